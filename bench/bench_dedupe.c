@@ -0,0 +1,191 @@
+/**
+ * bench_dedupe.c
+ *
+ * Measures the deduplicated data file format of server/datalog.c against
+ * the checksummed one on a producer that keeps sending the same few
+ * payloads: append rate and file size of each, and XXH64 throughput on its
+ * own, which is what a deduplicated append pays on top. XXH64 is checked
+ * against reference values first, and the deduplicated file is reopened
+ * (rehashing its bodies) and replayed from disk, references expanded,
+ * against the bytes appended.
+ *
+ * Usage: bench_dedupe [result-file [path]]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "datalog.h"
+#include "xxhash.h"
+#include "benchutil.h"
+
+#define DEFAULT_PATH "/var/tmp/aesdsocket-dedupe"
+#define HASH_BUFFER (4 * 1024 * 1024)
+#define HASH_TOTAL (256ull * 1024 * 1024)
+#define BODIES 32                  // Distinct payloads the producer sends
+#define MAX_BODY 4096
+#define APPENDS 10000
+
+static char bodies[BODIES][MAX_BODY];
+static size_t body_len[BODIES];
+static uint8_t sequence[APPENDS];  // Which body each append sends
+
+/**
+ * check_hash
+ * ----------
+ * Compares XXH64 with reference values, covering the short input path and
+ * the four-lane one.
+ *
+ * Returns:
+ *   The number of mismatches.
+ */
+static int check_hash(void) {
+    unsigned char seq[100];
+    for (int i = 0; i < 100; ++i) seq[i] = (unsigned char)i;
+    return (xxh64("", 0, 0) != 0xef46db3751d8e999ull) +
+           (xxh64("abc", 3, 0) != 0x44bc2cf5ad770999ull) +
+           (xxh64(seq, sizeof(seq), 0) != 0x6ac1e58032166597ull);
+}
+
+/**
+ * measure_hash
+ * ------------
+ * Hashes HASH_TOTAL bytes and writes the throughput to fp.
+ */
+static void measure_hash(FILE *fp) {
+    char *buf = malloc(HASH_BUFFER);
+    if (!buf) return;
+    for (size_t i = 0; i < HASH_BUFFER; ++i) buf[i] = (char)(i * 2654435761u >> 24);
+
+    uint64_t h = 0;
+    uint64_t start = bench_now_ns();
+    for (uint64_t done = 0; done < HASH_TOTAL; done += HASH_BUFFER)
+        h ^= xxh64(buf, HASH_BUFFER, h);
+    double secs = (bench_now_ns() - start) / 1e9;
+    fprintf(fp, "xxh64_mibps=%.1f\n", HASH_TOTAL / secs / (1024.0 * 1024.0));
+    fprintf(fp, "xxh64_result=%016llx\n", (unsigned long long)h);
+    free(buf);
+}
+
+/**
+ * measure_appends
+ * ---------------
+ * Appends the producer's APPENDS packets to a new file at path in the given
+ * format and writes the rate and file size under name to fp. The file is
+ * left behind.
+ *
+ * Returns:
+ *   The replay length, or -1 on failure.
+ */
+static off_t measure_appends(FILE *fp, const char *name, const char *path,
+                             enum log_format format) {
+    struct datalog log = DATALOG_INITIALIZER;
+    unlink(path);
+    if (datalog_open(&log, path, format, LOG_DEFAULT_CACHE) < 0) return -1;
+
+    off_t end = 0;
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < APPENDS && end >= 0; ++i)
+        end = datalog_append(&log, bodies[sequence[i]], body_len[sequence[i]]);
+    double secs = (bench_now_ns() - start) / 1e9;
+
+    fprintf(fp, "%s_ops=%.1f\n", name, APPENDS / secs);
+    fprintf(fp, "%s_file_bytes=%lld\n", name, (long long)log.size);
+    if (format == LOG_DEDUPLICATED) {
+        unsigned long hashed = atomic_load(&log.dedupe_hashed);
+        unsigned long hash_ns = atomic_load(&log.dedupe_hash_ns);
+        fprintf(fp, "%s_refs=%lu\n", name, atomic_load(&log.dedupe_refs));
+        fprintf(fp, "%s_saved_pct=%.1f\n", name,
+                100.0 * atomic_load(&log.dedupe_saved) / (log.payload ? log.payload : 1));
+        fprintf(fp, "%s_hash_pct=%.1f\n", name, 100.0 * hash_ns / 1e9 / secs);
+        fprintf(fp, "%s_hash_ns_per_kib=%.1f\n", name, hashed ? hash_ns * 1024.0 / hashed : 0.0);
+    }
+    datalog_close(&log);
+    return end;
+}
+
+/**
+ * check_replay
+ * ------------
+ * Reopens the deduplicated file at path without a replay cache, so every
+ * byte comes from disk, and replays it through a socket pair.
+ *
+ * Returns:
+ *   0 if the replay matched the packets appended, 1 otherwise.
+ */
+static int check_replay(const char *path, off_t len) {
+    struct datalog log = DATALOG_INITIALIZER;
+    if (datalog_open(&log, path, LOG_DEDUPLICATED, 0) < 0) return 1;
+    int sv[2];
+    if (log.payload != len || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        datalog_close(&log);
+        return 1;
+    }
+
+    // Drain in a child so the replay never blocks on a full socket
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        char buf[65536];
+        int i = 0;
+        size_t at = 0;             // Offset into the body of append i
+        int bad = 0;
+        ssize_t n;
+        while ((n = read(sv[1], buf, sizeof(buf))) > 0) {
+            for (ssize_t k = 0; k < n; ++k) {
+                if (i == APPENDS || buf[k] != bodies[sequence[i]][at]) bad++;
+                if (i < APPENDS && ++at == body_len[sequence[i]]) {
+                    i++;
+                    at = 0;
+                }
+            }
+        }
+        _exit(i == APPENDS && bad == 0 ? 0 : 1);
+    }
+    close(sv[1]);
+    struct bufchain chain = BUFCHAIN_INITIALIZER;
+    int rc = datalog_replay(&log, &chain, sv[0], len, "", 0);
+    bufchain_release(&chain);
+    close(sv[0]);
+    int status = 1;
+    if (pid > 0) waitpid(pid, &status, 0);
+    datalog_close(&log);
+    return rc < 0 || status != 0;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *fp = bench_open_result(argc, argv);
+    if (!fp) return 1;
+    const char *path = argc > 2 ? argv[2] : DEFAULT_PATH;
+
+    // Newline-terminated payloads of 64 bytes to 4 KiB, sent in random order
+    uint32_t rnd = 1;
+    for (int b = 0; b < BODIES; ++b) {
+        rnd = rnd * 1103515245u + 12345u;
+        body_len[b] = 64 + (rnd >> 8) % (MAX_BODY - 64);
+        for (size_t i = 0; i < body_len[b] - 1; ++i)
+            bodies[b][i] = (char)('a' + (b * 7 + i * 13) % 26);
+        bodies[b][body_len[b] - 1] = '\n';
+    }
+    for (int i = 0; i < APPENDS; ++i) {
+        rnd = rnd * 1103515245u + 12345u;
+        sequence[i] = (rnd >> 8) % BODIES;
+    }
+
+    int failures = check_hash();
+    measure_hash(fp);
+    off_t plain = measure_appends(fp, "checksummed", path, LOG_CHECKSUMMED);
+    off_t deduped = measure_appends(fp, "deduplicated", path, LOG_DEDUPLICATED);
+    if (plain < 0 || deduped != plain) failures++;
+    else failures += check_replay(path, deduped);
+    unlink(path);
+
+    fprintf(fp, "errors=%d\n", failures);
+    if (fp != stdout) fclose(fp);
+    return failures ? 2 : 0;
+}
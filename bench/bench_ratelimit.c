@@ -0,0 +1,152 @@
+/**
+ * bench_ratelimit.c
+ *
+ * Measures lookups in the per-address token bucket table of
+ * server/ratelimit.c with 1 thousand, 64 thousand and 1 million addresses
+ * tracked, which should all cost about the same, and admissions of ever
+ * new addresses into a full table, each evicting the least recently seen
+ * one. Bucket arithmetic and LRU eviction are checked first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+#include "benchutil.h"
+
+#define BATCH 4096
+#define LOOKUPS (1000 * BATCH)
+
+/**
+ * make_addr
+ * ---------
+ * Fills addr with the i-th test address: IPv4 in 10.0.0.0/8 for i below
+ * 2^24, IPv6 beyond.
+ */
+static void make_addr(struct sockaddr_storage *addr, uint32_t i) {
+    memset(addr, 0, sizeof(*addr));
+    if (i < (1u << 24)) {
+        struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+        in4->sin_family = AF_INET;
+        in4->sin_addr.s_addr = htonl(0x0a000000u | i);
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr.s6_addr[0] = 0xfd;
+        memcpy(&in6->sin6_addr.s6_addr[12], &i, sizeof(i));
+    }
+}
+
+/**
+ * check
+ * -----
+ * Exercises bucket refills and eviction on a small table.
+ *
+ * Returns:
+ *   The number of failed checks.
+ */
+static int check(void) {
+    struct ratelimit rl;
+    struct sockaddr_storage a, b;
+    int failures = 0;
+    if (ratelimit_init(&rl, 2, 1000, 4) < 0) return 1;
+
+    // A burst of two connections, then one more every half second
+    make_addr(&a, 1);
+    if (!ratelimit_connect(&rl, &a, 0) || !ratelimit_connect(&rl, &a, 0)) failures++;
+    if (ratelimit_connect(&rl, &a, 100)) failures++;
+    if (!ratelimit_connect(&rl, &a, 600)) failures++;
+
+    // 1500 bytes on a 1000-byte bucket: 500 in debt, half a second's wait
+    uint64_t wait = ratelimit_bytes(&rl, &a, 1500, 600);
+    if (wait < 500 || wait > 501) failures++;
+    if (ratelimit_bytes(&rl, &a, 0, 1200) != 0) failures++;
+
+    // Filling the table evicts the least recently seen address, not a
+    // recently refreshed one
+    for (uint32_t i = 2; i <= 4; ++i) {
+        make_addr(&b, i);
+        ratelimit_connect(&rl, &b, 1200);
+    }
+    ratelimit_connect(&rl, &a, 1200);
+    make_addr(&b, 5);
+    ratelimit_connect(&rl, &b, 1200);
+    unsigned long evictions;
+    if (ratelimit_stats(&rl, &evictions) != 4 || evictions != 1) failures++;
+    // a kept its drained bucket; 2 was evicted and starts over full
+    if (ratelimit_connect(&rl, &a, 1200) && ratelimit_connect(&rl, &a, 1200) &&
+        ratelimit_connect(&rl, &a, 1200))
+        failures++;
+    make_addr(&b, 2);
+    if (!ratelimit_connect(&rl, &b, 1200) || !ratelimit_connect(&rl, &b, 1200)) failures++;
+
+    ratelimit_free(&rl);
+    return failures;
+}
+
+/**
+ * measure
+ * -------
+ * Tracks n addresses, then times LOOKUPS admissions of random ones among
+ * them (fresh is 0), or of addresses never seen before (fresh is 1), and
+ * writes the rate under name to fp.
+ *
+ * Returns:
+ *   The number of failed checks.
+ */
+static int measure(FILE *fp, const char *name, uint32_t n, int fresh) {
+    struct ratelimit rl;
+    struct sockaddr_storage *addrs = malloc(sizeof(*addrs) * BATCH);
+    if (!addrs || ratelimit_init(&rl, 1e9, 0, n) < 0) {
+        free(addrs);
+        return 1;
+    }
+    struct sockaddr_storage addr;
+    for (uint32_t i = 0; i < n; ++i) {
+        make_addr(&addr, i);
+        ratelimit_connect(&rl, &addr, 0);
+    }
+
+    // Precomputed addresses keep their setup out of the timing
+    uint32_t x = 2463534242u, next = n;
+    int failures = 0;
+    uint64_t start = bench_now_ns();
+    for (uint32_t done = 0; done < LOOKUPS; done += BATCH) {
+        uint64_t pause = bench_now_ns();
+        for (int k = 0; k < BATCH; ++k) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            make_addr(&addrs[k], fresh ? next++ : x % n);
+        }
+        start += bench_now_ns() - pause;
+        for (int k = 0; k < BATCH; ++k)
+            if (!ratelimit_connect(&rl, &addrs[k], 1)) failures++;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    unsigned long evictions;
+    if (ratelimit_stats(&rl, &evictions) != n) failures++;
+    if (evictions != (fresh ? LOOKUPS : 0)) failures++;
+    fprintf(fp, "%s_ops=%.1f\n", name, LOOKUPS / (elapsed / 1e9));
+    ratelimit_free(&rl);
+    free(addrs);
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *fp = bench_open_result(argc, argv);
+    if (!fp) return 1;
+
+    int failures = check();
+    failures += measure(fp, "ratelimit_1k", 1000, 0);
+    failures += measure(fp, "ratelimit_64k", 64000, 0);
+    failures += measure(fp, "ratelimit_1m", 1000000, 0);
+    failures += measure(fp, "ratelimit_evict_1m", 1000000, 1);
+
+    fprintf(fp, "errors=%d\n", failures);
+    if (fp != stdout) fclose(fp);
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,178 @@
+/**
+ * bench_recovery.c
+ *
+ * Measures how long server/datalog.c takes to open an existing checksummed
+ * data file: validating every record, rebuilding the offset index and
+ * loading the replay cache. The file is written first with records of
+ * 64 bytes to 8 KiB, then recovered from the page cache with one scan
+ * thread per CPU and with four, and once more after evicting the file from
+ * the page cache with POSIX_FADV_DONTNEED.
+ *
+ * Usage: bench_recovery [result-file [size-mib [path]]]
+ * The size defaults to 256 MiB; AESD_RECOVERY_MIB overrides it as well, e.g.
+ * AESD_RECOVERY_MIB=10240 for the 10 GiB figure. A replay through the cache
+ * and one through the index are checked against the data written.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "datalog.h"
+#include "benchutil.h"
+
+#define DEFAULT_MIB 256
+#define DEFAULT_PATH "/var/tmp/aesdsocket-recovery"
+#define MAX_RECORD 8192
+
+/**
+ * record_byte
+ * -----------
+ * Contents of the data file at payload offset pos, so replays can be checked
+ * without keeping a copy.
+ */
+static char record_byte(uint64_t pos) {
+    return (char)('a' + (pos * 2654435761u >> 13) % 26);
+}
+
+/**
+ * generate
+ * --------
+ * Writes a checksummed data file of at least mib MiB to path.
+ *
+ * Returns:
+ *   Record bytes written, or -1 on failure.
+ */
+static off_t generate(const char *path, uint64_t mib) {
+    struct datalog log = DATALOG_INITIALIZER;
+    unlink(path);
+    if (datalog_open(&log, path, LOG_CHECKSUMMED, 0) < 0) return -1;
+
+    char *buf = malloc(MAX_RECORD);
+    off_t end = 0;
+    uint32_t rnd = 1;
+    while (buf && end >= 0 && (uint64_t)log.size < mib * 1024 * 1024) {
+        rnd = rnd * 1103515245u + 12345u;
+        size_t len = 64 + (rnd >> 8) % (MAX_RECORD - 64);
+        for (size_t i = 0; i < len; ++i) buf[i] = record_byte(log.payload + i);
+        end = datalog_append(&log, buf, len);
+    }
+    free(buf);
+    datalog_close(&log);
+    return end;
+}
+
+/**
+ * check_replay
+ * ------------
+ * Replays the first len record bytes through a socket pair and compares
+ * them with what was written.
+ *
+ * Returns:
+ *   0 if the reply matched, 1 otherwise.
+ */
+static int check_replay(struct datalog *log, off_t len) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return 1;
+
+    // Drain in a child so the replay never blocks on a full socket
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        char buf[65536];
+        off_t got = 0;
+        int bad = 0;
+        ssize_t n;
+        while ((n = read(sv[1], buf, sizeof(buf))) > 0) {
+            for (ssize_t i = 0; i < n; ++i)
+                if (buf[i] != record_byte(got + i)) bad++;
+            got += n;
+        }
+        _exit(got == len && bad == 0 ? 0 : 1);
+    }
+    close(sv[1]);
+    struct bufchain chain = BUFCHAIN_INITIALIZER;
+    int rc = datalog_replay(log, &chain, sv[0], len, "", 0);
+    bufchain_release(&chain);
+    close(sv[0]);
+    int status = 1;
+    if (pid > 0) waitpid(pid, &status, 0);
+    return rc < 0 || status != 0;
+}
+
+/**
+ * measure
+ * -------
+ * Recovers the file at path with the given number of scan threads (0: one
+ * per CPU), writing its timings under name to fp.
+ *
+ * Returns:
+ *   The number of errors found.
+ */
+static int measure(FILE *fp, const char *name, const char *path, off_t payload,
+                   unsigned threads) {
+    struct datalog log = DATALOG_INITIALIZER;
+    log.scan_threads = threads;
+    uint64_t start = bench_now_ns();
+    if (datalog_open(&log, path, LOG_RAW, LOG_DEFAULT_CACHE) < 0) return 1;
+    uint64_t elapsed = bench_now_ns() - start;
+
+    double secs = elapsed / 1e9;
+    double mib = log.size / (1024.0 * 1024.0);
+    fprintf(fp, "%s_ms=%.1f\n", name, secs * 1000.0);
+    fprintf(fp, "%s_mibps=%.1f\n", name, mib / secs);
+    fprintf(fp, "%s_gib_ms=%.1f\n", name, secs * 1000.0 * 1024.0 / mib);
+    fprintf(fp, "%s_threads=%u\n", name, log.scan_threads);
+
+    int errors = log.payload != payload;
+    if (!errors) {
+        // One replay served from the cache, one that has to go to the file
+        off_t small = payload < 100000 ? payload : 100000;
+        errors += check_replay(&log, small);
+        off_t big = payload < LOG_DEFAULT_CACHE + 4 * LOG_INDEX_STRIDE ?
+                    payload : LOG_DEFAULT_CACHE + 4 * LOG_INDEX_STRIDE;
+        errors += check_replay(&log, big);
+    }
+    datalog_close(&log);
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *fp = bench_open_result(argc, argv);
+    if (!fp) return 1;
+    uint64_t mib = argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_MIB;
+    if (getenv("AESD_RECOVERY_MIB")) mib = strtoull(getenv("AESD_RECOVERY_MIB"), NULL, 10);
+    const char *path = argc > 3 ? argv[3] : DEFAULT_PATH;
+
+    uint64_t start = bench_now_ns();
+    off_t payload = generate(path, mib);
+    if (payload < 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return 1;
+    }
+    uint64_t written = bench_now_ns() - start;
+
+    int errors = measure(fp, "recovery_warm", path, payload, 0);
+    errors += measure(fp, "recovery_4t", path, payload, 4);
+
+    // Evict the file so the second run has to read it from the device
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    errors += measure(fp, "recovery_cold", path, payload, 0);
+
+    fprintf(fp, "recovery_file_mib=%llu\n", (unsigned long long)mib);
+    fprintf(fp, "recovery_write_ms=%.1f\n", written / 1e6);
+    fprintf(fp, "errors=%d\n", errors);
+    if (fp != stdout) fclose(fp);
+    unlink(path);
+    return errors ? 2 : 0;
+}
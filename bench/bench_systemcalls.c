@@ -0,0 +1,54 @@
+/**
+ * bench_systemcalls.c
+ *
+ * Measures the cost of the process-spawning helpers in
+ * examples/systemcalls: do_system(), do_exec() and do_exec_redirect().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "systemcalls.h"
+#include "benchutil.h"
+
+#define ITERATIONS 200
+#define REDIRECT_FILE "/tmp/bench_systemcalls.out"
+
+int main(int argc, char *argv[]) {
+    FILE *fp = bench_open_result(argc, argv);
+    if (!fp) return 1;
+
+    uint64_t *samples = malloc(ITERATIONS * sizeof(uint64_t));
+    if (!samples) return 1;
+    int failures = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        uint64_t t = bench_now_ns();
+        if (!do_system("true")) failures++;
+        samples[i] = bench_now_ns() - t;
+    }
+    bench_report(fp, "do_system", samples, ITERATIONS, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        uint64_t t = bench_now_ns();
+        if (!do_exec(1, "/bin/true")) failures++;
+        samples[i] = bench_now_ns() - t;
+    }
+    bench_report(fp, "do_exec", samples, ITERATIONS, bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        uint64_t t = bench_now_ns();
+        if (!do_exec_redirect(REDIRECT_FILE, 2, "/bin/echo", "bench")) failures++;
+        samples[i] = bench_now_ns() - t;
+    }
+    bench_report(fp, "do_exec_redirect", samples, ITERATIONS, bench_now_ns() - start);
+    unlink(REDIRECT_FILE);
+
+    fprintf(fp, "errors=%d\n", failures);
+    if (fp != stdout) fclose(fp);
+    free(samples);
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * bench_threading.c
+ *
+ * Measures thread start/join cost through start_thread_obtaining_mutex()
+ * from examples/threading, both uncontended and with every thread sharing
+ * one mutex.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "threading.h"
+#include "benchutil.h"
+
+#define ITERATIONS 2000
+#define BATCH 8
+
+int main(int argc, char *argv[]) {
+    FILE *fp = bench_open_result(argc, argv);
+    if (!fp) return 1;
+
+    uint64_t *samples = malloc(ITERATIONS * sizeof(uint64_t));
+    if (!samples) return 1;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    int failures = 0;
+
+    // One thread at a time: start, let it take the mutex, join
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        pthread_t thread;
+        void *ret = NULL;
+        uint64_t t = bench_now_ns();
+        if (!start_thread_obtaining_mutex(&thread, &mutex, 0, 0)) {
+            failures++;
+            samples[i] = 0;
+            continue;
+        }
+        pthread_join(thread, &ret);
+        samples[i] = bench_now_ns() - t;
+        if (!ret || !((struct thread_data *)ret)->thread_complete_success) failures++;
+        free(ret);
+    }
+    bench_report(fp, "thread_start_join", samples, ITERATIONS, bench_now_ns() - start);
+
+    // Batches of threads contending for the same mutex
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS / BATCH; ++i) {
+        pthread_t threads[BATCH];
+        int started = 0;
+        uint64_t t = bench_now_ns();
+        for (int j = 0; j < BATCH; ++j) {
+            if (start_thread_obtaining_mutex(&threads[started], &mutex, 0, 0))
+                started++;
+            else
+                failures++;
+        }
+        for (int j = 0; j < started; ++j) {
+            void *ret = NULL;
+            pthread_join(threads[j], &ret);
+            if (!ret || !((struct thread_data *)ret)->thread_complete_success) failures++;
+            free(ret);
+        }
+        samples[i] = bench_now_ns() - t;
+    }
+    bench_report(fp, "thread_batch8", samples, ITERATIONS / BATCH, bench_now_ns() - start);
+
+    fprintf(fp, "errors=%d\n", failures);
+    if (fp != stdout) fclose(fp);
+    free(samples);
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,57 @@
+/**
+ * benchutil.h
+ *
+ * Small helpers shared by the micro-benchmarks: a monotonic clock,
+ * percentile calculation, and key=value result output in the same format
+ * aesdload writes, so perf-gate.sh can compare any of them to a baseline.
+ */
+
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline int bench_cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * bench_report
+ * ------------
+ * Sorts the per-operation samples (in nanoseconds) and writes throughput and
+ * p50/p99 latency for one operation, prefixed by name, to fp.
+ */
+static inline void bench_report(FILE *fp, const char *name, uint64_t *samples,
+                                size_t n, uint64_t elapsed_ns) {
+    qsort(samples, n, sizeof(uint64_t), bench_cmp_u64);
+    size_t i50 = n / 2, i99 = (size_t)(n * 0.99);
+    if (i99 >= n) i99 = n - 1;
+
+    fprintf(fp, "%s_ops=%.1f\n", name, n / (elapsed_ns / 1e9));
+    fprintf(fp, "%s_p50_us=%.1f\n", name, samples[i50] / 1000.0);
+    fprintf(fp, "%s_p99_us=%.1f\n", name, samples[i99] / 1000.0);
+}
+
+/**
+ * bench_open_result
+ * -----------------
+ * Opens the result file named on the command line, or stdout without one.
+ */
+static inline FILE *bench_open_result(int argc, char *argv[]) {
+    if (argc < 2) return stdout;
+    FILE *fp = fopen(argv[1], "w");
+    if (!fp) perror(argv[1]);
+    return fp;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#!/bin/sh
+# Runs one benchmark and compares its key=value results to a stored baseline.
+#
+# Usage: perf-gate.sh <baseline-file> <result-file> <command> [args...]
+#
+# The command must write its results to <result-file>. Every key present in
+# the baseline is checked: throughput and hit count keys (*_ops, *_pps,
+# *_mibps, *_hits) may not drop, and latency, volume, loss and error keys
+# (*_us, *_ms, *_bytes, *_lost, errors) may not grow, by more than
+# AESD_PERF_THRESHOLD percent (default 30). Tail latencies (*_p99_*) swing
+# far more from run to run on a shared host than medians do, and are only
+# held to AESD_PERF_TAIL_THRESHOLD percent (default 100). AESD_PERF_SLACK_US
+# (default 0) lets *_us and *_ms keys also grow by that many microseconds,
+# for timings of a few milliseconds where scheduling jitter alone exceeds
+# any percentage.
+# With AESD_PERF_UPDATE=1 the baseline is written from the new results
+# instead. A missing baseline fails the gate rather than passing it, so
+# a new benchmark has to have its baseline recorded on purpose.
+
+set -e
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 <baseline-file> <result-file> <command> [args...]"
+    exit 1
+fi
+
+baseline=$1
+result=$2
+shift 2
+threshold=${AESD_PERF_THRESHOLD:-30}
+tail_threshold=${AESD_PERF_TAIL_THRESHOLD:-100}
+slack_us=${AESD_PERF_SLACK_US:-0}
+
+rm -f "$result"
+"$@"
+
+if [ ! -f "$result" ]; then
+    echo "Benchmark did not write $result"
+    exit 1
+fi
+
+if [ "${AESD_PERF_UPDATE:-0}" = "1" ]; then
+    # p999 tails are too noisy on a shared host to gate on
+    grep -E '^(errors|[a-z0-9_]+_(ops|pps|mibps|hits|us|ms|bytes|lost))=' "$result" |
+        grep -v '_p999_' > "$baseline"
+    echo "Baseline $baseline updated"
+    exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+    echo "No baseline $baseline; rerun with AESD_PERF_UPDATE=1 to record one"
+    exit 1
+fi
+
+awk -F= -v threshold="$threshold" -v tail_threshold="$tail_threshold" \
+    -v slack_us="$slack_us" '
+    NR == FNR { base[$1] = $2; next }
+    { cur[$1] = $2 }
+    END {
+        failed = 0
+        for (key in base) {
+            if (!(key in cur)) {
+                printf "MISSING %s (baseline %s)\n", key, base[key]
+                failed = 1
+                continue
+            }
+            higher_better = (key ~ /_(ops|pps|mibps|hits)$/)
+            allowed = (key ~ /_p99_/) ? tail_threshold : threshold
+            if (higher_better) {
+                limit = base[key] * (1 - allowed / 100)
+                bad = cur[key] < limit
+            } else {
+                limit = base[key] * (1 + allowed / 100)
+                slack = (key ~ /_us$/) ? slack_us : (key ~ /_ms$/) ? slack_us / 1000 : 0
+                if (limit < base[key] + slack) limit = base[key] + slack
+                bad = cur[key] > limit
+            }
+            printf "%-6s %-28s %14s (baseline %s, limit %.1f)\n",
+                   bad ? "FAIL" : "ok", key, cur[key], base[key], limit
+            if (bad) failed = 1
+        }
+        exit failed
+    }
+' "$baseline" "$result"
@@ -0,0 +1,71 @@
+/**
+ * activation.c
+ *
+ * Inherits pre-bound listeners from a service manager and reports
+ * readiness to it. See activation.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "activation.h"
+
+int activation_listen_fds(int *fds, int max) {
+    const char *pid_env = getenv("LISTEN_PID");
+    const char *fds_env = getenv("LISTEN_FDS");
+    int count = 0;
+
+    if (pid_env && fds_env && strtol(pid_env, NULL, 10) == getpid()) {
+        int n = atoi(fds_env);
+        for (int fd = ACTIVATION_FDS_START; fd < ACTIVATION_FDS_START + n; ++fd) {
+            // Only listening stream sockets are usable; leave anything else alone
+            int listening = 0, type = 0;
+            socklen_t len = sizeof(int);
+            if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+                continue;
+            len = sizeof(int);
+            if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM)
+                continue;
+            if (count == max) break;
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds[count++] = fd;
+        }
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return count;
+}
+
+int activation_notify(const char *state) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (!path || !*path) return 0;
+
+    struct sockaddr_un addr;
+    size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') addr.sun_path[0] = '\0';   // Abstract namespace
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    ssize_t n = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+                       offsetof(struct sockaddr_un, sun_path) + len);
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
@@ -0,0 +1,28 @@
+/**
+ * activation.h
+ *
+ * Socket activation and readiness notification, compatible with systemd's
+ * LISTEN_FDS/LISTEN_PID and NOTIFY_SOCKET protocols, without linking
+ * libsystemd.
+ */
+
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+#define ACTIVATION_FDS_START 3   // First inherited descriptor (SD_LISTEN_FDS_START)
+
+/**
+ * Collects up to max listening sockets passed in by a service manager.
+ * The variables are only honoured when LISTEN_PID names this process, and
+ * are removed from the environment so children do not inherit them.
+ * Returns the number of descriptors stored in fds.
+ */
+int activation_listen_fds(int *fds, int max);
+
+/**
+ * Sends a state string such as "READY=1" to NOTIFY_SOCKET, if set.
+ * Returns 0 on success or when no notification socket is configured.
+ */
+int activation_notify(const char *state);
+
+#endif
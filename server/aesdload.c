@@ -0,0 +1,962 @@
+/**
+ * aesdload.c
+ *
+ * Load generator for aesdsocket:
+ * - Opens N concurrent TCP connections to the server (localhost:9000 by
+ *   default), or connections to its Unix domain socket.
+ * - Sends newline-terminated packets of a configurable size, either in
+ *   closed-loop mode (send, wait for the replay, repeat) or open-loop mode
+ *   (send on a fixed schedule regardless of outstanding replays).
+ * - Optionally negotiates length-prefixed framing or batch acknowledgement
+ *   (framing.h) instead of newline framing, and sends packets in bursts.
+ * - Optionally spreads the connections over several named channels.
+ * - Optionally opens a fresh connection for every packet to measure
+ *   connection churn and refused connections, or in churn mode opens and
+ *   closes connections without sending anything at all.
+ * - In slowloris mode, holds connections open on a packet that never ends,
+ *   trickling it out or not at all, and measures how long the server takes
+ *   to close them.
+ * - Validates every replay against the accumulated file: each replay must end
+ *   with the packet that triggered it and must extend the previous replay.
+ *   Framed replays must also split back into exactly the records sent.
+ * - Reports throughput and p50/p99/p999 latency, and optionally writes the
+ *   results as key=value lines so they can be tracked across builds.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "framing.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define RECV_CHUNK 65536
+#define MAX_REFUSED 100000  // Give up on a reconnecting client after this many
+#define SLOWLORIS_WAIT_NS (120 * 1000000000ull)    // Count a connection never closed as an error
+#define REPLY_STALL_MS 60000  // Give up on replies after this long without any data
+#define FRAMED_NEWLINE_EVERY 61  // Framed records hold a newline this many bytes apart
+
+enum load_mode { MODE_CLOSED, MODE_OPEN, MODE_CHURN, MODE_SLOWLORIS };
+
+// Run configuration, filled in from the command line
+struct load_config {
+    const char *host;
+    const char *port;
+    const char *unix_path;  // Connect to this Unix socket instead of host:port
+    unsigned nconns;        // Concurrent connections
+    unsigned npackets;      // Packets sent per connection
+    size_t pktsize;         // Bytes per packet, including the newline
+    double rate;            // Packets per second per connection (0 = unthrottled)
+    enum load_mode mode;
+    bool validate;
+    bool reconnect;         // New connection for every packet (closed loop only)
+    bool framed;            // Varint length-prefixed records instead of newlines
+    bool batch;             // One acknowledged replay per server receive
+    unsigned burst;         // Packets per send
+    unsigned channels;      // Connection i uses channel "ch<i % channels>"; 0: none
+    unsigned wait_secs;     // How long to retry the initial connect
+    const char *result_path;
+};
+
+// Per-connection state and statistics
+struct load_conn {
+    unsigned id;
+    int fd;
+    uint64_t connected_ns;  // When the initial connection was made
+    const struct load_config *cfg;
+
+    char *pkt;              // Packet currently being built for sending
+    char *wire;             // Bytes of the burst being sent, framing included
+    char *expect;           // Packet whose replay we are waiting for
+    char *line;             // Current line of the replay being received
+    size_t linelen;
+    bool line_overflow;
+    char frame_hdr[VARINT_MAX_LEN];   // Framed: record count or length being received
+    size_t frame_hdrlen;
+    uint64_t frame_records; // Framed: records of the current replay still to come
+    bool frame_body;        // Framed: receiving a record's bytes, not its length
+    uint64_t frame_len;     // Framed: length of the record being received
+    uint64_t frame_left;    // Framed: record bytes, batch: replay bytes still to come
+    char ack_line[BATCH_ACK_MAX];     // Batch: "#ack" line being received
+    size_t ack_len;
+    uint64_t ack_last;      // Batch: last packet covered by the current replay
+
+    uint64_t *sched_ns;     // Intended send time of each packet
+    uint64_t *lat_ns;       // Latency of each completed replay
+    unsigned sent;
+    unsigned replies;
+
+    // Replay validation: each replay must start with the previous replay
+    size_t reply_pos;
+    uint64_t reply_hash;
+    size_t prev_len;
+    uint64_t prev_hash;
+    bool prefix_checked;
+
+    uint64_t reply_bytes;
+    uint64_t wire_bytes;    // Everything received, protocol headers included
+    uint64_t acks;          // Replays received
+    uint64_t refused;       // Failed connection attempts in reconnect mode
+    uint64_t errors;
+};
+
+static pthread_barrier_t start_barrier;
+static uint64_t run_start_ns;
+static unsigned run_nonce;
+
+/**
+ * now_ns
+ * ------
+ * Returns the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * fnv1a
+ * -----
+ * Extends a 64-bit FNV-1a hash over len bytes.
+ */
+static uint64_t fnv1a(uint64_t h, const char *buf, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)buf[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+
+/**
+ * build_packet
+ * ------------
+ * Fills buf with packet seq of connection id. Every packet is unique within
+ * the run so its line can be found again in the replay. Framed records
+ * carry newlines inside them as well, which only the record boundaries of
+ * the replay can tell apart from their ends.
+ */
+static void build_packet(char *buf, const struct load_config *cfg, unsigned id, unsigned seq) {
+    size_t pktsize = cfg->pktsize;
+    int taglen = snprintf(buf, pktsize, "L%uc%us%u ", run_nonce, id, seq);
+    memset(buf + taglen, 'x', pktsize - 1 - taglen);
+    if (cfg->framed) {
+        for (size_t i = taglen + FRAMED_NEWLINE_EVERY; i < pktsize - 1; i += FRAMED_NEWLINE_EVERY)
+            buf[i] = '\n';
+    }
+    buf[pktsize - 1] = '\n';
+}
+
+/**
+ * connect_server
+ * --------------
+ * Connects to host:port (or the Unix socket) for connection id, retrying
+ * for up to wait_secs seconds so the load generator can be started right
+ * after the server. With wait_secs 0 a single attempt is made and failures
+ * are not reported.
+ *
+ * Returns:
+ *   Socket descriptor on success, -1 on failure.
+ */
+static int connect_server(const struct load_config *cfg, unsigned id, unsigned wait_secs) {
+    struct addrinfo hints, *res;
+    struct sockaddr_un sun;
+    struct addrinfo local = { .ai_family = AF_UNIX, .ai_socktype = SOCK_STREAM };
+
+    if (cfg->unix_path) {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, cfg->unix_path, sizeof(sun.sun_path) - 1);
+        local.ai_addr = (struct sockaddr *)&sun;
+        local.ai_addrlen = sizeof(sun);
+        res = &local;
+    } else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int rc = getaddrinfo(cfg->host, cfg->port, &hints, &res);
+        if (rc != 0) {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+            return -1;
+        }
+    }
+
+    uint64_t deadline = now_ns() + (uint64_t)wait_secs * 1000000000ull;
+    int fd = -1;
+    for (;;) {
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd < 0) break;
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+        if (now_ns() >= deadline) break;
+        struct timespec backoff = { 0, 50000000 };
+        nanosleep(&backoff, NULL);
+    }
+    if (res != &local) freeaddrinfo(res);
+
+    if (fd < 0) {
+        if (wait_secs > 0) perror("connect");
+        return -1;
+    }
+
+    int one = 1;
+    if (!cfg->unix_path) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Channel first, then framing, in a single send
+    char preamble[2 * FRAMED_PREAMBLE_LEN + CHANNEL_NAME_MAX + 1];
+    size_t len = 0;
+    if (cfg->channels > 0) {
+        memcpy(preamble, CHANNEL_PREAMBLE, FRAMED_PREAMBLE_LEN);
+        len = FRAMED_PREAMBLE_LEN;
+        len += snprintf(preamble + len, CHANNEL_NAME_MAX + 1, "ch%u\n", id % cfg->channels);
+    }
+    const char *framing = cfg->framed ? FRAMED_PREAMBLE : cfg->batch ? BATCH_PREAMBLE : NULL;
+    if (framing) {
+        memcpy(preamble + len, framing, FRAMED_PREAMBLE_LEN);
+        len += FRAMED_PREAMBLE_LEN;
+    }
+    if (len > 0 && send(fd, preamble, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * send_all
+ * --------
+ * Sends len bytes, looping over short writes.
+ */
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * complete_reply
+ * --------------
+ * Called when the line of the packet we are waiting for has been received.
+ * Checks the replay length, records its latency, and resets for the next one.
+ */
+static void complete_reply(struct load_conn *c) {
+    const struct load_config *cfg = c->cfg;
+    uint64_t now = now_ns();
+
+    if (cfg->validate && c->replies > 0) {
+        // The replay must hold everything from the previous one plus our packet
+        if (c->reply_pos < c->prev_len + cfg->pktsize || !c->prefix_checked) {
+            c->errors++;
+        } else if (cfg->nconns == 1 && c->reply_pos != c->prev_len + cfg->pktsize) {
+            // With a single producer the file grows by exactly one packet
+            c->errors++;
+        }
+    }
+
+    c->lat_ns[c->replies] = now - c->sched_ns[c->replies];
+    c->replies++;
+    c->acks++;
+    c->reply_bytes += c->reply_pos;
+
+    c->prev_len = c->reply_pos;
+    c->prev_hash = c->reply_hash;
+    c->reply_pos = 0;
+    c->reply_hash = FNV_OFFSET;
+    c->prefix_checked = false;
+
+    build_packet(c->expect, cfg, c->id, c->replies);
+}
+
+/**
+ * hash_reply
+ * ----------
+ * Extends the hash of the current replay by part bytes, checking it against
+ * the previous replay once exactly that many bytes have been hashed.
+ */
+static void hash_reply(struct load_conn *c, const char *buf, size_t part) {
+    // Snapshot the hash exactly at the previous replay's length
+    if (!c->prefix_checked && c->reply_pos + part >= c->prev_len) {
+        size_t upto = c->prev_len - c->reply_pos;
+        c->reply_hash = fnv1a(c->reply_hash, buf, upto);
+        if (c->reply_hash != c->prev_hash) c->errors++;
+        c->prefix_checked = true;
+        c->reply_hash = fnv1a(c->reply_hash, buf + upto, part - upto);
+    } else {
+        c->reply_hash = fnv1a(c->reply_hash, buf, part);
+    }
+}
+
+/**
+ * consume_reply
+ * -------------
+ * Feeds received bytes through the replay parser. Replays are delimited by
+ * the line of the packet that triggered them.
+ */
+static void consume_reply(struct load_conn *c, const char *buf, size_t len) {
+    const struct load_config *cfg = c->cfg;
+
+    while (len > 0) {
+        // Bytes up to and including the next newline belong to the current line
+        const char *nl = memchr(buf, '\n', len);
+        size_t seg = nl ? (size_t)(nl - buf) + 1 : len;
+
+        if (cfg->validate) hash_reply(c, buf, seg);
+        c->reply_pos += seg;
+
+        if (!c->line_overflow) {
+            if (c->linelen + seg <= cfg->pktsize) {
+                memcpy(c->line + c->linelen, buf, seg);
+                c->linelen += seg;
+            } else {
+                c->line_overflow = true;
+            }
+        }
+
+        if (nl) {
+            bool match = !c->line_overflow && c->linelen == cfg->pktsize &&
+                         c->replies < c->sent &&
+                         memcmp(c->line, c->expect, cfg->pktsize) == 0;
+            c->linelen = 0;
+            c->line_overflow = false;
+            if (match) complete_reply(c);
+        }
+
+        buf += seg;
+        len -= seg;
+    }
+}
+
+/**
+ * end_framed_record
+ * -----------------
+ * Called at the end of each record of a framed replay, whose first bytes
+ * are in c->line. Every record this run sent is one packet, so one that
+ * starts with the run's tag but has any other length has a boundary in the
+ * wrong place. The last record of a replay must be the packet that
+ * triggered it.
+ */
+static void end_framed_record(struct load_conn *c) {
+    const struct load_config *cfg = c->cfg;
+    bool whole = c->frame_len == cfg->pktsize;
+
+    if (cfg->validate && !whole) {
+        char tag[16];
+        int taglen = snprintf(tag, sizeof(tag), "L%uc", run_nonce);
+        if (c->linelen >= (size_t)taglen && memcmp(c->line, tag, taglen) == 0) c->errors++;
+    }
+    if (--c->frame_records == 0) {
+        if (whole && c->replies < c->sent && memcmp(c->line, c->expect, cfg->pktsize) == 0)
+            complete_reply(c);
+        else
+            c->errors++;
+    }
+    c->frame_body = false;
+    c->linelen = 0;
+}
+
+/**
+ * consume_framed
+ * --------------
+ * Parses framed replays: a varint record count, then every record as a
+ * varint length and its bytes. The record bytes run together are the replay
+ * that complete_reply() validates.
+ */
+static void consume_framed(struct load_conn *c, const char *buf, size_t len) {
+    const struct load_config *cfg = c->cfg;
+
+    while (len > 0) {
+        if (!c->frame_body) {
+            c->frame_hdr[c->frame_hdrlen++] = *buf++;
+            len--;
+            uint64_t value;
+            int hdr = varint_decode(c->frame_hdr, c->frame_hdrlen, &value);
+            if (hdr == 0) continue;
+            c->frame_hdrlen = 0;
+            if (hdr < 0) {
+                c->errors++;
+            } else if (c->frame_records == 0) {
+                // Start of a replay, which holds at least our own record
+                if (value == 0) c->errors++;
+                c->frame_records = value;
+            } else {
+                c->frame_left = c->frame_len = value;
+                c->frame_body = true;
+                if (value == 0) end_framed_record(c);
+            }
+            continue;
+        }
+
+        size_t seg = len < c->frame_left ? len : (size_t)c->frame_left;
+        if (cfg->validate) hash_reply(c, buf, seg);
+        c->reply_pos += seg;
+        if (c->linelen < cfg->pktsize) {
+            // Only the start of a record is of interest
+            size_t keep = seg < cfg->pktsize - c->linelen ? seg : cfg->pktsize - c->linelen;
+            memcpy(c->line + c->linelen, buf, keep);
+            c->linelen += keep;
+        }
+        c->frame_left -= seg;
+        if (c->frame_left == 0) end_framed_record(c);
+        buf += seg;
+        len -= seg;
+    }
+}
+
+/**
+ * complete_batch
+ * --------------
+ * Called at the end of a batch replay: checks that it ends with the last
+ * packet it acknowledges and holds all of them, and records the latency of
+ * every packet it covers.
+ */
+static void complete_batch(struct load_conn *c) {
+    const struct load_config *cfg = c->cfg;
+    uint64_t now = now_ns();
+    uint64_t count = c->ack_last - c->replies;
+
+    if (cfg->validate) {
+        build_packet(c->expect, cfg, c->id, c->ack_last - 1);
+        if (c->reply_pos < cfg->pktsize || memcmp(c->line, c->expect, cfg->pktsize) != 0) {
+            c->errors++;
+        } else if (c->replies == 0) {
+            // The first replay may include data left by earlier runs
+        } else if (c->reply_pos < c->prev_len + count * cfg->pktsize || !c->prefix_checked) {
+            c->errors++;
+        } else if (cfg->nconns == 1 && c->reply_pos != c->prev_len + count * cfg->pktsize) {
+            c->errors++;
+        }
+    }
+
+    while (c->replies < c->ack_last) {
+        c->lat_ns[c->replies] = now - c->sched_ns[c->replies];
+        c->replies++;
+    }
+    c->acks++;
+    c->reply_bytes += c->reply_pos;
+
+    c->prev_len = c->reply_pos;
+    c->prev_hash = c->reply_hash;
+    c->reply_pos = 0;
+    c->reply_hash = FNV_OFFSET;
+    c->prefix_checked = false;
+}
+
+/**
+ * consume_batch
+ * -------------
+ * Parses batch-mode replays: an "#ack first last bytes" line followed by
+ * the replay itself. The last packet's worth of each replay is kept in
+ * c->line for complete_batch().
+ */
+static void consume_batch(struct load_conn *c, const char *buf, size_t len) {
+    const struct load_config *cfg = c->cfg;
+
+    while (len > 0) {
+        if (c->frame_left == 0) {
+            char ch = *buf++;
+            len--;
+            if (c->ack_len < sizeof(c->ack_line) - 1) c->ack_line[c->ack_len++] = ch;
+            if (ch != '\n') continue;
+            c->ack_line[c->ack_len] = '\0';
+            c->ack_len = 0;
+
+            unsigned long long first, last, bytes;
+            if (sscanf(c->ack_line, "#ack %llu %llu %llu", &first, &last, &bytes) != 3 ||
+                first != c->replies + 1ull || last < first || last > c->sent || bytes == 0) {
+                c->errors++;
+                continue;
+            }
+            c->ack_last = last;
+            c->frame_left = bytes;
+            continue;
+        }
+
+        size_t seg = len < c->frame_left ? len : (size_t)c->frame_left;
+        if (cfg->validate) {
+            hash_reply(c, buf, seg);
+            uint64_t total = c->reply_pos + c->frame_left;
+            uint64_t tail = total > cfg->pktsize ? total - cfg->pktsize : 0;
+            uint64_t from = c->reply_pos > tail ? c->reply_pos : tail;
+            if (from < c->reply_pos + seg)
+                memcpy(c->line + (from - tail), buf + (from - c->reply_pos),
+                       c->reply_pos + seg - from);
+        }
+        c->reply_pos += seg;
+        c->frame_left -= seg;
+        if (c->frame_left == 0) complete_batch(c);
+        buf += seg;
+        len -= seg;
+    }
+}
+
+/**
+ * run_churn
+ * ---------
+ * Churn mode: every "packet" is a short-lived connection of its own that
+ * sends nothing. The client half-closes it right away and waits for the
+ * server to close its end, which covers the server's whole setup and
+ * teardown of a connection.
+ */
+static void run_churn(struct load_conn *c) {
+    const struct load_config *cfg = c->cfg;
+
+    while (c->replies < cfg->npackets) {
+        uint64_t start = now_ns();
+        if (c->fd < 0 && (c->fd = connect_server(cfg, c->id, 0)) < 0) {
+            if (++c->refused > MAX_REFUSED) {
+                c->errors++;
+                return;
+            }
+            struct timespec backoff = { 0, 1000000 };
+            nanosleep(&backoff, NULL);
+            continue;
+        }
+        c->sent++;
+
+        char byte;
+        ssize_t n;
+        shutdown(c->fd, SHUT_WR);
+        while ((n = recv(c->fd, &byte, 1, 0)) < 0 && errno == EINTR)
+            ;
+        close(c->fd);
+        c->fd = -1;
+        if (n != 0) {
+            // Anything but an orderly close
+            c->errors++;
+            return;
+        }
+        c->lat_ns[c->replies++] = now_ns() - start;
+    }
+}
+
+/**
+ * run_slowloris
+ * -------------
+ * Slowloris mode: sends a packet that never ends, a byte at a time at the
+ * configured rate (or nothing at all without one), up to one byte short
+ * of its newline, and waits for the server to close the connection. Its
+ * one "replay" is that close, and its latency how long the connection
+ * lasted.
+ */
+static void run_slowloris(struct load_conn *c) {
+    const struct load_config *cfg = c->cfg;
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+    uint64_t start = now_ns();
+    size_t trickled = 0;
+    bool closed = false;
+
+    c->sent++;
+    while (!closed) {
+        uint64_t now = now_ns();
+        if (now - start > SLOWLORIS_WAIT_NS) break;
+        if (interval && trickled < cfg->pktsize - 1 && now >= start + trickled * interval) {
+            if (send(c->fd, "x", 1, MSG_NOSIGNAL) < 0) {
+                closed = errno == EPIPE || errno == ECONNRESET;
+                break;
+            }
+            trickled++;
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        int timeout = interval ? (int)(interval / 1000000) + 1 : 1000;
+        if (poll(&pfd, 1, timeout) <= 0) continue;
+        char byte;
+        ssize_t n = recv(c->fd, &byte, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        // A replay of a packet that never ended would be a server bug
+        closed = n == 0 || (n < 0 && errno == ECONNRESET);
+        break;
+    }
+
+    close(c->fd);
+    c->fd = -1;
+    if (!closed) {
+        c->errors++;
+        return;
+    }
+    c->lat_ns[c->replies++] = now_ns() - c->connected_ns;
+}
+
+/**
+ * conn_thread
+ * -----------
+ * Drives one connection through its packets in the configured mode.
+ */
+static void *conn_thread(void *arg) {
+    struct load_conn *c = arg;
+    const struct load_config *cfg = c->cfg;
+    char *rbuf = malloc(RECV_CHUNK);
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+
+    pthread_barrier_wait(&start_barrier);
+    if (!rbuf) {
+        c->errors++;
+        close(c->fd);
+        c->fd = -1;
+        return NULL;
+    }
+
+    if (cfg->mode == MODE_CHURN) {
+        run_churn(c);
+        free(rbuf);
+        return NULL;
+    }
+    if (cfg->mode == MODE_SLOWLORIS) {
+        run_slowloris(c);
+        free(rbuf);
+        return NULL;
+    }
+
+    build_packet(c->expect, cfg, c->id, 0);
+
+    while (c->replies < cfg->npackets) {
+        uint64_t now = now_ns();
+        int timeout = -1;
+
+        // Closed loop: one packet in flight. Open loop: follow the schedule.
+        if (c->sent < cfg->npackets) {
+            uint64_t due = run_start_ns + c->sent * interval;
+            bool may_send = cfg->mode == MODE_OPEN || c->replies == c->sent;
+            if (may_send && now >= due && c->fd < 0) {
+                // Reconnect mode: each packet gets a fresh connection
+                c->fd = connect_server(cfg, c->id, 0);
+                if (c->fd < 0) {
+                    if (++c->refused > MAX_REFUSED) {
+                        c->errors++;
+                        break;
+                    }
+                    struct timespec backoff = { 0, 1000000 };
+                    nanosleep(&backoff, NULL);
+                }
+                continue;
+            }
+            if (may_send && now >= due) {
+                // A burst is several packets in a single send
+                unsigned n = cfg->npackets - c->sent;
+                if (n > cfg->burst) n = cfg->burst;
+                size_t outlen = 0;
+                for (unsigned i = 0; i < n; ++i) {
+                    build_packet(c->pkt, cfg, c->id, c->sent + i);
+                    c->sched_ns[c->sent + i] = cfg->mode == MODE_OPEN ? due : now;
+                    if (cfg->framed) outlen += varint_encode(cfg->pktsize, c->wire + outlen);
+                    memcpy(c->wire + outlen, c->pkt, cfg->pktsize);
+                    outlen += cfg->pktsize;
+                }
+                if (send_all(c->fd, c->wire, outlen) < 0) {
+                    c->errors++;
+                    break;
+                }
+                c->sent += n;
+                continue;
+            }
+            if (may_send)
+                timeout = (int)((due - now + 999999) / 1000000);
+        }
+
+        // Only waiting on replies: a server that stops mid-replay must not hang the run
+        bool waiting = timeout < 0;
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, waiting ? REPLY_STALL_MS : timeout);
+        if (rc < 0 && errno != EINTR) {
+            c->errors++;
+            break;
+        }
+        if (rc == 0 && waiting) {
+            c->errors += cfg->npackets - c->replies;
+            break;
+        }
+        if (rc <= 0) continue;
+
+        ssize_t n = recv(c->fd, rbuf, RECV_CHUNK, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            // Server went away with replays outstanding
+            c->errors += cfg->npackets - c->replies;
+            break;
+        }
+        c->wire_bytes += n;
+        if (cfg->framed)
+            consume_framed(c, rbuf, n);
+        else if (cfg->batch)
+            consume_batch(c, rbuf, n);
+        else
+            consume_reply(c, rbuf, n);
+
+        if (cfg->reconnect && c->replies == c->sent) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+
+    // Let a one-client-at-a-time server move on to the next connection
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    free(rbuf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * percentile
+ * ----------
+ * Returns the q-quantile of a sorted array, in microseconds.
+ */
+static double percentile(const uint64_t *sorted, size_t n, double q) {
+    if (n == 0) return 0;
+    size_t idx = (size_t)(q * n);
+    if (idx >= n) idx = n - 1;
+    return sorted[idx] / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port | -u path] [-c conns] [-n packets] [-s size]\n"
+            "          [-r rate] [-m closed|open|churn|slowloris] [-w secs] [-o results] [-N] [-R]\n"
+            "          [-F | -B] [-b burst] [-L channels]\n"
+            "  -u  connect to this Unix domain socket instead of host:port\n"
+            "  -c  concurrent connections (default 1)\n"
+            "  -n  packets per connection (default 100)\n"
+            "  -s  packet size in bytes including newline (default 64)\n"
+            "  -r  packets per second per connection, required for open loop\n"
+            "  -m  closed: wait for each replay; open: send on a fixed schedule;\n"
+            "      churn: a new connection per packet that sends nothing;\n"
+            "      slowloris: one endless packet per connection, trickled at the\n"
+            "      rate if any, until the server closes the connection\n"
+            "  -w  seconds to retry the initial connect (default 5)\n"
+            "  -o  write key=value results to this file\n"
+            "  -N  do not validate replays\n"
+            "  -R  open a new connection for every packet (closed loop)\n"
+            "  -F  send varint length-prefixed records, newlines inside them,\n"
+            "      instead of newline packets; replays must return their boundaries\n"
+            "  -B  batch acknowledgement: one replay per burst the server receives\n"
+            "  -b  packets per send (default 1)\n"
+            "  -L  spread the connections over this many channels (ch0, ch1, ...)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct load_config cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .nconns = 1,
+        .npackets = 100,
+        .pktsize = 64,
+        .rate = 0,
+        .mode = MODE_CLOSED,
+        .validate = true,
+        .wait_secs = 5,
+        .result_path = NULL,
+        .burst = 1,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:u:c:n:s:r:m:w:o:NRFBb:L:")) != -1) {
+        switch (opt) {
+        case 'H': cfg.host = optarg; break;
+        case 'p': cfg.port = optarg; break;
+        case 'u': cfg.unix_path = optarg; break;
+        case 'c': cfg.nconns = strtoul(optarg, NULL, 0); break;
+        case 'n': cfg.npackets = strtoul(optarg, NULL, 0); break;
+        case 's': cfg.pktsize = strtoul(optarg, NULL, 0); break;
+        case 'r': cfg.rate = strtod(optarg, NULL); break;
+        case 'w': cfg.wait_secs = strtoul(optarg, NULL, 0); break;
+        case 'o': cfg.result_path = optarg; break;
+        case 'N': cfg.validate = false; break;
+        case 'R': cfg.reconnect = true; break;
+        case 'F': cfg.framed = true; break;
+        case 'B': cfg.batch = true; break;
+        case 'b': cfg.burst = strtoul(optarg, NULL, 0); break;
+        case 'L': cfg.channels = strtoul(optarg, NULL, 0); break;
+        case 'm':
+            if (strcmp(optarg, "closed") == 0) cfg.mode = MODE_CLOSED;
+            else if (strcmp(optarg, "open") == 0) cfg.mode = MODE_OPEN;
+            else if (strcmp(optarg, "churn") == 0) cfg.mode = MODE_CHURN;
+            else if (strcmp(optarg, "slowloris") == 0) cfg.mode = MODE_SLOWLORIS;
+            else { usage(argv[0]); return 1; }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (cfg.nconns == 0 || cfg.npackets == 0 || cfg.pktsize < 32) {
+        fprintf(stderr, "Need at least one connection, one packet and 32-byte packets\n");
+        return 1;
+    }
+    if (cfg.framed && cfg.batch) {
+        fprintf(stderr, "-F and -B are mutually exclusive\n");
+        return 1;
+    }
+    if (cfg.burst == 0) cfg.burst = 1;
+    if (cfg.mode == MODE_OPEN && cfg.reconnect) {
+        fprintf(stderr, "Reconnect mode needs closed loop\n");
+        return 1;
+    }
+    if (cfg.mode == MODE_OPEN && cfg.rate <= 0) {
+        fprintf(stderr, "Open-loop mode needs a rate (-r)\n");
+        return 1;
+    }
+
+    run_nonce = (unsigned)getpid();
+
+    struct load_conn *conns = calloc(cfg.nconns, sizeof(*conns));
+    pthread_t *threads = calloc(cfg.nconns, sizeof(*threads));
+    if (!conns || !threads) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (unsigned i = 0; i < cfg.nconns; ++i) {
+        struct load_conn *c = &conns[i];
+        c->id = i;
+        c->cfg = &cfg;
+        c->pkt = malloc(cfg.pktsize);
+        c->wire = malloc((size_t)cfg.burst * (cfg.pktsize + VARINT_MAX_LEN));
+        c->expect = malloc(cfg.pktsize);
+        c->line = malloc(cfg.pktsize);
+        c->sched_ns = calloc(cfg.npackets, sizeof(uint64_t));
+        c->lat_ns = calloc(cfg.npackets, sizeof(uint64_t));
+        c->reply_hash = FNV_OFFSET;
+        c->prev_hash = FNV_OFFSET;
+        if (!c->pkt || !c->wire || !c->expect || !c->line || !c->sched_ns || !c->lat_ns) {
+            perror("malloc");
+            return 1;
+        }
+        c->fd = connect_server(&cfg, i, cfg.wait_secs);
+        if (c->fd < 0) return 1;
+        c->connected_ns = now_ns();
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, cfg.nconns + 1);
+    for (unsigned i = 0; i < cfg.nconns; ++i)
+        pthread_create(&threads[i], NULL, conn_thread, &conns[i]);
+
+    run_start_ns = now_ns();
+    pthread_barrier_wait(&start_barrier);
+
+    for (unsigned i = 0; i < cfg.nconns; ++i)
+        pthread_join(threads[i], NULL);
+    uint64_t elapsed = now_ns() - run_start_ns;
+
+    // Merge per-connection results
+    size_t total = 0;
+    uint64_t sent = 0, errors = 0, reply_bytes = 0, wire_bytes = 0, acks = 0, refused = 0;
+    for (unsigned i = 0; i < cfg.nconns; ++i) {
+        sent += conns[i].sent;
+        errors += conns[i].errors;
+        refused += conns[i].refused;
+        reply_bytes += conns[i].reply_bytes;
+        wire_bytes += conns[i].wire_bytes;
+        acks += conns[i].acks;
+        total += conns[i].replies;
+    }
+    uint64_t *lat = malloc((total ? total : 1) * sizeof(uint64_t));
+    size_t k = 0;
+    for (unsigned i = 0; i < cfg.nconns; ++i) {
+        memcpy(lat + k, conns[i].lat_ns, conns[i].replies * sizeof(uint64_t));
+        k += conns[i].replies;
+    }
+    qsort(lat, total, sizeof(uint64_t), cmp_u64);
+
+    double secs = elapsed / 1e9;
+    double pps = total / secs;
+    double mbps = reply_bytes / secs / (1024.0 * 1024.0);
+    double p50 = percentile(lat, total, 0.50);
+    double p99 = percentile(lat, total, 0.99);
+    double p999 = percentile(lat, total, 0.999);
+    const char *mode = cfg.mode == MODE_OPEN        ? "open"
+                       : cfg.mode == MODE_CHURN     ? "churn"
+                       : cfg.mode == MODE_SLOWLORIS ? "slowloris"
+                                                    : "closed";
+
+    printf("mode %s, %u connections, %zu-byte packets\n", mode, cfg.nconns, cfg.pktsize);
+    // Packets that were sent but never answered, e.g. across a server shutdown
+    uint64_t lost = sent - total;
+    printf("  packets sent %llu, replays %zu, lost %llu, errors %llu\n",
+           (unsigned long long)sent, total, (unsigned long long)lost,
+           (unsigned long long)errors);
+    if (cfg.reconnect || cfg.mode == MODE_CHURN)
+        printf("  refused connection attempts %llu\n", (unsigned long long)refused);
+    printf("  throughput %.1f packets/s, replay %.2f MiB/s over %.3f s\n", pps, mbps, secs);
+    printf("  %llu replays, %llu bytes received\n", (unsigned long long)acks,
+           (unsigned long long)wire_bytes);
+    printf("  latency p50 %.1f us, p99 %.1f us, p999 %.1f us\n", p50, p99, p999);
+
+    if (cfg.result_path) {
+        FILE *fp = fopen(cfg.result_path, "w");
+        if (!fp) {
+            perror(cfg.result_path);
+            return 1;
+        }
+        fprintf(fp, "mode=%s\n", mode);
+        fprintf(fp, "transport=%s\n", cfg.unix_path ? "unix" : "tcp");
+        fprintf(fp, "framing=%s\n", cfg.framed ? "varint" : cfg.batch ? "batch" : "newline");
+        fprintf(fp, "burst=%u\n", cfg.burst);
+        fprintf(fp, "channels=%u\n", cfg.channels);
+        fprintf(fp, "connections=%u\n", cfg.nconns);
+        fprintf(fp, "packets_per_connection=%u\n", cfg.npackets);
+        fprintf(fp, "packet_size=%zu\n", cfg.pktsize);
+        fprintf(fp, "rate=%.1f\n", cfg.rate);
+        fprintf(fp, "packets_sent=%llu\n", (unsigned long long)sent);
+        fprintf(fp, "replays=%zu\n", total);
+        fprintf(fp, "replays_lost=%llu\n", (unsigned long long)lost);
+        fprintf(fp, "connect_refused=%llu\n", (unsigned long long)refused);
+        fprintf(fp, "errors=%llu\n", (unsigned long long)errors);
+        fprintf(fp, "elapsed_s=%.6f\n", secs);
+        fprintf(fp, "throughput_pps=%.1f\n", pps);
+        fprintf(fp, "replay_mibps=%.3f\n", mbps);
+        fprintf(fp, "acks=%llu\n", (unsigned long long)acks);
+        fprintf(fp, "wire_bytes=%llu\n", (unsigned long long)wire_bytes);
+        fprintf(fp, "latency_p50_us=%.1f\n", p50);
+        fprintf(fp, "latency_p99_us=%.1f\n", p99);
+        fprintf(fp, "latency_p999_us=%.1f\n", p999);
+        fclose(fp);
+    }
+
+    for (unsigned i = 0; i < cfg.nconns; ++i) {
+        free(conns[i].pkt);
+        free(conns[i].wire);
+        free(conns[i].expect);
+        free(conns[i].line);
+        free(conns[i].sched_ns);
+        free(conns[i].lat_ns);
+    }
+    free(lat);
+    free(conns);
+    free(threads);
+    pthread_barrier_destroy(&start_barrier);
+
+    return errors ? 2 : 0;
+}
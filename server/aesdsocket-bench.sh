@@ -0,0 +1,376 @@
+#!/bin/sh
+# Runs the aesdload benchmark suite against a local aesdsocket instance.
+# Results are written as key=value files, one per scenario, to the directory
+# given as the first argument (default: bench-results). Remaining arguments
+# select scenarios to run; all scenarios run when none are given.
+# AESDSOCKET and AESDLOAD override the binaries under test; SERVER_ARGS is
+# passed to the server started by run_scenario.
+
+set -e
+
+cd `dirname $0`
+outdir=${1:-bench-results}
+[ $# -gt 0 ] && shift
+scenarios=${*:-"closed-1 closed-4 open-1 shutdown upgrade startup threads-8 prefork-8 unix-1 \
+    newline-16k framed-16k burst-1k batch-1k checksummed-16k channels-1 channels-4 channels-8 \
+    replication spill-64m churn-100k uncached-16k zerocopy-16k corked-3k busy-poll-1 slowloris \
+    capped-32 upgrade-budget"}
+mkdir -p "$outdir"
+
+AESDSOCKET=${AESDSOCKET:-./aesdsocket}
+AESDLOAD=${AESDLOAD:-./aesdload}
+LOG_FILE=/var/tmp/aesdsocketdata
+
+# Sends SIGTERM and falls back to SIGKILL if the server has not exited
+# within 5 seconds
+stop_server() {
+    kill -TERM $server_pid 2>/dev/null || true
+    tries=50
+    while kill -0 $server_pid 2>/dev/null && [ $tries -gt 0 ]; do
+        sleep 0.1
+        tries=$((tries - 1))
+    done
+    if kill -0 $server_pid 2>/dev/null; then
+        echo "aesdsocket did not exit on SIGTERM, killing it"
+        kill -KILL $server_pid 2>/dev/null || true
+    fi
+    wait $server_pid 2>/dev/null || true
+}
+
+# Prints the peak resident set size of the server so far, in bytes
+server_rss_peak_bytes() {
+    awk '$1 == "VmHWM:" { print $2 * 1024 }' /proc/$server_pid/status 2>/dev/null || echo 0
+}
+
+run_scenario() {
+    name=$1
+    shift
+    rm -f $LOG_FILE $LOG_FILE.*
+    $AESDSOCKET $SERVER_ARGS > "$outdir/$name.server" &
+    server_pid=$!
+    set +e
+    $AESDLOAD -w 5 -o "$outdir/$name.txt" "$@"
+    rc=$?
+    set -e
+    [ $rc -eq 0 ] && echo "server_rss_peak_bytes=$(server_rss_peak_bytes)" >> "$outdir/$name.txt"
+    stop_server
+    # CPU time (user + system) of the server, from the metrics it prints on
+    # exit: /proc/<pid>/stat only counts whole clock ticks. Pre-forked
+    # workers report to syslog only, so there is none for them.
+    [ $rc -eq 0 ] && sed -n 's/^Metrics: .* cpu_ms=\([0-9.]*\).*/server_cpu_ms=\1/p' \
+        "$outdir/$name.server" >> "$outdir/$name.txt"
+    # What the server copied per replay, from the metrics it prints on exit
+    [ $rc -eq 0 ] && sed -n 's/^Metrics: .* copies_per_replay=\([0-9.]*\) copied_bytes_per_replay=\([0-9.]*\) sends_per_replay=\([0-9.]*\).*/copies_per_replay=\1\ncopied_bytes_per_replay=\2\nsends_per_replay=\3/p' \
+        "$outdir/$name.server" >> "$outdir/$name.txt"
+    [ $rc -eq 0 ] && sed -n 's/^Metrics: .* \(zerocopy_sends=[0-9]*\) \(zerocopy_copied=[0-9]*\) \(zerocopy_fallbacks=[0-9]*\).*/\1\n\2\n\3/p' \
+        "$outdir/$name.server" >> "$outdir/$name.txt"
+    [ $rc -eq 0 ] && sed -n 's/^Metrics: .* \(timeouts_idle=[0-9]*\) \(timeouts_header=[0-9]*\) \(timeouts_lifetime=[0-9]*\).*/\1\n\2\n\3/p' \
+        "$outdir/$name.server" >> "$outdir/$name.txt"
+    [ $rc -eq 0 ] && sed -n 's/^Metrics: .* \(busy_poll_hits=[0-9]*\) \(busy_poll_sleeps=[0-9]*\).*/\1\n\2/p' \
+        "$outdir/$name.server" >> "$outdir/$name.txt"
+    [ $rc -eq 0 ] && sed -n 's/^Metrics: .* \(tcp_segs_per_replay=[0-9.]*\) \(tcp_bytes_per_seg=[0-9]*\).*/\1\n\2/p' \
+        "$outdir/$name.server" >> "$outdir/$name.txt"
+    [ $rc -eq 0 ] && sed -n 's/^Metrics: .* \(conn_sheds=[0-9]*\) \(accept_pauses=[0-9]*\) \(accept_paused_ms=[0-9]*\) accept_queue_len=[0-9]* \(accept_queue_peak=[0-9]*\).*/\1\n\2\n\3\n\4/p' \
+        "$outdir/$name.server" >> "$outdir/$name.txt"
+    rm -f "$outdir/$name.server"
+    if [ $rc -ne 0 ]; then
+        echo "Scenario $name failed with rc=$rc"
+        exit $rc
+    fi
+}
+
+for scenario in $scenarios; do
+    case "$scenario" in
+        closed-1)
+            echo "Closed loop, single connection"
+            run_scenario closed-1 -m closed -c 1 -n 200 -s 64
+            ;;
+        busy-poll-1)
+            # closed-1 with connection threads spinning up to 50 us for data;
+            # compare latency_p99_us and server_cpu_ms with closed-1
+            echo "Closed loop, single connection, busy-polling server"
+            SERVER_ARGS="-b 50" run_scenario busy-poll-1 -m closed -c 1 -n 200 -s 64
+            ;;
+        closed-4)
+            echo "Closed loop, 4 connections"
+            run_scenario closed-4 -m closed -c 4 -n 100 -s 64
+            ;;
+        open-1)
+            echo "Open loop, single connection at 200 packets/s"
+            run_scenario open-1 -m open -c 1 -n 500 -s 64 -r 200
+            ;;
+        shutdown)
+            # Signal the server mid-load and measure how long the drain takes
+            # and how many packets go unanswered
+            echo "Shutdown under open-loop load, 4 connections"
+            rm -f $LOG_FILE
+            $AESDSOCKET > "$outdir/shutdown.server" &
+            server_pid=$!
+            $AESDLOAD -w 5 -o "$outdir/shutdown.load" -m open -c 4 -n 100000 -s 64 -r 200 \
+                > /dev/null &
+            load_pid=$!
+            sleep 2
+            start=$(date +%s%N)
+            stop_server
+            end=$(date +%s%N)
+            wait $load_pid 2>/dev/null || true
+            {
+                echo "shutdown_ms=$(( (end - start) / 1000000 ))"
+                sed -n 's/.* \([0-9]*\) packets (\([0-9]*\) partial bytes) lost/server_packets_lost=\1\nserver_bytes_lost=\2/p' \
+                    "$outdir/shutdown.server"
+                grep '^replays_lost=' "$outdir/shutdown.load"
+            } > "$outdir/shutdown.txt"
+            rm -f "$outdir/shutdown.server" "$outdir/shutdown.load"
+            cat "$outdir/shutdown.txt"
+            ;;
+        upgrade)
+            # Replace the server with "-U -C" while persistent and reconnecting
+            # clients are running; neither should see an error or a refusal
+            echo "Upgrade under load, persistent and reconnecting clients"
+            rm -f $LOG_FILE
+            $AESDSOCKET > /dev/null &
+            old_pid=$!
+            $AESDLOAD -w 5 -o "$outdir/upgrade.persist" -m open -c 2 -n 600 -s 64 -r 200 \
+                > /dev/null &
+            persist_pid=$!
+            $AESDLOAD -w 5 -o "$outdir/upgrade.churn" -m closed -R -c 2 -n 300 -s 64 \
+                > /dev/null &
+            churn_pid=$!
+            sleep 1
+            $AESDSOCKET -U -C > /dev/null &
+            server_pid=$!
+            wait $persist_pid $churn_pid 2>/dev/null || true
+            if kill -0 $old_pid 2>/dev/null; then
+                echo "Old instance still running after upgrade"
+                kill -KILL $old_pid
+            fi
+            wait $old_pid 2>/dev/null || true
+            stop_server
+            {
+                sed -n 's/^connect_refused=/upgrade_connect_refused=/p' "$outdir/upgrade.churn"
+                sed -n 's/^replays_lost=/upgrade_replays_lost=/p' "$outdir/upgrade.persist"
+                cat "$outdir/upgrade.persist" "$outdir/upgrade.churn" |
+                    awk -F= '$1 == "errors" { sum += $2 } END { print "errors=" sum + 0 }'
+            } > "$outdir/upgrade.txt"
+            rm -f "$outdir/upgrade.persist" "$outdir/upgrade.churn"
+            cat "$outdir/upgrade.txt"
+            ;;
+        upgrade-budget)
+            # 1100 idle connections, each holding a 1 KiB receive buffer, taken
+            # over by an instance whose whole budget is 1 MiB: it keeps them
+            # beyond the budget, but must then refuse every new connection
+            echo "Upgrade past the receive budget, then a new connection"
+            rm -f $LOG_FILE
+            $AESDSOCKET -B 2048 > /dev/null &
+            old_pid=$!
+            $AESDLOAD -w 5 -m slowloris -c 1100 -u /var/tmp/aesdsocket.sock > /dev/null &
+            idle_pid=$!
+            sleep 2
+            $AESDSOCKET -U -C -R 1024 -M 1 -s 0 > "$outdir/upgrade-budget.server" &
+            server_pid=$!
+            tries=50
+            while kill -0 $old_pid 2>/dev/null && [ $tries -gt 0 ]; do
+                sleep 0.1
+                tries=$((tries - 1))
+            done
+            set +e
+            $AESDLOAD -w 0 -n 1 -u /var/tmp/aesdsocket.sock -o "$outdir/upgrade-budget.load" \
+                > /dev/null
+            set -e
+            stop_server
+            wait $idle_pid 2>/dev/null || true
+            if kill -0 $old_pid 2>/dev/null; then
+                echo "Old instance still running after upgrade"
+                kill -KILL $old_pid
+            fi
+            wait $old_pid 2>/dev/null || true
+            # The new connection must have been refused for want of budget
+            rejects=$(sed -n 's/^Metrics: .* recv_budget_rejects=\([0-9]*\).*/\1/p' \
+                "$outdir/upgrade-budget.server")
+            replays=$(sed -n 's/^replays=//p' "$outdir/upgrade-budget.load" 2>/dev/null)
+            {
+                echo "budget_rejects=${rejects:-0}"
+                [ "${rejects:-0}" -ge 1 ] && [ "${replays:-1}" -eq 0 ] &&
+                    echo "errors=0" || echo "errors=1"
+            } > "$outdir/upgrade-budget.txt"
+            rm -f "$outdir/upgrade-budget.server" "$outdir/upgrade-budget.load"
+            cat "$outdir/upgrade-budget.txt"
+            ;;
+        startup)
+            # "-d" returns once the daemon is serving, so the very first
+            # connection attempt must succeed
+            echo "Daemon startup to readiness"
+            rm -f $LOG_FILE
+            start=$(date +%s%N)
+            $AESDSOCKET -d
+            end=$(date +%s%N)
+            server_pid=$(pgrep -n -f "$AESDSOCKET -d")
+            set +e
+            $AESDLOAD -w 0 -n 1 -o "$outdir/startup.load" > /dev/null
+            set -e
+            stop_server
+            {
+                echo "startup_us=$(( (end - start) / 1000 ))"
+                sed -n 's/^errors=/startup_errors=/p' "$outdir/startup.load" 2>/dev/null ||
+                    echo "startup_errors=1"
+            } > "$outdir/startup.txt"
+            rm -f "$outdir/startup.load"
+            cat "$outdir/startup.txt"
+            ;;
+        unix-1)
+            # Same load as closed-1, over the Unix socket instead of TCP loopback
+            echo "Closed loop, single connection over the Unix socket"
+            run_scenario unix-1 -m closed -c 1 -n 200 -s 64 -u /var/tmp/aesdsocket.sock
+            ;;
+        newline-16k)
+            # Large records over the Unix socket, where the server's newline
+            # scan is a visible share of the work
+            echo "Closed loop, 16 KiB newline packets over the Unix socket"
+            run_scenario newline-16k -m closed -c 1 -n 100 -s 16384 -u /var/tmp/aesdsocket.sock
+            ;;
+        framed-16k)
+            # Framed records need a data file that keeps their lengths. They
+            # hold newlines every 61 bytes, and each replay must split back
+            # into exactly the records sent
+            echo "Closed loop, 16 KiB length-prefixed records over the Unix socket, checksummed"
+            SERVER_ARGS=-K run_scenario framed-16k -m closed -c 1 -n 100 -s 16384 -u /var/tmp/aesdsocket.sock -F
+            ;;
+        uncached-16k)
+            # checksummed-16k without the replay cache: every replay is read
+            # back from the file into the chain, and copied on the way
+            echo "Closed loop, 16 KiB newline packets, checksummed records, no replay cache"
+            SERVER_ARGS="-K -m 0" run_scenario uncached-16k -m closed -c 1 -n 100 -s 16384 \
+                -u /var/tmp/aesdsocket.sock
+            ;;
+        zerocopy-16k)
+            # Replays past 64 KiB sent with MSG_ZEROCOPY over TCP; loopback
+            # copies anyway, so this mostly guards the fallback
+            echo "Closed loop, 16 KiB newline packets over TCP, MSG_ZEROCOPY replays"
+            SERVER_ARGS="-z 64" run_scenario zerocopy-16k -m closed -c 1 -n 100 -s 16384
+            ;;
+        corked-3k)
+            # Uncached replays leave in several sends; corked, they fill whole
+            # segments (compare tcp_segs_per_replay with SERVER_ARGS="-m 0")
+            echo "Closed loop, 3000-byte packets over TCP, no replay cache, corked replays"
+            SERVER_ARGS="-m 0 -T all" run_scenario corked-3k -m closed -c 1 -n 200 -s 3000
+            ;;
+        slowloris)
+            # Connections trickling a packet that never ends, a byte every
+            # 200 ms: the idle timeout never fires, the header timeout must
+            echo "Slowloris, 200 connections trickling endless packets, 2 s header timeout"
+            SERVER_ARGS="-I 5,2,0" run_scenario slowloris -m slowloris -c 200 -r 5 -s 64 \
+                -u /var/tmp/aesdsocket.sock
+            ;;
+        capped-32)
+            # 32 clients against a cap of 4 live connections: the rest wait
+            # in the accept queue while the server stops accepting
+            echo "Closed loop, 32 connections, at most 4 served at once"
+            SERVER_ARGS="-B 128 -L 4" run_scenario capped-32 -m closed -c 32 -n 50 -s 64
+            ;;
+        checksummed-16k)
+            # newline-16k against a data file with CRC32C record headers
+            echo "Closed loop, 16 KiB newline packets, checksummed records"
+            SERVER_ARGS=-K run_scenario checksummed-16k -m closed -c 1 -n 100 -s 16384 \
+                -u /var/tmp/aesdsocket.sock
+            ;;
+        burst-1k)
+            # 1000-packet bursts: every packet triggers a replay of the file
+            echo "Closed loop, bursts of 1000 packets, one replay per packet"
+            run_scenario burst-1k -m closed -c 1 -n 3000 -b 1000 -s 64
+            ;;
+        batch-1k)
+            echo "Closed loop, bursts of 1000 packets, batch acknowledgement"
+            run_scenario batch-1k -m closed -c 1 -n 3000 -b 1000 -s 64 -B
+            ;;
+        threads-8)
+            echo "Closed loop, 8 connections, one threaded process"
+            SERVER_ARGS= run_scenario threads-8 -m closed -c 8 -n 100 -s 64
+            ;;
+        prefork-8)
+            echo "Closed loop, 8 connections, 4 pre-forked workers"
+            SERVER_ARGS="-P 4" run_scenario prefork-8 -m closed -c 8 -n 100 -s 64
+            ;;
+        channels-1|channels-4|channels-8)
+            # The same 8 connections spread over 1, 4 or 8 channels: each
+            # replay only covers its own channel's data file
+            nchannels=${scenario#channels-}
+            echo "Closed loop, 8 connections over $nchannels channels"
+            run_scenario $scenario -m closed -c 8 -n 200 -s 256 -L $nchannels \
+                -u /var/tmp/aesdsocket.sock
+            ;;
+        replication)
+            # A follower on the same host applies everything the primary
+            # commits, then serves read-only batch replays of its copy
+            echo "Closed loop, 4 connections on the primary, follower replays"
+            rm -f $LOG_FILE $LOG_FILE.* $LOG_FILE-replica
+            $AESDSOCKET -S /var/tmp/aesdsocket.repl > /dev/null &
+            primary_pid=$!
+            $AESDSOCKET -F /var/tmp/aesdsocket.repl > "$outdir/replication.follower" &
+            server_pid=$!
+            $AESDLOAD -w 5 -o "$outdir/replication.primary" -m closed -c 4 -n 200 -s 256 \
+                -u /var/tmp/aesdsocket.sock > /dev/null || true
+            # The follower may still be waiting to retry its first connection
+            tries=50
+            while [ $(stat -c %s $LOG_FILE-replica 2>/dev/null || echo 0) -lt $((4 * 200 * 256)) ] &&
+                [ $tries -gt 0 ]; do
+                sleep 0.1
+                tries=$((tries - 1))
+            done
+            $AESDLOAD -w 5 -o "$outdir/replication.replica" -m closed -c 4 -n 100 -s 64 -B -N \
+                -u /var/tmp/aesdsocket-replica.sock > /dev/null || true
+            stop_server
+            server_pid=$primary_pid
+            stop_server
+            {
+                sed -n 's/^throughput_pps=/primary_throughput_pps=/p' "$outdir/replication.primary"
+                sed -n 's/^throughput_pps=/follower_throughput_pps=/p' "$outdir/replication.replica"
+                sed -n 's/^replay_mibps=/follower_replay_mibps=/p' "$outdir/replication.replica"
+                sed -n 's/^Replicated \([0-9]*\) bytes in \([0-9]*\) batches.*(max \([0-9]*\) bytes \/ \([0-9]*\) ms)/repl_batches=\2\nrepl_behind_bytes=\1\nrepl_lag_max_bytes=\3\nrepl_lag_max_ms=\4/p' \
+                    "$outdir/replication.follower" |
+                    awk -F= '$1 == "repl_behind_bytes" { $2 = 4 * 200 * 256 - $2 } { print $1 "=" $2 }'
+                cat "$outdir/replication.primary" "$outdir/replication.replica" 2>/dev/null |
+                    awk -F= '$1 == "errors" { sum += $2; n++ } END { print "errors=" (n == 2 ? sum : 1) }'
+            } > "$outdir/replication.txt"
+            rm -f "$outdir/replication.primary" "$outdir/replication.replica" \
+                "$outdir/replication.follower"
+            cat "$outdir/replication.txt"
+            ;;
+        spill-64m)
+            # 64 MiB newline packets: past the spill threshold they stream to
+            # a staging file, so the server's peak RSS stays far below them
+            echo "Closed loop, 64 MiB newline packets spilled to a staging file"
+            SERVER_ARGS="-m 0" run_scenario spill-64m -m closed -c 1 -n 2 -s 67108864
+            ;;
+        churn-100k)
+            # 100k short-lived connections that send nothing: connection
+            # state and receive buffers should come from the pools
+            echo "Connection churn, 100k connections over 4 clients"
+            rm -f $LOG_FILE
+            $AESDSOCKET > "$outdir/churn-100k.server" &
+            server_pid=$!
+            set +e
+            $AESDLOAD -w 5 -o "$outdir/churn-100k.load" -m churn -c 4 -n 25000 \
+                -u /var/tmp/aesdsocket.sock > /dev/null
+            rc=$?
+            set -e
+            rss=$(server_rss_peak_bytes)
+            stop_server
+            {
+                sed -n 's/^throughput_pps=/churn_pps=/p; s/^latency_p99_us=/churn_p99_us=/p; /^errors=/p' \
+                    "$outdir/churn-100k.load"
+                echo "server_rss_peak_bytes=$rss"
+                sed -n 's/^Metrics: .* pool_hit_pct=\([0-9.]*\) pool_resident_bytes=\([0-9]*\).*/pool_hit_pct=\1\npool_resident_bytes=\2/p' \
+                    "$outdir/churn-100k.server"
+            } > "$outdir/churn-100k.txt"
+            rm -f "$outdir/churn-100k.server" "$outdir/churn-100k.load"
+            cat "$outdir/churn-100k.txt"
+            [ $rc -eq 0 ] || exit $rc
+            ;;
+        *)
+            echo "Unknown scenario $scenario"
+            exit 1
+            ;;
+    esac
+done
+
+echo "Results written to $outdir"
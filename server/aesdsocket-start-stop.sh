@@ -3,14 +3,21 @@
 case "$1" in 
     start)
         echo "Starting aesdsocket"
+        # Returns once the daemon is accepting connections
         start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d
         ;;
     stop)
         echo "Stopping aesdsocket"
         start-stop-daemon -K -n aesdsocket
         ;;
+    upgrade)
+        # The new binary takes over the listening socket and live clients
+        # from the running one, so port 9000 never stops accepting
+        echo "Upgrading aesdsocket"
+        /usr/bin/aesdsocket -d -U -C
+        ;;
     *)
-       echo "Usage: $0 {start|stop}"
+       echo "Usage: $0 {start|stop|upgrade}"
     exit 1
 esac
 
@@ -2,73 +2,305 @@
  * aesdsocket.c
  *
  * This program implements a TCP server that:
- * - Listens on port 9000 for incoming client connections.
- * - Accepts one client connection at a time.
+ * - Listens on port 9000 for incoming client connections, over IPv6 and
+ *   IPv4 (dual-stack), and on the Unix domain socket /var/tmp/aesdsocket.sock
+ *   for producers on the same host.
+ * - Handles each client connection in its own thread.
  * - Receives newline-terminated data packets from clients and appends them
- *   to the file /var/tmp/aesdsocketdata.
- * - After receiving each complete packet, sends the full file contents
- *   back to the client.
- * - Logs client connections, disconnections, and errors to syslog.
+ *   to the file /var/tmp/aesdsocketdata. Clients can instead negotiate
+ *   length-prefixed framing (see framing.h) to send binary records, which
+ *   needs a "-K" or "-D" data file to keep them apart, or batch
+ *   acknowledgement, where a burst of packets gets a single replay.
+ * - Optionally ("-K") stores every record behind a header with its length,
+ *   sequence number and CRC32C; such a file is checked on startup and
+ *   truncated at the first torn or corrupt record. With "-D" a record whose
+ *   body is in the file already is stored as a reference to it instead.
+ * - Keeps named channels apart: a connection preamble or a dedicated port
+ *   ("-N name:port") selects a channel with its own data file, lock and
+ *   replay cache, /var/tmp/aesdsocketdata.<name>.
+ * - Recovers an existing data file on startup, validating large files with
+ *   several threads, and serves replays of its first records from memory
+ *   (see datalog.h). Large replays to TCP clients can skip the copy into
+ *   the socket buffer ("-z", MSG_ZEROCOPY), and replays can be corked into
+ *   full-sized segments, short ones sent without Nagle delays ("-T").
+ *   For latency-critical producers, connection threads can busy-poll for
+ *   data instead of sleeping ("-b").
+ * - Optionally closes connections that stay idle, take too long over their
+ *   first record (slowloris) or outlive a maximum lifetime ("-I"), tracked
+ *   on a timing wheel (see timewheel.h).
+ * - Optionally limits each client address to a rate of new connections and
+ *   of received bytes ("-A", see ratelimit.h).
+ * - Takes a configurable listen backlog ("-B") and caps its live
+ *   connections ("-L"): at the cap it stops accepting, leaving bursts to
+ *   the kernel's accept queue, or sheds new connections. The depth of the
+ *   TCP accept queues is sampled and reported, with a warning as they near
+ *   the backlog.
+ * - After receiving each complete packet, sends the file contents up to and
+ *   including that packet back to the client.
+ * - Optionally ("-W") appends a "timestamp:" record in RFC 2822 format to
+ *   the default channel at a fixed interval, driven by a timerfd in the
+ *   main loop and committed like any client packet.
+ * - Bounds the memory spent on partial packets, per connection ("-R") and
+ *   for the whole process ("-M"); a packet that does not fit is rejected
+ *   and its connection closed. Newline packets larger than a threshold
+ *   ("-s") are streamed to an unnamed staging file in /var/tmp instead, and
+ *   appended in one piece once their newline arrives. Connection state and
+ *   receive buffers are recycled through free lists (see pool.h).
+ * - Logs client connections, disconnections, and errors to syslog, and its
+ *   metrics on SIGUSR2 and at shutdown.
  * - Supports daemon mode using the "-d" argument.
- * - Cleans up sockets and temporary files when SIGINT or SIGTERM is received.
+ * - Receives SIGINT/SIGTERM through a signalfd in the main loop, then stops
+ *   accepting, drains in-flight packets and replays within a deadline, flushes
+ *   the data file, and removes it unless running persistently ("-p").
+ * - Hands its listening socket, and optionally its live connections, to a
+ *   newly started instance ("-U", "-U -C") over a Unix control socket, so it
+ *   can be replaced without refusing a single connection.
+ * - Accepts a pre-bound listener through LISTEN_FDS/LISTEN_PID and reports
+ *   readiness through NOTIFY_SOCKET; in daemon mode the launching process
+ *   exits only once the server is serving.
+ * - Optionally pre-forks worker processes ("-P count") that share the
+ *   listener and append through a shared-memory index, so a crashing worker
+ *   only takes down its own connections.
+ * - Ships its committed records to followers ("-S endpoint"), or runs as a
+ *   read-only follower of another instance ("-F endpoint") that serves
+ *   replays from its own copy on port 9001 (see replication.h).
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/queue.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <arpa/inet.h>
 #include <syslog.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <errno.h>
-#include <sys/stat.h> 
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <glob.h>
+#include "handoff.h"
+#include "activation.h"
+#include "shmlog.h"
+#include "framing.h"
+#include "datalog.h"
+#include "replication.h"
+#include "pool.h"
+#include "timewheel.h"
+#include "ratelimit.h"
 
 #define PORT 9000
 #define DATAFILE "/var/tmp/aesdsocketdata"
+#define DEFAULT_DRAIN_TIMEOUT_MS 5000
+#define CONTROL_SOCKET "/var/tmp/aesdsocket.ctl"
+#define UNIX_SOCKET "/var/tmp/aesdsocket.sock"
+#define MAX_LISTENERS 8
+#define MAX_CHANNELS 64
+#define CHANNEL_LOG_PREFIX DATAFILE "."    // Channel "x" appends to DATAFILE.x
+#define REPLICA_PORT 9001                  // A follower's defaults, so it can share
+#define REPLICA_DATAFILE "/var/tmp/aesdsocketdata-replica"     // the host with its primary
+#define REPLICA_UNIX_SOCKET "/var/tmp/aesdsocket-replica.sock"
+#define HANDOFF_PARK_TIMEOUT_MS 2000
+#define WAKE_SIGNAL SIGUSR1        // Interrupts a blocked recv() so a thread can park
+#define METRICS_SIGNAL SIGUSR2     // Logs the metrics
+#define DEFAULT_RECV_CAP (128u * 1024 * 1024)      // Fits a FRAMED_MAX_RECORD record
+#define DEFAULT_RECV_BUDGET (1024u * 1024 * 1024)
+#define DEFAULT_SPILL_THRESHOLD (1024u * 1024)
+#define SPILL_DIR "/var/tmp"
+#define CONN_POOL_MAX 1024         // Connection objects kept for reuse
+#define TCP_TUNE_CORK 0x1          // "-T" modes: cork each replay into full segments,
+#define TCP_TUNE_NODELAY 0x2       // send short replays and acks without waiting
+#define TCP_TUNE_DEFER 0x4         // on Nagle, accept only once data has arrived
+#define DEFER_ACCEPT_SECS 5        // How long TCP_DEFER_ACCEPT waits for that data
+#define TIMEOUT_TICK_MS 100        // Resolution of the connection timeouts
+#define DEFAULT_RATELIMIT_ADDRESSES 65536  // Client addresses tracked for "-A"
+#define DEFAULT_LISTEN_BACKLOG 10
+#define ACCEPT_QUEUE_WARN_PCT 75   // Warn when an accept queue fills this much of its backlog
+#define TIMESTAMP_FORMAT "timestamp:%a, %d %b %Y %H:%M:%S %z\n"   // RFC 2822
 
-// Global variables for signal handling and socket management
-volatile sig_atomic_t exit_requested = 0;  // Flag set by signal handler
-int global_sockfd = -1;                    // Listening socket descriptor
-int global_clientfd = -1;                  // Current connected client descriptor
+// How a connection delimits its records, decided by its first bytes
+enum framing {
+    FRAMING_UNKNOWN,           // Not enough bytes yet to tell
+    FRAMING_NEWLINE,           // Newline-terminated packets (the default)
+    FRAMING_VARINT,            // Varint length-prefixed records
+    FRAMING_BATCH,             // Newline packets, one acknowledged replay per recv()
+};
 
-/**
- * signal_handler
- * ----------------
- * Triggered by SIGINT or SIGTERM.
- * Sets the exit flag and closes any open sockets.
- */
-void signal_handler(int signo) {
-    exit_requested = 1;
+// One accepted client, served by its own thread
+struct conn {
+    int fd;                    // Closed by the thread under conn_lock, -1 afterwards
+    pthread_t thread;
+    struct sockaddr_storage addr;   // IPv4, IPv6 or Unix peer
+    bool done;                 // Thread finished, ready to be joined
+    bool parked;               // Thread stopped at a packet boundary for a handoff
+    bool handed_off;           // Socket now belongs to the new instance; never shut down
+    enum framing framing;
+    struct channel *channel;   // Data file the connection appends to
+    uint64_t seq;              // Batch mode: packets acknowledged so far
+    char *pending;             // Partial packet handed over with the connection
+    size_t pending_len;
+    size_t pending_cap;
+    int spill_fd;              // Staging file of an oversized partial packet, or -1
+    off_t spill_len;           // Bytes of the partial packet staged there so far
+    struct bufchain replay;    // Replays go out through this chain
+    unsigned long replays;     // Replays sent, for the segment statistics
+    struct timer timer;        // Fires at the next timeout deadline; main loop only
+    uint64_t start_ms;         // When the connection started here
+    _Atomic uint64_t last_rx_ms;    // When data last arrived, for the idle timeout
+    atomic_bool committed;     // A record arrived: the header timeout is over
+    SLIST_ENTRY(conn) entries;
+};
 
-    if (global_clientfd != -1) {
-        close(global_clientfd);
-        global_clientfd = -1;
-    }
+// A named data file with its own lock and replay cache; connections on
+// different channels never contend or replay each other's data
+struct channel {
+    char name[CHANNEL_NAME_MAX + 1];   // Empty for the default channel
+    char path[sizeof(CHANNEL_LOG_PREFIX) + CHANNEL_NAME_MAX];
+    struct datalog log;
+};
 
-    if (global_sockfd != -1) {
-        close(global_sockfd);
-        global_sockfd = -1;
-    }
+// A TCP port whose connections start out on a channel ("-N name:port")
+struct channel_port {
+    const char *name;
+    uint16_t port;
+};
+
+// Progress of a listening-socket handoff to a new instance
+enum handoff_phase {
+    HANDOFF_NONE,              // Serving normally
+    HANDOFF_PARKING,           // Connection threads are parking for a handoff
+    HANDOFF_DONE,              // Sockets now belong to the new instance
+};
+
+// Global state shared between the main loop and connection threads
+atomic_int exit_requested = 0;             // Set once a shutdown signal arrives
+static SLIST_HEAD(conn_list, conn) conns = SLIST_HEAD_INITIALIZER(conns);
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct channel default_channel = { .path = DATAFILE, .log = DATALOG_INITIALIZER };
+static struct channel *channels[MAX_CHANNELS] = { &default_channel };
+static int nchannels = 1;
+static pthread_mutex_t channel_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct channel *listener_channels[MAX_LISTENERS];   // By listener index
+static enum log_format log_format = LOG_RAW;   // Format of newly created data files
+static size_t log_cache_bytes = LOG_DEFAULT_CACHE;
+static bool daemon_mode = false;
+static atomic_int handoff_state = HANDOFF_NONE;
+static const char *serve_endpoint = NULL;  // "-S": followers connect here
+static const char *follow_endpoint = NULL; // "-F": read-only follower of this primary
+static struct repl_primary repl_primary;
+static struct repl_follower repl_follower;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;   // Paired with conn_lock
+static unsigned worker_id = 0;             // 1..K in a pre-forked worker, 0 otherwise
+
+// Shutdown accounting, reported once the server has drained
+static atomic_ulong packets_lost = 0;      // Packets received but never committed or replayed
+static atomic_ulong bytes_lost = 0;        // Bytes of partial packets dropped at close
 
-    syslog(LOG_INFO, "Caught signal %d, exiting", signo);
+// Receive buffers: each connection's is capped at recv_cap bytes, and all of
+// them together (per process) at recv_budget bytes
+static size_t recv_cap = DEFAULT_RECV_CAP;
+static size_t recv_budget = DEFAULT_RECV_BUDGET;
+static atomic_size_t recv_used = 0;        // Bytes of receive buffers allocated now
+static atomic_size_t recv_peak = 0;
+static atomic_ulong recv_cap_rejects = 0;  // Connections closed for a packet over recv_cap
+static atomic_ulong recv_budget_rejects = 0;   // ...for want of budget
+static size_t spill_threshold = DEFAULT_SPILL_THRESHOLD;   // 0: never spill
+static size_t zerocopy_threshold = 0;      // Replays this long use MSG_ZEROCOPY; 0: never
+static int tcp_tuning = 0;                 // TCP_TUNE_* modes
+static unsigned busy_poll_us = 0;          // Spin this long for data before sleeping; 0: never
+static atomic_ulong busy_poll_hits = 0;    // Receives served while spinning
+static atomic_ulong busy_poll_sleeps = 0;  // ...and those that went to sleep after all
+
+// Connection timeouts (0: none), scheduled on a timing wheel the main loop
+// turns every TIMEOUT_TICK_MS
+static uint64_t idle_timeout_ms = 0;
+static uint64_t header_timeout_ms = 0;
+static uint64_t lifetime_ms = 0;
+static struct timewheel conn_timers;
+static unsigned long timeouts_idle = 0;    // Connections closed for each timeout
+static unsigned long timeouts_header = 0;
+static unsigned long timeouts_lifetime = 0;
+
+// Per-address admission control ("-A"), off unless rate_limited
+static bool rate_limited = false;
+static struct ratelimit limits;
+static unsigned long rl_conn_rejects = 0;  // Connections refused at accept
+static atomic_ulong rl_byte_delays = 0;    // Times a connection waited to receive more
+static atomic_ulong rl_delay_ms = 0;       // ...and for how long in total
+
+// Listen backlog ("-B") and live connection cap ("-L", 0: none). At the cap
+// the main loop stops watching the listeners until a connection ends, or
+// with shed_load accepts and closes the excess right away.
+static int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+static bool backlog_set = false;           // Inherited listeners take listen_backlog too
+static int max_conns = 0;
+static bool shed_load = false;
+static int nconns = 0;                     // Connections in the list, done or not
+static atomic_bool accept_paused = false;
+static int reap_fd = -1;                   // Connection threads wake a paused main loop
+static unsigned long accept_pauses = 0;
+static uint64_t accept_paused_ms = 0;      // Time spent not accepting
+static unsigned long conn_sheds = 0;       // Connections closed at accept over the cap
+static unsigned accept_queue_len = 0;      // Last sampled depth of the TCP accept queues...
+static unsigned accept_queue_peak = 0;
+static unsigned accept_queue_backlog = 0;  // ...and their backlogs, summed over listeners
+static bool accept_queue_warned = false;
+
+static unsigned timestamp_secs = 0;        // "-W": timestamp record interval; 0: none
+static unsigned long timestamp_records = 0;
+
+static atomic_ulong tcp_replays = 0;       // Replays on closed TCP connections...
+static atomic_ulong tcp_data_segs = 0;     // ...the data segments they took
+static atomic_ulong tcp_bytes_sent = 0;    // ...and the bytes in them
+static atomic_ulong spilled_packets = 0;   // Packets committed from a staging file
+static atomic_ulong spilled_bytes = 0;     // Bytes streamed to staging files
+static struct pool conn_pool = POOL_INITIALIZER(sizeof(struct conn), CONN_POOL_MAX);
+
+/**
+ * now_ms
+ * ------
+ * Returns the monotonic clock in milliseconds.
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /**
  * open_socket
  * -----------
- * Creates a TCP socket, binds it to PORT, and starts listening.
+ * Creates a TCP socket, binds it to port, and starts listening with the
+ * "-B" backlog. The socket is IPv6 with IPV6_V6ONLY off, so it accepts IPv4
+ * clients as well; hosts without IPv6 get a plain IPv4 socket.
  *
  * Returns:
  *   Socket descriptor on success, -1 on failure.
  */
-int open_socket(void) {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0); // TCP IPv4 socket
+int open_socket(uint16_t port) {
+    int sockfd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0); // TCP dual-stack socket
+    if (sockfd < 0 && errno == EAFNOSUPPORT)
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sockfd < 0) {
         perror("socket");
         return -1;
@@ -78,19 +310,31 @@ int open_socket(void) {
     int optval = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
-    struct sockaddr_in serv_addr;
+    struct sockaddr_storage serv_addr;
+    socklen_t addrlen;
     memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;          // IPv4
-    serv_addr.sin_addr.s_addr = INADDR_ANY;  // Bind to all interfaces
-    serv_addr.sin_port = htons(PORT);        // Port 9000
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&serv_addr;
+    struct sockaddr_in *in4 = (struct sockaddr_in *)&serv_addr;
+    int v6only = 0;
+    if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == 0) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;        // Bind to all interfaces, IPv4 included
+        in6->sin6_port = htons(port);        // Port 9000 or a channel port
+        addrlen = sizeof(*in6);
+    } else {
+        in4->sin_family = AF_INET;           // IPv4 only
+        in4->sin_addr.s_addr = INADDR_ANY;
+        in4->sin_port = htons(port);
+        addrlen = sizeof(*in4);
+    }
 
-    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    if (bind(sockfd, (struct sockaddr *)&serv_addr, addrlen) < 0) {
         perror("bind");
         close(sockfd);
         return -1;
     }
 
-    if (listen(sockfd, 10) < 0) {
+    if (listen(sockfd, listen_backlog) < 0) {
         perror("listen");
         close(sockfd);
         return -1;
@@ -99,6 +343,56 @@ int open_socket(void) {
     return sockfd;
 }
 
+/**
+ * open_unix_socket
+ * ----------------
+ * Creates a Unix domain stream socket at path and starts listening. Local
+ * producers connect here to skip the TCP loopback stack. A stale socket
+ * file is replaced; callers open the TCP port first, whose bind fails if
+ * another instance is still running.
+ *
+ * Returns:
+ *   Socket descriptor on success, -1 on failure.
+ */
+static int open_unix_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) return -1;
+
+    unlink(path);
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0666) < 0 || listen(sockfd, listen_backlog) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * format_peer
+ * -----------
+ * Writes a printable client address: IPv4 clients of the dual-stack socket
+ * show as plain IPv4, Unix clients as "local".
+ */
+static void format_peer(const struct sockaddr_storage *addr, char *buf, size_t len) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+    if (addr->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, len);
+    } else if (addr->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+        inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], buf, len);
+    } else if (addr->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &in6->sin6_addr, buf, len);
+    } else {
+        snprintf(buf, len, "local");
+    }
+}
+
 /**
  * daemonize
  * ---------
@@ -106,11 +400,30 @@ int open_socket(void) {
  * - Forks twice to detach from the controlling terminal.
  * - Creates a new session.
  * - Redirects stdin, stdout, stderr to /dev/null.
+ * The original process only exits once the daemon reports through the
+ * returned pipe that it is serving (see notify_ready), so callers such as
+ * start-stop-daemon return exactly when the server is ready.
+ *
+ * Returns:
+ *   Write end of the readiness pipe, in the daemon.
  */
-void daemonize(void) {
+int daemonize(void) {
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) exit(EXIT_FAILURE);
+
     pid_t pid = fork();
     if (pid < 0) exit(EXIT_FAILURE);
-    if (pid > 0) exit(EXIT_SUCCESS); // Parent exits
+    if (pid > 0) {
+        // Parent exits once the daemon is ready, or fails if it dies first
+        close(ready[1]);
+        char byte;
+        ssize_t n;
+        do {
+            n = read(ready[0], &byte, 1);
+        } while (n < 0 && errno == EINTR);
+        exit(n == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(ready[0]);
 
     if (setsid() < 0) exit(EXIT_FAILURE);
 
@@ -119,194 +432,2031 @@ void daemonize(void) {
     if (pid > 0) exit(EXIT_SUCCESS); // Parent exits
 
     umask(0);
-    chdir("/");
+    if (chdir("/") < 0) exit(EXIT_FAILURE);
 
     // Redirect standard file descriptors
-    freopen("/dev/null", "r", stdin);
-    freopen("/dev/null", "w", stdout);
-    freopen("/dev/null", "w", stderr);
+    if (!freopen("/dev/null", "r", stdin) ||
+        !freopen("/dev/null", "w", stdout) ||
+        !freopen("/dev/null", "w", stderr))
+        exit(EXIT_FAILURE);
+
+    return ready[1];
 }
 
 /**
- * handle_client
+ * notify_ready
+ * ------------
+ * Reports that the server is accepting clients: releases the process
+ * waiting in daemonize() and notifies a service manager through
+ * NOTIFY_SOCKET.
+ */
+static void notify_ready(int ready_fd) {
+    if (ready_fd >= 0) {
+        char byte = 1;
+        if (write(ready_fd, &byte, 1) != 1)
+            syslog(LOG_WARNING, "Failed to report readiness to parent");
+        close(ready_fd);
+    }
+
+    char state[64];
+    snprintf(state, sizeof(state), "READY=1\nMAINPID=%d", (int)getpid());
+    if (activation_notify(state) < 0)
+        syslog(LOG_WARNING, "Failed to notify service manager: %s", strerror(errno));
+}
+
+/**
+ * channel_get
+ * -----------
+ * Returns the channel named by the len bytes at name, opening (and, if it
+ * exists, recovering) its data file on first use.
+ *
+ * Returns:
+ *   The channel, or NULL if it cannot be opened or MAX_CHANNELS are open.
+ */
+static struct channel *channel_get(const char *name, size_t len) {
+    struct channel *ch = NULL;
+
+    pthread_mutex_lock(&channel_lock);
+    for (int i = 0; i < nchannels && !ch; ++i) {
+        if (strlen(channels[i]->name) == len && memcmp(channels[i]->name, name, len) == 0)
+            ch = channels[i];
+    }
+    if (!ch && nchannels < MAX_CHANNELS && (ch = calloc(1, sizeof(*ch))) != NULL) {
+        memcpy(ch->name, name, len);
+        snprintf(ch->path, sizeof(ch->path), "%s%s", CHANNEL_LOG_PREFIX, ch->name);
+        ch->log = (struct datalog)DATALOG_INITIALIZER;
+        ch->log.worker = worker_id;
+        if (datalog_open(&ch->log, ch->path, log_format, log_cache_bytes) < 0) {
+            free(ch);
+            ch = NULL;
+        } else {
+            channels[nchannels++] = ch;
+            syslog(LOG_INFO, "Opened channel %s", ch->name);
+        }
+    }
+    pthread_mutex_unlock(&channel_lock);
+    return ch;
+}
+
+/**
+ * channel_for_listener
+ * --------------------
+ * Returns the channel whose "-N" port the listening socket is bound to, or
+ * the default channel.
+ */
+static struct channel *channel_for_listener(int sockfd, const struct channel_port *ports,
+                                            int nports) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(sockfd, (struct sockaddr *)&addr, &len) < 0) return &default_channel;
+
+    uint16_t port = 0;
+    if (addr.ss_family == AF_INET6) port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    if (addr.ss_family == AF_INET) port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    for (int i = 0; i < nports; ++i) {
+        if (ports[i].port == port) {
+            struct channel *ch = channel_get(ports[i].name, strlen(ports[i].name));
+            return ch ? ch : &default_channel;
+        }
+    }
+    return &default_channel;
+}
+
+/**
+ * close_channels
+ * --------------
+ * Flushes and closes the data file of every channel.
+ */
+static void close_channels(void) {
+    pthread_mutex_lock(&channel_lock);
+    for (int i = 0; i < nchannels; ++i) datalog_close(&channels[i]->log);
+    pthread_mutex_unlock(&channel_lock);
+}
+
+/**
+ * remove_logs
+ * -----------
+ * Removes the data files of the default channel and of every named channel,
+ * including those only a pre-forked worker opened. A follower has no
+ * channels; the files matching theirs belong to its primary.
+ */
+static void remove_logs(void) {
+    remove(default_channel.path);
+    if (follow_endpoint) return;
+
+    glob_t g;
+    if (glob(CHANNEL_LOG_PREFIX "*", GLOB_NOSORT, NULL, &g) == 0) {
+        for (size_t i = 0; i < g.gl_pathc; ++i) remove(g.gl_pathv[i]);
+        globfree(&g);
+    }
+}
+
+/**
+ * recv_charge
+ * -----------
+ * Takes bytes of receive buffer out of the process-wide budget.
+ *
+ * Returns:
+ *   true on success, false if the budget does not have that much left.
+ */
+static bool recv_charge(size_t bytes) {
+    size_t used = atomic_load(&recv_used);
+    do {
+        // Connections taken over in an upgrade may have left it overdrawn
+        if (used >= recv_budget || bytes > recv_budget - used) return false;
+    } while (!atomic_compare_exchange_weak(&recv_used, &used, used + bytes));
+
+    size_t peak = atomic_load(&recv_peak);
+    while (used + bytes > peak && !atomic_compare_exchange_weak(&recv_peak, &peak, used + bytes))
+        ;
+    return true;
+}
+
+/**
+ * recv_release
+ * ------------
+ * Returns bytes of receive buffer to the budget.
+ */
+static void recv_release(size_t bytes) {
+    atomic_fetch_sub(&recv_used, bytes);
+}
+
+/**
+ * report_metrics
+ * --------------
+ * Logs the server's counters, and prints them as well when running in the
+ * foreground and print is set.
+ */
+static void report_metrics(bool print) {
+    struct pool_stats conns = { 0 }, bufs = { 0 };
+    pool_stats(&conn_pool, &conns);
+    pool_buf_stats(&bufs);
+
+    // Replays of all channels, with what they copied on the way out
+    unsigned long replays = 0, copies = 0, copied = 0, sends = 0;
+    unsigned long zc_sends = 0, zc_copied = 0, zc_fallbacks = 0;
+    unsigned long dd_refs = 0, dd_saved = 0, dd_hashed = 0, dd_hash_ns = 0;
+    for (int i = 0; i < nchannels; ++i) {
+        replays += atomic_load(&channels[i]->log.replays);
+        copies += atomic_load(&channels[i]->log.replay_copies);
+        copied += atomic_load(&channels[i]->log.replay_copied);
+        sends += atomic_load(&channels[i]->log.replay_sends);
+        zc_sends += atomic_load(&channels[i]->log.replay_zc_sends);
+        zc_copied += atomic_load(&channels[i]->log.replay_zc_copied);
+        zc_fallbacks += atomic_load(&channels[i]->log.replay_zc_fallbacks);
+        dd_refs += atomic_load(&channels[i]->log.dedupe_refs);
+        dd_saved += atomic_load(&channels[i]->log.dedupe_saved);
+        dd_hashed += atomic_load(&channels[i]->log.dedupe_hashed);
+        dd_hash_ns += atomic_load(&channels[i]->log.dedupe_hash_ns);
+    }
+    double per = replays ? 1.0 / replays : 0.0;
+    unsigned long tcp_segs = atomic_load(&tcp_data_segs);
+    unsigned long tcp_sent = atomic_load(&tcp_bytes_sent);
+    unsigned long tcp_reps = atomic_load(&tcp_replays);
+    unsigned long rl_evictions = 0;
+    size_t rl_tracked = rate_limited ? ratelimit_stats(&limits, &rl_evictions) : 0;
+
+    // CPU time of all threads, dead or alive, finer than /proc's clock ticks
+    struct rusage ru;
+    double cpu_ms = 0.0;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 +
+                 (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+
+    char line[2048];
+    snprintf(line, sizeof(line),
+             "recv_used_bytes=%zu recv_peak_bytes=%zu recv_budget_bytes=%zu "
+             "recv_cap_bytes=%zu recv_cap_rejects=%lu recv_budget_rejects=%lu "
+             "spilled_packets=%lu spilled_bytes=%lu packets_lost=%lu bytes_lost=%lu "
+             "conn_pool_gets=%lu conn_pool_hits=%lu buf_pool_gets=%lu buf_pool_hits=%lu "
+             "pool_hit_pct=%.1f pool_resident_bytes=%zu replays=%lu copies_per_replay=%.2f "
+             "copied_bytes_per_replay=%.1f sends_per_replay=%.2f zerocopy_sends=%lu "
+             "zerocopy_copied=%lu zerocopy_fallbacks=%lu tcp_replays=%lu tcp_data_segs=%lu "
+             "tcp_segs_per_replay=%.2f tcp_bytes_per_seg=%.0f busy_poll_hits=%lu "
+             "busy_poll_sleeps=%lu cpu_ms=%.1f timeouts_idle=%lu timeouts_header=%lu timeouts_lifetime=%lu "
+             "rl_conn_rejects=%lu rl_byte_delays=%lu rl_delay_ms=%lu rl_tracked=%zu "
+             "rl_evictions=%lu conns_live=%d conn_sheds=%lu accept_pauses=%lu "
+             "accept_paused_ms=%llu accept_queue_len=%u accept_queue_peak=%u "
+             "accept_queue_backlog=%u timestamp_records=%lu dedupe_refs=%lu "
+             "dedupe_saved_bytes=%lu dedupe_hashed_bytes=%lu dedupe_hash_ms=%.1f "
+             "dedupe_hash_mibps=%.0f",
+             atomic_load(&recv_used), atomic_load(&recv_peak), recv_budget, recv_cap,
+             atomic_load(&recv_cap_rejects), atomic_load(&recv_budget_rejects),
+             atomic_load(&spilled_packets), atomic_load(&spilled_bytes),
+             atomic_load(&packets_lost), atomic_load(&bytes_lost),
+             conns.gets, conns.hits, bufs.gets, bufs.hits,
+             conns.gets + bufs.gets ? 100.0 * (conns.hits + bufs.hits) / (conns.gets + bufs.gets)
+                                    : 0.0,
+             conns.resident + bufs.resident, replays, copies * per, copied * per, sends * per,
+             zc_sends, zc_copied, zc_fallbacks, tcp_reps, tcp_segs,
+             tcp_reps ? (double)tcp_segs / tcp_reps : 0.0,
+             tcp_segs ? (double)tcp_sent / tcp_segs : 0.0, atomic_load(&busy_poll_hits),
+             atomic_load(&busy_poll_sleeps), cpu_ms, timeouts_idle, timeouts_header, timeouts_lifetime,
+             rl_conn_rejects, atomic_load(&rl_byte_delays), atomic_load(&rl_delay_ms), rl_tracked,
+             rl_evictions, nconns, conn_sheds, accept_pauses,
+             (unsigned long long)accept_paused_ms, accept_queue_len, accept_queue_peak,
+             accept_queue_backlog, timestamp_records, dd_refs, dd_saved, dd_hashed,
+             dd_hash_ns / 1e6,
+             dd_hash_ns ? dd_hashed / (dd_hash_ns / 1e9) / (1024.0 * 1024.0) : 0.0);
+    if (worker_id)
+        syslog(LOG_INFO, "Worker %u metrics: %s", worker_id, line);
+    else
+        syslog(LOG_INFO, "Metrics: %s", line);
+    if (print && !daemon_mode) printf("Metrics: %s\n", line);
+}
+
+/**
+ * spill
+ * -----
+ * Streams len bytes of an oversized partial packet to the connection's
+ * staging file, creating it first if needed. The file has no name, so the
+ * kernel reclaims it even if the process dies.
+ *
+ * Returns:
+ *   0 on success, -1 on failure.
+ */
+static int spill(struct conn *c, const char *buf, size_t len) {
+    if (c->spill_fd < 0) {
+        c->spill_fd = open(SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (c->spill_fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+            // No O_TMPFILE support: a named file, unlinked right away
+            char path[] = SPILL_DIR "/aesdsocket-spill-XXXXXX";
+            c->spill_fd = mkostemp(path, O_CLOEXEC);
+            if (c->spill_fd >= 0) unlink(path);
+        }
+        if (c->spill_fd < 0) return -1;
+    }
+
+    // Positional writes: the file is truncated, not reopened, between packets
+    while (len > 0) {
+        ssize_t n = pwrite(c->spill_fd, buf, len, c->spill_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        c->spill_len += n;
+        atomic_fetch_add(&spilled_bytes, n);
+    }
+    return 0;
+}
+
+/**
+ * park_connection
+ * ---------------
+ * Called by a connection thread at a packet boundary while a handoff is in
+ * progress. Publishes the partial packet and waits for the outcome.
+ *
+ * Returns:
+ *   true if the connection was handed to the new instance, false if the
+ *   handoff was abandoned and the thread should keep serving.
+ */
+static bool park_connection(struct conn *c, char *buf, size_t cap, size_t len) {
+    pthread_mutex_lock(&conn_lock);
+    c->pending = buf;
+    c->pending_cap = cap;
+    c->pending_len = len;
+    c->parked = true;
+    pthread_cond_broadcast(&park_cond);
+    while (handoff_state == HANDOFF_PARKING)
+        pthread_cond_wait(&park_cond, &conn_lock);
+    c->parked = false;
+    c->pending = NULL;
+    bool handed_off = handoff_state == HANDOFF_DONE;
+    pthread_mutex_unlock(&conn_lock);
+    return handed_off;
+}
+
+/**
+ * negotiate_framing
+ * -----------------
+ * Decides the channel and framing of a new connection from its first len
+ * bytes: an optional channel preamble, then a preamble from framing.h that
+ * selects framed records or batch acknowledgement, anything else newline
+ * packets.
+ *
+ * Returns:
+ *   Number of preamble bytes to skip, -1 if more bytes are needed, -2 if
+ *   the channel preamble is malformed, its channel cannot be opened, or this
+ *   is a follower, which only replicates the default channel, or -3 if the
+ *   connection asks for framed records on a raw data file, where they would
+ *   run into the newline packets around them.
+ */
+static int negotiate_framing(struct conn *c, const char *buf, size_t len) {
+    size_t skip = 0;
+    size_t cmp = len < FRAMED_PREAMBLE_LEN ? len : FRAMED_PREAMBLE_LEN;
+    if (memcmp(buf, CHANNEL_PREAMBLE, cmp) == 0) {
+        if (len < FRAMED_PREAMBLE_LEN) return -1;
+        if (follow_endpoint) return -2;
+        const char *name = buf + FRAMED_PREAMBLE_LEN;
+        size_t avail = len - FRAMED_PREAMBLE_LEN;
+        const char *nl = memchr(name, '\n', avail < CHANNEL_NAME_MAX + 1 ? avail
+                                                                        : CHANNEL_NAME_MAX + 1);
+        if (!nl) return avail > CHANNEL_NAME_MAX ? -2 : -1;
+        if (!channel_name_valid(name, nl - name) ||
+            !(c->channel = channel_get(name, nl - name)))
+            return -2;
+        skip = nl + 1 - buf;
+        buf += skip;
+        len -= skip;
+        cmp = len < FRAMED_PREAMBLE_LEN ? len : FRAMED_PREAMBLE_LEN;
+    }
+
+    bool framed = memcmp(buf, FRAMED_PREAMBLE, cmp) == 0;
+    bool batch = memcmp(buf, BATCH_PREAMBLE, cmp) == 0;
+    if (!framed && !batch) {
+        c->framing = FRAMING_NEWLINE;
+        return skip;
+    }
+    if (len < FRAMED_PREAMBLE_LEN) return -1;
+    if (framed && !c->channel->log.checksummed) return -3;
+    c->framing = framed ? FRAMING_VARINT : FRAMING_BATCH;
+    return skip + FRAMED_PREAMBLE_LEN;
+}
+
+/**
+ * recv_busy
+ * ---------
+ * recv() for busy-poll mode: spins on non-blocking receives for up to
+ * busy_poll_us, yielding the CPU between attempts so a producer sharing
+ * the core still gets to run, and only then blocks. The kernel's own busy
+ * polling (SO_BUSY_POLL) covers the time spent inside recv() itself.
+ *
+ * Returns:
+ *   As recv(); a pending handoff ends the spin with EINTR, like the signal
+ *   that interrupts a blocking receive.
+ */
+static ssize_t recv_busy(int fd, void *buf, size_t len) {
+    if (busy_poll_us) {
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+            if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                atomic_fetch_add_explicit(&busy_poll_hits, 1, memory_order_relaxed);
+                return n;
+            }
+            if (handoff_state == HANDOFF_PARKING) {
+                errno = EINTR;
+                return -1;
+            }
+            sched_yield();
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 <
+                 busy_poll_us);
+        atomic_fetch_add_explicit(&busy_poll_sleeps, 1, memory_order_relaxed);
+    }
+    return recv(fd, buf, len, 0);
+}
+
+/**
+ * throttle
+ * --------
+ * Charges n bytes just received to the client's byte bucket and, while
+ * it is in debt, holds off the next recv(): the client's data waits in the
+ * socket buffer, where TCP flow control slows it down, instead of being
+ * buffered here. A shutdown or handoff ends the wait early.
+ */
+static void throttle(struct conn *c, size_t n) {
+    uint64_t wait = ratelimit_bytes(&limits, &c->addr, n, now_ms());
+    if (!wait) return;
+    atomic_fetch_add(&rl_byte_delays, 1);
+    atomic_fetch_add(&rl_delay_ms, wait);
+    uint64_t until = now_ms() + wait, now;
+    while ((now = now_ms()) < until && !exit_requested && handoff_state == HANDOFF_NONE) {
+        uint64_t ms = until - now < TIMEOUT_TICK_MS ? until - now : TIMEOUT_TICK_MS;
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * commit_record
  * -------------
- * Receives data from a connected client, processes newline-terminated packets,
- * appends them to the data file, and sends the full file contents back to the client.
- */
-void handle_client(int clientfd, struct sockaddr_in *cli_addr) {
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &cli_addr->sin_addr, client_ip, sizeof(client_ip));
-    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
-
-    // Open the data file in append mode
-    FILE *fp = fopen(DATAFILE, "a");
-    if (!fp) {
-        syslog(LOG_ERR, "Failed to open %s", DATAFILE);
-        close(clientfd);
-        return;
+ * Appends count complete records, held back to back in buf, to the data
+ * file of the connection's channel with a single write and replays the file
+ * up to their end to the client once. Only batch connections commit more
+ * than one at a time. A packet whose start was spilled to the staging file
+ * is committed on its own, from there and buf. A follower appends nothing:
+ * its records only come from the primary, so a client's record just asks
+ * for a replay of everything replicated so far.
+ */
+static void commit_record(struct conn *c, const char *buf, size_t len, unsigned count) {
+    char hdr[BATCH_ACK_MAX];
+    size_t hdrlen = 0;
+
+    // The header timeout covers receiving the first record, not appending
+    // it or a replay of a large file
+    atomic_store_explicit(&c->committed, true, memory_order_relaxed);
+
+    struct datalog *log = &c->channel->log;
+    off_t replay_len;
+    if (follow_endpoint) {
+        replay_len = datalog_length(log);
+    } else if (c->spill_len > 0) {
+        replay_len = datalog_append_staged(log, c->spill_fd, c->spill_len, buf, len);
+        atomic_fetch_add(&spilled_packets, 1);
+    } else {
+        replay_len = datalog_append(log, buf, len);
+    }
+    if (c->spill_len > 0) {
+        // Keep the staging file for the next oversized packet
+        if (ftruncate(c->spill_fd, 0) < 0)
+            syslog(LOG_WARNING, "Failed to truncate staging file: %s", strerror(errno));
+        c->spill_len = 0;
+    }
+    if (replay_len >= 0 && c->framing == FRAMING_BATCH) {
+        hdrlen = snprintf(hdr, sizeof(hdr), "#ack %llu %llu %lld\n",
+                          (unsigned long long)c->seq + 1,
+                          (unsigned long long)c->seq + count, (long long)replay_len);
     }
+    c->seq += count;
+
+    // Corked, the header and the records leave in full-sized segments and
+    // the tail goes out at the uncork. Zerocopy sends wait for their ACKs,
+    // which a corked tail would hold up, and are large enough anyway.
+    int one = 1, zero = 0;
+    bool cork = (tcp_tuning & TCP_TUNE_CORK) && c->addr.ss_family != AF_UNIX &&
+                !c->replay.zc_threshold;
+    if (cork) setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+    int rc = -1;
+    if (replay_len >= 0 && c->framing == FRAMING_VARINT)
+        rc = datalog_replay_framed(log, &c->replay, c->fd, replay_len);
+    else if (replay_len >= 0)
+        rc = datalog_replay(log, &c->replay, c->fd, replay_len, hdr, hdrlen);
+    if (rc < 0)
+        atomic_fetch_add(&packets_lost, count);
+    else
+        c->replays++;
+    if (cork) setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+}
+
+/**
+ * handle_client
+ * -------------
+ * Receives data from a connected client, splits it into records (newline-
+ * terminated packets, or varint length-prefixed records on framed
+ * connections), appends them to the data file, and replays the file to the
+ * client after each. Returns once the client disconnects or the connection
+ * is shut down for draining; records already received are still committed
+ * and replayed.
+ */
+void handle_client(struct conn *c) {
+    int clientfd = c->fd;
+    char client_ip[INET6_ADDRSTRLEN];
+    format_peer(&c->addr, client_ip, sizeof(client_ip));
 
     size_t bufsize = 1024;
-    char *recvbuf = malloc(bufsize); // Buffer to accumulate packet data
+    char *recvbuf;        // Buffer to accumulate packet data
+    size_t datalen = 0;   // Number of bytes currently in recvbuf
+    size_t record = 0;    // Framed: size of the record at the start of recvbuf, once known
+
+    if (c->pending) {
+        // Connection handed over by a previous instance, with its partial
+        // packet; its buffer is charged even beyond the budget
+        recvbuf = c->pending;
+        bufsize = c->pending_cap;
+        datalen = c->pending_len;
+        c->pending = NULL;
+        atomic_fetch_add(&recv_used, bufsize);
+        syslog(LOG_INFO, "Took over connection from %s", client_ip);
+    } else if (!recv_charge(bufsize)) {
+        atomic_fetch_add(&recv_budget_rejects, 1);
+        syslog(LOG_WARNING, "Receive budget of %zu bytes exhausted, refusing %s",
+               recv_budget, client_ip);
+        return;
+    } else {
+        recvbuf = pool_buf_get(bufsize);
+        syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+    }
     if (!recvbuf) {
+        recv_release(bufsize);
         syslog(LOG_ERR, "malloc failed");
-        fclose(fp);
-        close(clientfd);
         return;
     }
+    // Unix sockets have no zerocopy path, nor Nagle
+    if (zerocopy_threshold && c->addr.ss_family != AF_UNIX &&
+        bufchain_zerocopy(&c->replay, clientfd, zerocopy_threshold) < 0)
+        syslog(LOG_WARNING, "MSG_ZEROCOPY unavailable for %s: %s", client_ip, strerror(errno));
+    int one = 1, busy = busy_poll_us;
+    if ((tcp_tuning & TCP_TUNE_NODELAY) && c->addr.ss_family != AF_UNIX)
+        setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (busy_poll_us && c->addr.ss_family != AF_UNIX)
+        setsockopt(clientfd, SOL_SOCKET, SO_BUSY_POLL, &busy, sizeof(busy));
 
-    size_t datalen = 0;   // Number of bytes currently in recvbuf
-    char temp[512];       // Temporary buffer for recv()
-    ssize_t n;
+    ssize_t n = datalen;  // Bytes handed over are processed like a fresh recv()
+    size_t scan = 0;      // Newline: bytes of recvbuf already searched
 
-    while (!exit_requested && (n = recv(clientfd, temp, sizeof(temp), 0)) > 0) {
-        size_t temp_offset = 0;
+    for (;;) {
+        if (n == 0) {
+            if (handoff_state == HANDOFF_PARKING) {
+                if (park_connection(c, recvbuf, bufsize, datalen)) {
+                    // The new instance owns the connection and the partial packet now
+                    pool_buf_put(recvbuf, bufsize);
+                    recv_release(bufsize);
+                    if (c->spill_fd >= 0) close(c->spill_fd);
+                    syslog(LOG_INFO, "Handed over connection from %s", client_ip);
+                    return;
+                }
+                continue;
+            }
 
-        while (temp_offset < n) {
-            // Resize recvbuf if needed
-            if (datalen + (n - temp_offset) >= bufsize) {
+            // Make room for a whole framed record, or at least 512 more
+            // bytes, within the connection's cap and the process budget
+            if (record > recv_cap || datalen >= recv_cap) {
+                atomic_fetch_add(&recv_cap_rejects, 1);
+                syslog(LOG_WARNING, "Packet from %s exceeds the %zu byte receive cap, closing",
+                       client_ip, recv_cap);
+                break;
+            }
+            size_t need = datalen + 512;
+            if (record > need) need = record;
+            if (need > recv_cap) need = recv_cap;
+            if (need > bufsize) {
                 size_t newsize = bufsize * 2;
-                while (datalen + (n - temp_offset) >= newsize)
+                while (need > newsize)
                     newsize *= 2;
-                char *newbuf = realloc(recvbuf, newsize);
+                if (newsize > recv_cap) newsize = recv_cap;
+                if (!recv_charge(newsize - bufsize)) {
+                    atomic_fetch_add(&recv_budget_rejects, 1);
+                    syslog(LOG_WARNING, "Receive budget of %zu bytes exhausted, closing %s "
+                           "with %zu bytes of partial packet", recv_budget, client_ip, datalen);
+                    break;
+                }
+                char *newbuf = pool_buf_resize(recvbuf, bufsize, datalen, newsize);
                 if (!newbuf) {
+                    recv_release(newsize - bufsize);
                     syslog(LOG_ERR, "realloc failed");
-                    free(recvbuf);
-                    fclose(fp);
-                    close(clientfd);
-                    return;
+                    break;
                 }
                 recvbuf = newbuf;
                 bufsize = newsize;
             }
 
-            // Copy data from temp to recvbuf
-            size_t copylen = n - temp_offset;
-            memcpy(recvbuf + datalen, temp + temp_offset, copylen);
-            datalen += copylen;
-            temp_offset += copylen;
-
-            // Process complete packets in recvbuf
-            size_t start = 0;
-            for (size_t i = 0; i < datalen; ++i) {
-                if (recvbuf[i] == '\n') {
-                    size_t pktlen = i - start + 1;
-
-                    // Append packet to data file
-                    fwrite(recvbuf + start, 1, pktlen, fp);
-                    fflush(fp);
-
-                    // Send the full file contents back to the client
-                    FILE *fp2 = fopen(DATAFILE, "r");
-                    if (!fp2) {
-                        syslog(LOG_ERR, "Failed to open %s for reading", DATAFILE);
-                        free(recvbuf);
-                        fclose(fp);
-                        close(clientfd);
-                        return;
-                    }
-
-                    char sendbuf[1024];
-                    ssize_t nn;
-                    while ((nn = fread(sendbuf, 1, sizeof(sendbuf), fp2)) > 0) {
-                        if (send(clientfd, sendbuf, nn, 0) < 0) {
-                            syslog(LOG_ERR, "Failed to send data to client");
-                            break;
-                        }
-                    }
-                    fclose(fp2);
-
-                    start = i + 1; // Move start past the processed packet
+            // Receive straight into place; framed records need no scanning
+            n = recv_busy(clientfd, recvbuf + datalen, bufsize - datalen);
+            if (n < 0 && errno == EINTR) {  // Woken up to check handoff_state
+                n = 0;
+                continue;
+            }
+            if (n <= 0) break;
+            if (idle_timeout_ms)
+                atomic_store_explicit(&c->last_rx_ms, now_ms(), memory_order_relaxed);
+            if (rate_limited) throttle(c, n);
+            scan = datalen;
+            datalen += n;
+        }
+        n = 0;
+
+        size_t start = 0;
+        if (c->framing == FRAMING_UNKNOWN) {
+            int skip = negotiate_framing(c, recvbuf, datalen);
+            if (skip == -2) {
+                syslog(LOG_ERR, "Bad channel from %s, closing", client_ip);
+                break;
+            }
+            if (skip == -3) {
+                syslog(LOG_ERR, "Framed records from %s need a checksummed data file, closing",
+                       client_ip);
+                break;
+            }
+            if (skip < 0) continue;
+            start = scan = skip;
+        }
+
+        bool malformed = false;
+        if (c->framing == FRAMING_VARINT) {
+            // Process complete records in recvbuf
+            while (start < datalen) {
+                uint64_t body;
+                int hdr = varint_decode(recvbuf + start, datalen - start, &body);
+                if (hdr == 0) break;
+                if (hdr < 0 || body > FRAMED_MAX_RECORD) {
+                    malformed = true;
+                    break;
                 }
+                record = hdr + body;
+                if (datalen - start < record) break;
+
+                commit_record(c, recvbuf + start + hdr, body, 1);
+                start += record;
+                record = 0;
+            }
+        } else if (c->framing == FRAMING_BATCH) {
+            // A spilled packet goes out on its own, then every other packet
+            // completed by this recv() in one commit
+            char *nl;
+            if (c->spill_len > 0 && (nl = memchr(recvbuf + scan, '\n', datalen - scan)) != NULL) {
+                scan = nl - recvbuf + 1;
+                commit_record(c, recvbuf + start, scan - start, 1);
+                start = scan;
             }
+            unsigned count = 0;
+            size_t end = start;
+            while ((nl = memchr(recvbuf + scan, '\n', datalen - scan)) != NULL) {
+                end = scan = nl - recvbuf + 1;
+                count++;
+            }
+            if (count > 0) {
+                commit_record(c, recvbuf + start, end - start, count);
+                start = end;
+            }
+        } else {
+            // Process complete packets in recvbuf; only bytes not yet
+            // searched can contain a new packet boundary
+            char *nl;
+            while ((nl = memchr(recvbuf + scan, '\n', datalen - scan)) != NULL) {
+                size_t end = nl - recvbuf + 1;
+                commit_record(c, recvbuf + start, end - start, 1);
+                start = scan = end; // Move start past the processed packet
+            }
+        }
+        if (malformed) {
+            syslog(LOG_ERR, "Malformed or oversized record from %s, closing", client_ip);
+            break;
+        }
+
+        // Shift leftover data to the start of the buffer for next recv()
+        if (start > 0) {
+            memmove(recvbuf, recvbuf + start, datalen - start);
+            datalen -= start;
+        }
 
-            // Shift leftover data to the start of the buffer for next recv()
-            if (start > 0 && start < datalen) {
-                memmove(recvbuf, recvbuf + start, datalen - start);
-                datalen -= start;
-            } else if (start == datalen) {
-                datalen = 0;
+        // A newline packet past the threshold continues in the staging file,
+        // so memory stays flat however large it gets
+        if (spill_threshold && datalen > 0 && c->framing != FRAMING_VARINT &&
+            (c->spill_len > 0 || datalen >= spill_threshold)) {
+            if (spill(c, recvbuf, datalen) < 0) {
+                syslog(LOG_ERR, "Failed to spill partial packet from %s: %s, closing",
+                       client_ip, strerror(errno));
+                break;
             }
+            datalen = 0;
         }
     }
 
-    free(recvbuf);
-    fclose(fp);
-    close(clientfd);
+    // A partial packet can only be left behind by a disconnect or a drain
+    if (datalen > 0 || c->spill_len > 0) {
+        atomic_fetch_add(&packets_lost, 1);
+        atomic_fetch_add(&bytes_lost, datalen + c->spill_len);
+        syslog(LOG_INFO, "Dropped %lld bytes of partial packet from %s",
+               (long long)(datalen + c->spill_len), client_ip);
+    }
+    if (c->spill_fd >= 0) close(c->spill_fd);
+
+    // Fields the kernel is too old to fill stay zero
+    struct tcp_info ti = { 0 };
+    socklen_t tilen = sizeof(ti);
+    if (c->addr.ss_family != AF_UNIX &&
+        getsockopt(clientfd, IPPROTO_TCP, TCP_INFO, &ti, &tilen) == 0) {
+        atomic_fetch_add(&tcp_replays, c->replays);
+        atomic_fetch_add(&tcp_data_segs, ti.tcpi_data_segs_out);
+        atomic_fetch_add(&tcp_bytes_sent, ti.tcpi_bytes_sent);
+    }
+
+    pool_buf_put(recvbuf, bufsize);
+    recv_release(bufsize);
     syslog(LOG_INFO, "Closed connection from %s", client_ip);
 }
 
+/**
+ * conn_thread
+ * -----------
+ * Thread entry point for one connection. The socket is closed under
+ * conn_lock so the main loop can never shut down a recycled descriptor.
+ */
+static void *conn_thread(void *arg) {
+    struct conn *c = arg;
+
+    handle_client(c);
+    bufchain_release(&c->replay);
+
+    pthread_mutex_lock(&conn_lock);
+    close(c->fd);
+    c->fd = -1;
+    c->done = true;
+    pthread_mutex_unlock(&conn_lock);
+    // A main loop paused at the connection cap waits for this to resume
+    if (atomic_load(&accept_paused)) eventfd_write(reap_fd, 1);
+    return NULL;
+}
+
+/**
+ * reap_connections
+ * ----------------
+ * Joins connection threads that have finished and recycles their state.
+ *
+ * Returns:
+ *   Number of connections still running.
+ */
+static int reap_connections(void) {
+    int live = 0;
+    struct conn **link = &SLIST_FIRST(&conns);
+
+    pthread_mutex_lock(&conn_lock);
+    while (*link) {
+        struct conn *c = *link;
+        if (!c->done) {
+            live++;
+            link = &SLIST_NEXT(c, entries);
+            continue;
+        }
+        *link = SLIST_NEXT(c, entries);
+        pthread_join(c->thread, NULL);
+        timer_del(&conn_timers, &c->timer);
+        pool_put(&conn_pool, c);
+        nconns--;
+    }
+    pthread_mutex_unlock(&conn_lock);
+    return live;
+}
+
+/**
+ * shutdown_connections
+ * --------------------
+ * Applies shutdown(how) to every live connection that was not handed to a
+ * new instance. SHUT_RD lets threads finish the data already received and
+ * then see end-of-file; SHUT_RDWR also aborts replays in progress.
+ */
+static void shutdown_connections(int how) {
+    struct conn *c;
+
+    pthread_mutex_lock(&conn_lock);
+    SLIST_FOREACH(c, &conns, entries) {
+        if (c->fd != -1 && !c->handed_off) shutdown(c->fd, how);
+    }
+    pthread_mutex_unlock(&conn_lock);
+}
+
+/**
+ * timeout_deadline
+ * ----------------
+ * Returns when the first of the connection's timeouts runs out, in
+ * milliseconds on the now_ms() clock, or 0 if it has none. Sets *kind to
+ * the counter of that timeout.
+ */
+static uint64_t timeout_deadline(struct conn *c, unsigned long **kind) {
+    uint64_t deadline = 0;
+    if (idle_timeout_ms) {
+        deadline = atomic_load_explicit(&c->last_rx_ms, memory_order_relaxed) + idle_timeout_ms;
+        *kind = &timeouts_idle;
+    }
+    if (header_timeout_ms && !atomic_load_explicit(&c->committed, memory_order_relaxed) &&
+        (!deadline || c->start_ms + header_timeout_ms < deadline)) {
+        deadline = c->start_ms + header_timeout_ms;
+        *kind = &timeouts_header;
+    }
+    if (lifetime_ms && (!deadline || c->start_ms + lifetime_ms < deadline)) {
+        deadline = c->start_ms + lifetime_ms;
+        *kind = &timeouts_lifetime;
+    }
+    return deadline;
+}
+
+/**
+ * arm_timeout
+ * -----------
+ * Schedules the connection's timer for its first timeout deadline.
+ * Activity does not touch the wheel: when the timer fires, the deadline is
+ * computed afresh from the latest activity and the timer rescheduled if it
+ * has moved on, so connection threads never contend for the wheel.
+ */
+static void arm_timeout(struct conn *c) {
+    unsigned long *kind;
+    c->start_ms = now_ms();
+    atomic_store_explicit(&c->last_rx_ms, c->start_ms, memory_order_relaxed);
+    uint64_t deadline = timeout_deadline(c, &kind);
+    if (deadline)
+        timer_add(&conn_timers, &c->timer, (deadline + TIMEOUT_TICK_MS - 1) / TIMEOUT_TICK_MS);
+}
+
+/**
+ * fire_timeout
+ * ------------
+ * Timing wheel callback: closes the connection if a timeout has run out,
+ * otherwise reschedules it for the new deadline. The shutdown wakes the
+ * thread from recv() as if the client had gone; a partial packet is
+ * dropped and counted as lost.
+ */
+static void fire_timeout(struct timer *t, void *arg) {
+    (void)arg;
+    struct conn *c = (struct conn *)((char *)t - offsetof(struct conn, timer));
+    // done is written by the connection thread under conn_lock
+    pthread_mutex_lock(&conn_lock);
+    bool done = c->done;
+    pthread_mutex_unlock(&conn_lock);
+    if (done) return;
+    uint64_t now = now_ms();
+    // Sockets being handed over are no longer only ours to shut down
+    if (handoff_state != HANDOFF_NONE) {
+        timer_add(&conn_timers, t, now / TIMEOUT_TICK_MS + 1);
+        return;
+    }
+
+    unsigned long *kind;
+    uint64_t deadline = timeout_deadline(c, &kind);
+    if (deadline > now) {
+        timer_add(&conn_timers, t, (deadline + TIMEOUT_TICK_MS - 1) / TIMEOUT_TICK_MS);
+        return;
+    }
+
+    char client_ip[INET6_ADDRSTRLEN];
+    format_peer(&c->addr, client_ip, sizeof(client_ip));
+    pthread_mutex_lock(&conn_lock);
+    if (c->fd != -1) shutdown(c->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&conn_lock);
+    (*kind)++;
+    syslog(LOG_INFO, "Closing %s: %s timeout", client_ip,
+           kind == &timeouts_idle ? "idle" : kind == &timeouts_header ? "header" : "lifetime");
+}
+
+/**
+ * start_connection
+ * ----------------
+ * Starts the thread for an accepted (or handed over) connection and adds it
+ * to the connection list.
+ */
+static void start_connection(struct conn *c) {
+    pthread_mutex_lock(&conn_lock);
+    if (pthread_create(&c->thread, NULL, conn_thread, c) != 0) {
+        pthread_mutex_unlock(&conn_lock);
+        syslog(LOG_ERR, "Failed to create connection thread");
+        close(c->fd);
+        pool_buf_put(c->pending, c->pending_cap);
+        pool_put(&conn_pool, c);
+        return;
+    }
+    SLIST_INSERT_HEAD(&conns, c, entries);
+    nconns++;
+    pthread_mutex_unlock(&conn_lock);
+    arm_timeout(c);
+}
+
+/**
+ * accept_client
+ * -------------
+ * Accepts one pending connection and starts its thread, unless its address
+ * is over its rate limit or, when shedding load, the server is at its
+ * connection cap.
+ */
+static void accept_client(int sockfd, struct channel *channel) {
+    struct conn *c = pool_get(&conn_pool);
+    if (!c) {
+        syslog(LOG_ERR, "malloc failed");
+        return;
+    }
+    memset(c, 0, sizeof(*c));
+    c->channel = channel;
+    c->spill_fd = -1;
+
+    socklen_t clilen = sizeof(c->addr);
+    c->fd = accept4(sockfd, (struct sockaddr *)&c->addr, &clilen, SOCK_CLOEXEC);
+    if (c->fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) syslog(LOG_ERR, "accept: %s", strerror(errno));
+        pool_put(&conn_pool, c);
+        return;
+    }
+    // Refused before a thread or a buffer is spent on it
+    if (rate_limited && !ratelimit_connect(&limits, &c->addr, now_ms())) {
+        rl_conn_rejects++;
+        close(c->fd);
+        pool_put(&conn_pool, c);
+        return;
+    }
+    if (shed_load && nconns >= max_conns && reap_connections() >= max_conns) {
+        conn_sheds++;
+        close(c->fd);
+        pool_put(&conn_pool, c);
+        return;
+    }
+
+    start_connection(c);
+}
+
+/**
+ * drain_connections
+ * -----------------
+ * Stops all connections gracefully: each one finishes the packets it has
+ * already received, then closes. Connections still busy after timeout_ms
+ * are cut off.
+ */
+static void drain_connections(int timeout_ms) {
+    uint64_t deadline = now_ms() + timeout_ms;
+
+    shutdown_connections(SHUT_RD);
+    while (reap_connections() > 0) {
+        if (now_ms() >= deadline) {
+            syslog(LOG_WARNING, "Drain timeout expired, aborting remaining connections");
+            shutdown_connections(SHUT_RDWR);
+            deadline = UINT64_MAX;
+        }
+        struct timespec ts = { 0, 10 * 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * wake_handler
+ * ------------
+ * WAKE_SIGNAL only exists to interrupt blocking calls; nothing to do here.
+ */
+static void wake_handler(int signo) {
+    (void)signo;
+}
+
+/**
+ * wait_parked
+ * -----------
+ * With conn_lock held and handoff_state set to HANDOFF_PARKING, keeps waking
+ * connection threads until every live one has parked.
+ *
+ * Returns:
+ *   Number of parked connections, or -1 if some thread did not park in time.
+ */
+static int wait_parked(int timeout_ms) {
+    uint64_t deadline = now_ms() + timeout_ms;
+
+    for (;;) {
+        int parked = 0, busy = 0;
+        struct conn *c;
+        SLIST_FOREACH(c, &conns, entries) {
+            if (c->done) continue;
+            if (c->parked) {
+                parked++;
+            } else {
+                // Re-sent every round in case the signal raced with recv()
+                pthread_kill(c->thread, WAKE_SIGNAL);
+                busy++;
+            }
+        }
+        if (busy == 0) return parked;
+        if (now_ms() >= deadline) return -1;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 10 * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&park_cond, &conn_lock, &ts);
+    }
+}
+
+/**
+ * send_parked_clients
+ * -------------------
+ * Sends every parked connection, with its partial packet, to the new instance.
+ *
+ * Returns:
+ *   0 on success, -1 on failure.
+ */
+static int send_parked_clients(int peer) {
+    struct conn *c;
+
+    SLIST_FOREACH(c, &conns, entries) {
+        if (c->done || !c->parked) continue;
+
+        struct handoff_msg msg = { .magic = HANDOFF_MAGIC, .type = HANDOFF_CLIENT };
+        msg.value = c->pending_len;
+        if (c->framing == FRAMING_NEWLINE) msg.flags = HANDOFF_CLIENT_NEWLINE;
+        if (c->framing == FRAMING_VARINT) msg.flags = HANDOFF_CLIENT_FRAMED;
+        if (c->framing == FRAMING_BATCH) msg.flags = HANDOFF_CLIENT_BATCH;
+        msg.count = (uint32_t)c->seq;
+        memcpy(&msg.addr, &c->addr, sizeof(c->addr));
+        msg.len = strlen(c->channel->name);
+        int fds[2] = { c->fd, c->spill_fd };
+        if (handoff_send(peer, &msg, c->channel->name, fds, c->spill_len > 0 ? 2 : 1) < 0)
+            return -1;
+
+        for (size_t off = 0; off < c->pending_len; off += HANDOFF_CHUNK) {
+            struct handoff_msg data = { .magic = HANDOFF_MAGIC, .type = HANDOFF_DATA };
+            size_t left = c->pending_len - off;
+            data.len = left < HANDOFF_CHUNK ? left : HANDOFF_CHUNK;
+            if (handoff_send(peer, &data, c->pending + off, NULL, 0) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * serve_handoff
+ * -------------
+ * Handles an upgrade request on the control socket: passes the listening
+ * sockets and the log state to the requesting process and, if it asked for
+ * them, every live connection, parked at a packet boundary first.
+ *
+ * Returns:
+ *   true if the new instance took over, false if the handoff was abandoned
+ *   and this instance keeps serving.
+ */
+static bool serve_handoff(int ctlfd, const int *listeners, int nlisteners) {
+    int peer = accept4(ctlfd, NULL, NULL, SOCK_CLOEXEC);
+    if (peer < 0) return false;
+
+    struct timeval tv = { .tv_sec = 5 };
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    struct handoff_msg req;
+    if (handoff_recv(peer, &req, NULL, 0, NULL, NULL) < 0 || req.type != HANDOFF_REQUEST) {
+        syslog(LOG_ERR, "Ignoring malformed handoff request");
+        close(peer);
+        return false;
+    }
+    bool want_clients = req.flags & HANDOFF_WANT_CLIENTS;
+
+    pthread_mutex_lock(&conn_lock);
+    int nclients = 0;
+    if (want_clients) {
+        handoff_state = HANDOFF_PARKING;
+        nclients = wait_parked(HANDOFF_PARK_TIMEOUT_MS);
+    }
+
+    bool ok = nclients >= 0;
+    if (ok) {
+        struct handoff_msg state = { .magic = HANDOFF_MAGIC, .type = HANDOFF_STATE };
+        state.count = nclients;
+        state.value = default_channel.log.size;
+        ok = handoff_send(peer, &state, NULL, listeners, nlisteners) == 0;
+    }
+    if (ok && want_clients)
+        ok = send_parked_clients(peer) == 0;
+
+    struct handoff_msg ack;
+    if (ok)
+        ok = handoff_recv(peer, &ack, NULL, 0, NULL, NULL) >= 0 && ack.type == HANDOFF_ACK;
+
+    handoff_state = ok ? HANDOFF_DONE : HANDOFF_NONE;
+    if (ok && want_clients) {
+        struct conn *c;
+        SLIST_FOREACH(c, &conns, entries) c->handed_off = c->parked && !c->done;
+    }
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&conn_lock);
+    close(peer);
+
+    if (ok)
+        syslog(LOG_INFO, "Handed off %d listeners and %d connections to new instance",
+               nlisteners, nclients);
+    else
+        syslog(LOG_ERR, "Handoff failed, continuing to serve");
+    return ok;
+}
+
+/**
+ * receive_handoff
+ * ---------------
+ * Asks the instance running on CONTROL_SOCKET for its listening sockets and,
+ * with want_clients, its live connections. The listeners are stored in
+ * listeners; the connections are returned on taken and must be started
+ * once this process is ready to serve.
+ *
+ * Returns:
+ *   The number of inherited listening sockets, or -1 on failure.
+ */
+static int receive_handoff(bool want_clients, struct conn_list *taken, off_t *log_size,
+                           int *listeners) {
+    int peer = handoff_connect(CONTROL_SOCKET);
+    if (peer < 0) {
+        perror("connect " CONTROL_SOCKET);
+        return -1;
+    }
+
+    struct timeval tv = { .tv_sec = 10 };
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct handoff_msg req = { .magic = HANDOFF_MAGIC, .type = HANDOFF_REQUEST };
+    req.flags = want_clients ? HANDOFF_WANT_CLIENTS : 0;
+
+    struct handoff_msg state;
+    int fds[HANDOFF_MAX_FDS];
+    int nfds = HANDOFF_MAX_FDS;
+    if (handoff_send(peer, &req, NULL, NULL, 0) < 0 ||
+        handoff_recv(peer, &state, NULL, 0, fds, &nfds) < 0 ||
+        state.type != HANDOFF_STATE || nfds < 1 || nfds > MAX_LISTENERS) {
+        fprintf(stderr, "Handoff from running instance failed\n");
+        for (int i = 0; i < nfds; ++i) close(fds[i]);
+        close(peer);
+        return -1;
+    }
+    int nlisteners = nfds;
+    memcpy(listeners, fds, nlisteners * sizeof(int));
+    *log_size = state.value;
+
+    for (uint32_t i = 0; i < state.count; ++i) {
+        struct handoff_msg msg;
+        char name[CHANNEL_NAME_MAX];
+        nfds = 2;
+        ssize_t namelen = handoff_recv(peer, &msg, name, sizeof(name), fds, &nfds);
+        if (namelen < 0 || msg.type != HANDOFF_CLIENT || nfds < 1) {
+            for (int k = 0; k < nfds; ++k) close(fds[k]);
+            goto fail;
+        }
+
+        struct conn *c = pool_get(&conn_pool);
+        size_t cap = 1024;
+        while (cap <= msg.value) cap *= 2;
+        char *pending = c ? pool_buf_get(cap) : NULL;
+        if (!pending) {
+            pool_put(&conn_pool, c);
+            for (int k = 0; k < nfds; ++k) close(fds[k]);
+            goto fail;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = fds[0];
+        c->spill_fd = -1;
+        if (nfds == 2) {
+            // The partial packet started in a staging file, which is all of it
+            c->spill_fd = fds[1];
+            c->spill_len = lseek(c->spill_fd, 0, SEEK_END);
+        }
+        c->channel = namelen > 0 ? channel_get(name, namelen) : &default_channel;
+        if (!c->channel) c->channel = &default_channel;
+        memcpy(&c->addr, &msg.addr, sizeof(c->addr));
+        if (msg.flags & HANDOFF_CLIENT_NEWLINE) c->framing = FRAMING_NEWLINE;
+        if (msg.flags & HANDOFF_CLIENT_FRAMED) c->framing = FRAMING_VARINT;
+        if (msg.flags & HANDOFF_CLIENT_BATCH) c->framing = FRAMING_BATCH;
+        c->seq = msg.count;
+        c->pending = pending;
+        c->pending_cap = cap;
+        SLIST_INSERT_HEAD(taken, c, entries);
+
+        while (c->pending_len < msg.value) {
+            struct handoff_msg data;
+            ssize_t n = handoff_recv(peer, &data, pending + c->pending_len,
+                                     msg.value - c->pending_len, NULL, NULL);
+            if (n <= 0 || data.type != HANDOFF_DATA) goto fail;
+            c->pending_len += n;
+        }
+    }
+
+    struct handoff_msg ack = { .magic = HANDOFF_MAGIC, .type = HANDOFF_ACK };
+    if (handoff_send(peer, &ack, NULL, NULL, 0) < 0) goto fail;
+    close(peer);
+    return nlisteners;
+
+fail:
+    // Without our acknowledgement the old instance keeps everything
+    fprintf(stderr, "Handoff from running instance failed\n");
+    while (!SLIST_EMPTY(taken)) {
+        struct conn *c = SLIST_FIRST(taken);
+        SLIST_REMOVE_HEAD(taken, entries);
+        close(c->fd);
+        if (c->spill_fd >= 0) close(c->spill_fd);
+        pool_buf_put(c->pending, c->pending_cap);
+        pool_put(&conn_pool, c);
+    }
+    for (int i = 0; i < nlisteners; ++i) close(listeners[i]);
+    close(peer);
+    return -1;
+}
+
+/**
+ * stop_replication
+ * ----------------
+ * Disconnects followers, or from the primary, before the data file closes,
+ * and reports how far a follower lagged behind.
+ */
+static void stop_replication(void) {
+    if (serve_endpoint) repl_primary_stop(&repl_primary);
+    if (!follow_endpoint) return;
+
+    struct repl_stats s;
+    repl_follower_stop(&repl_follower, &s);
+    syslog(LOG_INFO, "Replicated %llu bytes in %llu batches, lag %lld bytes / %llu ms "
+           "(max %lld bytes / %llu ms)", (unsigned long long)s.bytes,
+           (unsigned long long)s.batches, (long long)s.lag_bytes,
+           (unsigned long long)s.lag_ms, (long long)s.max_lag_bytes,
+           (unsigned long long)s.max_lag_ms);
+    if (!daemon_mode)
+        printf("Replicated %llu bytes in %llu batches, lag %lld bytes / %llu ms "
+               "(max %lld bytes / %llu ms)\n", (unsigned long long)s.bytes,
+               (unsigned long long)s.batches, (long long)s.lag_bytes,
+               (unsigned long long)s.lag_ms, (long long)s.max_lag_bytes,
+               (unsigned long long)s.max_lag_ms);
+}
+
+/**
+ * timestamp_record
+ * ----------------
+ * Returns the "timestamp:" record for the current second in local time and
+ * sets *len to its length. The string is cached and only formatted again
+ * once the second has changed.
+ */
+static const char *timestamp_record(size_t *len) {
+    static time_t cached_secs = -1;
+    static char cached[64];
+    static size_t cached_len;
+
+    time_t now = time(NULL);
+    if (now != cached_secs) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        cached_len = strftime(cached, sizeof(cached), TIMESTAMP_FORMAT, &tm);
+        cached_secs = now;
+    }
+    *len = cached_len;
+    return cached;
+}
+
+/**
+ * append_timestamp
+ * ----------------
+ * Timer callback of the main loop: commits a timestamp record to the
+ * default channel through datalog_append(), the path client packets take,
+ * so it lands between two whole records. Expirations missed while the loop
+ * was busy add no extra records.
+ */
+static void append_timestamp(int timerfd) {
+    uint64_t expirations;
+    if (read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    size_t len;
+    const char *record = timestamp_record(&len);
+    if (len == 0 || datalog_append(&default_channel.log, record, len) < 0)
+        syslog(LOG_ERR, "Failed to append timestamp record");
+    else
+        timestamp_records++;
+}
+
+/**
+ * watch_listeners
+ * ---------------
+ * Adds the listeners to the main loop's epoll set (op EPOLL_CTL_ADD) or
+ * removes them (EPOLL_CTL_DEL). Pre-forked workers share the listeners, so
+ * only one of them is woken per connection.
+ */
+static void watch_listeners(int epfd, const int *listeners, int nlisteners, int op) {
+    struct epoll_event ev = { .events = worker_id ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN };
+    for (int i = 0; i < nlisteners; ++i) {
+        ev.data.fd = listeners[i];
+        epoll_ctl(epfd, op, listeners[i], &ev);
+    }
+}
+
+/**
+ * set_accepting
+ * -------------
+ * Pauses or resumes accepting at the connection cap. While paused, new
+ * clients wait in the listeners' accept queues, and connection threads
+ * wake the main loop through reap_fd as they finish.
+ */
+static void set_accepting(int epfd, const int *listeners, int nlisteners, bool on) {
+    static uint64_t paused_since;
+    watch_listeners(epfd, listeners, nlisteners, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL);
+    if (on) {
+        accept_paused_ms += now_ms() - paused_since;
+    } else {
+        accept_pauses++;
+        paused_since = now_ms();
+    }
+    atomic_store(&accept_paused, !on);
+}
+
+/**
+ * sample_accept_queues
+ * --------------------
+ * Reads how many connections wait in each TCP listener's accept queue and
+ * its backlog, as ss shows them (a listener's tcpi_unacked and
+ * tcpi_sacked), and warns once a queue is nearly full: beyond its backlog
+ * the kernel drops SYNs, and clients retry only after a second or more.
+ * The Unix listener has no TCP_INFO and is left out.
+ */
+static void sample_accept_queues(const int *listeners, int nlisteners) {
+    unsigned len = 0, backlog = 0;
+    bool full = false, low = true;
+    for (int i = 0; i < nlisteners; ++i) {
+        struct tcp_info ti;
+        socklen_t tilen = sizeof(ti);
+        if (getsockopt(listeners[i], IPPROTO_TCP, TCP_INFO, &ti, &tilen) < 0) continue;
+        len += ti.tcpi_unacked;
+        backlog += ti.tcpi_sacked;
+        if (ti.tcpi_unacked * 100 >= ti.tcpi_sacked * ACCEPT_QUEUE_WARN_PCT) full = true;
+        if (ti.tcpi_unacked * 2 >= ti.tcpi_sacked) low = false;
+    }
+    accept_queue_len = len;
+    accept_queue_backlog = backlog;
+    if (len > accept_queue_peak) accept_queue_peak = len;
+
+    // Once per episode: the warning rearms when every queue is below half
+    if (full && !accept_queue_warned) {
+        syslog(LOG_WARNING, "Accept queue nearly full: %u waiting, backlog %u", len, backlog);
+        accept_queue_warned = true;
+    } else if (low) {
+        accept_queue_warned = false;
+    }
+}
+
 /**
  * listen_socket
  * -------------
- * Main server loop: accepts incoming connections and handles clients.
+ * Main server loop: waits on the listening sockets, the control socket and
+ * the signalfd, accepts incoming connections, and returns once a shutdown
+ * signal has been received and all connections have drained, or once a new
+ * instance has taken over.
+ *
+ * Returns:
+ *   1 if the sockets were handed to a new instance, 0 after a normal
+ *   shutdown, -1 on failure.
  */
-int listen_socket(int sockfd) {
-    openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+int listen_socket(const int *listeners, int nlisteners, int sigfd, int ctlfd,
+                  int drain_timeout_ms) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        syslog(LOG_ERR, "epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+
+    watch_listeners(epfd, listeners, nlisteners, EPOLL_CTL_ADD);
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = sigfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+    if (ctlfd >= 0) {
+        ev.data.fd = ctlfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, ctlfd, &ev);
+    }
+    bool pausing = max_conns > 0 && !shed_load;
+    if (pausing) {
+        reap_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (reap_fd < 0) {
+            syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+            close(epfd);
+            return -1;
+        }
+        ev.data.fd = reap_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, reap_fd, &ev);
+    }
+
+    // One process appends the timestamps; a follower only appends what its
+    // primary ships, timestamps included
+    int timerfd = -1;
+    if (timestamp_secs && worker_id <= 1 && !follow_endpoint) {
+        struct itimerspec its = { { timestamp_secs, 0 }, { timestamp_secs, 0 } };
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (timerfd < 0 || timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+            syslog(LOG_ERR, "timerfd: %s", strerror(errno));
+            if (timerfd >= 0) close(timerfd);
+            timerfd = -1;
+        } else {
+            ev.data.fd = timerfd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+        }
+    }
 
+    bool handed_off = false;
+    uint64_t sampled_tick = 0;
     while (!exit_requested) {
-        struct sockaddr_in cli_addr;
-        socklen_t clilen = sizeof(cli_addr);
+        struct epoll_event events[8];
+        // The timers and the accept queues are looked at every tick
+        int nev = epoll_wait(epfd, events, 8,
+                             conn_timers.count || accept_paused ? TIMEOUT_TICK_MS : -1);
+        if (nev < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nev; ++i) {
+            if (events[i].data.fd == sigfd) {
+                struct signalfd_siginfo si;
+                if (read(sigfd, &si, sizeof(si)) != sizeof(si)) continue;
+                if (si.ssi_signo == METRICS_SIGNAL) {
+                    report_metrics(false);
+                } else {
+                    syslog(LOG_INFO, "Caught signal %u, exiting", si.ssi_signo);
+                    exit_requested = 1;
+                }
+            } else if (events[i].data.fd == ctlfd && !exit_requested) {
+                if (serve_handoff(ctlfd, listeners, nlisteners)) {
+                    handed_off = true;
+                    exit_requested = 1;
+                }
+            } else if (events[i].data.fd == timerfd) {
+                append_timestamp(timerfd);
+            } else if (events[i].data.fd == reap_fd) {
+                eventfd_t n;
+                eventfd_read(reap_fd, &n);
+            } else if (!exit_requested && !accept_paused) {
+                int k = 0;
+                while (k < nlisteners - 1 && listeners[k] != events[i].data.fd) k++;
+                accept_client(events[i].data.fd, listener_channels[k]);
+                if (pausing && nconns >= max_conns && reap_connections() >= max_conns)
+                    set_accepting(epfd, listeners, nlisteners, false);
+            }
+        }
+        // Threads that finished after a pause began have woken us through
+        // reap_fd, or are seen here
+        reap_connections();
+        if (accept_paused && nconns < max_conns && !exit_requested)
+            set_accepting(epfd, listeners, nlisteners, true);
+        uint64_t tick = now_ms() / TIMEOUT_TICK_MS;
+        timewheel_advance(&conn_timers, tick, fire_timeout, NULL);
+        if (tick != sampled_tick) {
+            sample_accept_queues(listeners, nlisteners);
+            sampled_tick = tick;
+        }
+    }
+    if (accept_paused) set_accepting(epfd, listeners, nlisteners, true);
 
-        int clientfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-        if (clientfd < 0) {
-            if (exit_requested) break;
-            perror("accept");
+    // Stop accepting first so new clients are refused rather than dropped.
+    // After a handoff the listener stays open in the new instance.
+    uint64_t drain_start = now_ms();
+    activation_notify("STOPPING=1");
+    for (int i = 0; i < nlisteners; ++i) close(listeners[i]);
+    close(epfd);
+    if (timerfd >= 0) close(timerfd);
+    // Handed-over threads exit on their own and their sockets stay open in
+    // the new instance; any others (all of them after a listener-only
+    // handoff) drain as on a normal shutdown
+    drain_connections(drain_timeout_ms);
+    // No thread is left to write to it
+    if (reap_fd >= 0) {
+        close(reap_fd);
+        reap_fd = -1;
+    }
+    stop_replication();
+    close_channels();
+
+    unsigned long lost = atomic_load(&packets_lost);
+    unsigned long lost_bytes = atomic_load(&bytes_lost);
+    uint64_t elapsed = now_ms() - drain_start;
+    syslog(LOG_INFO, "Shutdown took %llu ms, %lu packets (%lu partial bytes) lost",
+           (unsigned long long)elapsed, lost, lost_bytes);
+    if (!daemon_mode)
+        printf("Shutdown took %llu ms, %lu packets (%lu partial bytes) lost\n",
+               (unsigned long long)elapsed, lost, lost_bytes);
+    report_metrics(true);
+
+    // Nothing stays cached past shutdown, for the sake of leak checkers
+    pool_trim(&conn_pool);
+    pool_buf_trim();
+    return handed_off ? 1 : 0;
+}
+
+/**
+ * worker_main
+ * -----------
+ * Body of a pre-forked worker process: serves clients on the shared
+ * listener with its own threads and signalfd, appending through the
+ * shared-memory index, until the supervisor tells it to stop.
+ */
+static void worker_main(unsigned id, pid_t supervisor, const int *listeners, int nlisteners,
+                        int drain_timeout_ms) {
+    // Drain and exit if the supervisor goes away without stopping us
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor) _exit(EXIT_FAILURE);
+
+    worker_id = id;
+    for (int i = 0; i < nchannels; ++i) channels[i]->log.worker = id;
+    daemon_mode = true;            // Only the supervisor reports on stdout
+    unsetenv("NOTIFY_SOCKET");     // Readiness is the supervisor's business
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, METRICS_SIGNAL);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sigfd < 0) {
+        syslog(LOG_ERR, "Worker %u: signalfd: %s", id, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    listen_socket(listeners, nlisteners, sigfd, -1, drain_timeout_ms);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * spawn_worker
+ * ------------
+ * Forks worker id (1-based).
+ *
+ * Returns:
+ *   The worker's pid, or -1 on failure.
+ */
+static pid_t spawn_worker(unsigned id, const int *listeners, int nlisteners, int sigfd,
+                          int drain_timeout_ms) {
+    pid_t supervisor = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sigfd);
+        worker_main(id, supervisor, listeners, nlisteners, drain_timeout_ms);
+    }
+    if (pid < 0) syslog(LOG_ERR, "Failed to fork worker %u: %s", id, strerror(errno));
+    return pid;
+}
+
+/**
+ * supervise_workers
+ * -----------------
+ * Pre-fork mode: starts nworkers processes that all accept on listeners,
+ * restarts any that die, and on SIGINT/SIGTERM stops them and waits for
+ * their drains to finish. A crashed worker only loses its own connections;
+ * the shared index rolls back an append it left half done.
+ *
+ * Returns:
+ *   0 after a normal shutdown, -1 on failure.
+ */
+static int supervise_workers(const int *listeners, int nlisteners, int sigfd, unsigned nworkers,
+                             int drain_timeout_ms, int ready_fd) {
+    pid_t *pids = calloc(nworkers, sizeof(pid_t));
+    if (!pids) return -1;
+
+    // Every worker polls the listener; losers of an accept race must not block
+    for (int i = 0; i < nlisteners; ++i)
+        fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK);
+
+    for (unsigned i = 0; i < nworkers; ++i)
+        pids[i] = spawn_worker(i + 1, listeners, nlisteners, sigfd, drain_timeout_ms);
+    notify_ready(ready_fd);
+    syslog(LOG_INFO, "Started %u worker processes", nworkers);
+
+    unsigned live = nworkers;
+    while (live > 0) {
+        struct signalfd_siginfo si;
+        ssize_t n = read(sigfd, &si, sizeof(si));
+        if (n != sizeof(si)) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+
+        if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) {
+            syslog(LOG_INFO, "Caught signal %u, stopping workers", si.ssi_signo);
+            activation_notify("STOPPING=1");
+            exit_requested = 1;
+            for (unsigned i = 0; i < nworkers; ++i)
+                if (pids[i] > 0) kill(pids[i], SIGTERM);
+            continue;
+        }
+        if (si.ssi_signo == METRICS_SIGNAL) {
+            // Every worker keeps its own counters
+            for (unsigned i = 0; i < nworkers; ++i)
+                if (pids[i] > 0) kill(pids[i], METRICS_SIGNAL);
             continue;
         }
 
-        global_clientfd = clientfd;
-        handle_client(clientfd, &cli_addr);
-        global_clientfd = -1;
+        // SIGCHLD: reap every worker that exited, restarting crashed ones
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (unsigned i = 0; i < nworkers; ++i) {
+                if (pids[i] != pid) continue;
+                pids[i] = 0;
+                if (exit_requested) {
+                    live--;
+                } else {
+                    syslog(LOG_WARNING, "Worker %u (pid %d) died with status %d, restarting",
+                           i + 1, (int)pid, status);
+                    pids[i] = spawn_worker(i + 1, listeners, nlisteners, sigfd, drain_timeout_ms);
+                    if (pids[i] < 0) live--;
+                }
+            }
+        }
     }
 
-    closelog();
+    unsigned long long recoveries = 0;
+    for (int i = 0; i < nchannels; ++i)
+        if (channels[i]->log.shared) recoveries += channels[i]->log.shared->recoveries;
+    if (recoveries)
+        syslog(LOG_INFO, "%llu torn appends rolled back", recoveries);
+    for (int i = 0; i < nlisteners; ++i) close(listeners[i]);
+    close_channels();
+    for (int i = 0; i < nchannels; ++i) {
+        shmlog_destroy(channels[i]->log.shared);
+        channels[i]->log.shared = NULL;
+    }
+    free(pids);
     return 0;
 }
 
+/**
+ * parse_tcp_tuning
+ * ----------------
+ * Parses the "-T" argument, a comma-separated list of cork, nodelay and
+ * defer, or all of them as "all".
+ *
+ * Returns:
+ *   The TCP_TUNE_* modes, or -1 for an unknown mode.
+ */
+static int parse_tcp_tuning(char *list) {
+    int modes = 0;
+    for (char *mode; (mode = strsep(&list, ",")) != NULL;) {
+        if (strcmp(mode, "cork") == 0)
+            modes |= TCP_TUNE_CORK;
+        else if (strcmp(mode, "nodelay") == 0)
+            modes |= TCP_TUNE_NODELAY;
+        else if (strcmp(mode, "defer") == 0)
+            modes |= TCP_TUNE_DEFER;
+        else if (strcmp(mode, "all") == 0)
+            modes |= TCP_TUNE_CORK | TCP_TUNE_NODELAY | TCP_TUNE_DEFER;
+        else
+            return -1;
+    }
+    return modes;
+}
+
 /**
  * main
  * ----
- * Entry point: parses arguments, sets up signals, opens the socket,
- * optionally daemonizes, and starts listening for clients.
+ * Entry point: parses arguments, routes SIGINT/SIGTERM to a signalfd, opens
+ * the socket (or takes it over from a running instance or a service
+ * manager), optionally daemonizes, reports readiness, and starts listening
+ * for clients.
+ *
+ * Options:
+ *   -d       Run as a daemon.
+ *   -t ms    Drain deadline for in-flight packets on shutdown (default 5000).
+ *   -U       Upgrade: take the listening socket over from the instance
+ *            running on CONTROL_SOCKET instead of binding a new one.
+ *   -C       With -U, also take over its live client connections.
+ *   -P n     Pre-fork n worker processes instead of serving from threads of
+ *            a single process.
+ *   -K       Create the data file with length, sequence number and CRC32C
+ *            headers on every record. Existing files keep their format.
+ *   -D       Create the data file deduplicated: like -K, but a record whose
+ *            body the file holds already is stored as a reference to it.
+ *   -p       Persistent: keep the data file on exit, so the next start
+ *            recovers it instead of starting empty.
+ *   -m MiB   Size of the in-memory replay cache (default 64, 0 disables).
+ *   -N name:port
+ *            Also listen on TCP port; its connections use channel name
+ *            unless their preamble picks another. May be repeated.
+ *   -S endpoint
+ *            Ship committed records of the default channel to followers
+ *            connecting to endpoint, a Unix socket path or a TCP [host:]port.
+ *   -F endpoint
+ *            Follow the primary at endpoint: append only what it ships and
+ *            serve replays of it. Listens on port 9001, REPLICA_UNIX_SOCKET
+ *            and REPLICA_DATAFILE instead, so it can run beside its primary.
+ *   -R KiB   Largest receive buffer of one connection (default 131072); a
+ *            partial packet that outgrows it closes the connection.
+ *   -M MiB   Receive buffers of all connections together (default 1024), per
+ *            process; a connection that cannot grow its buffer is closed.
+ *   -s KiB   Spill newline packets beyond this size to a staging file instead
+ *            of memory (default 1024, 0 disables).
+ *   -z KiB   Send replays of at least this size to TCP clients with
+ *            MSG_ZEROCOPY (default 0, disabled).
+ *   -T modes TCP tuning, a comma-separated list or "all": "cork" each
+ *            replay so it leaves in full-sized segments, "nodelay" to send
+ *            short replays and acknowledgements at once, "defer" to accept
+ *            connections only once their first data has arrived.
+ *   -b usec  Busy-poll: connection threads spin for up to usec waiting for
+ *            data before they sleep in recv(), trading CPU for latency.
+ *            Best with the threads' cores set aside (taskset, isolcpus).
+ *   -I idle[,header[,lifetime]]
+ *            Connection timeouts in seconds, 0 disabling one (all are off
+ *            by default): close a connection that sends nothing for idle
+ *            seconds, that has not sent its first record header seconds
+ *            after connecting, or that is older than lifetime. header must
+ *            allow for the largest first packet a client may stream.
+ *   -A conns[,bytes[,addresses]]
+ *            Per client IP address, admit at most conns connections and
+ *            receive at most bytes bytes per second (0: unlimited), for up
+ *            to addresses addresses at once (default 65536). Connections
+ *            over the limit are closed right after accept; bytes over it
+ *            wait in the socket buffer.
+ *   -B n     Listen backlog (default 10), also applied to listeners taken
+ *            over from a running instance or a service manager.
+ *   -L max[,shed]
+ *            Serve at most max connections at once, per process. At the cap
+ *            stop accepting, so new clients wait in the accept queue, or
+ *            with ",shed" accept and close them at once.
+ *   -W secs  Append a "timestamp:" record with the time in RFC 2822 format
+ *            to the default channel every secs seconds (e.g. 10).
  */
 int main(int argc, char *argv[]) {
-    int daemon_mode = 0;
+    int drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+    bool upgrade = false, take_clients = false, persistent = false;
+    unsigned nworkers = 0;
+    struct channel_port ports[MAX_LISTENERS - 2];
+    int nports = 0;
+    uint16_t port = PORT;
+    const char *unix_path = UNIX_SOCKET;
+    double rl_conns = 0, rl_bytes = 0;
+    size_t rl_addresses = DEFAULT_RATELIMIT_ADDRESSES;
+    int opt;
 
-    // Parse -d argument for daemon mode
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = 1;
+    while ((opt = getopt(argc, argv, "dt:UCP:KDpm:N:S:F:R:M:s:z:T:b:I:A:B:L:W:")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon_mode = true;
+            break;
+        case 't':
+            drain_timeout_ms = atoi(optarg);
+            break;
+        case 'U':
+            upgrade = true;
+            break;
+        case 'C':
+            take_clients = true;
+            break;
+        case 'P':
+            nworkers = (unsigned)atoi(optarg);
+            break;
+        case 'K':
+            if (log_format == LOG_RAW) log_format = LOG_CHECKSUMMED;
+            break;
+        case 'D':
+            log_format = LOG_DEDUPLICATED;
+            break;
+        case 'p':
+            persistent = true;
+            break;
+        case 'm':
+            log_cache_bytes = (size_t)atol(optarg) * 1024 * 1024;
+            break;
+        case 'N': {
+            char *colon = strrchr(optarg, ':');
+            int chport = colon ? atoi(colon + 1) : 0;
+            if (!colon || !channel_name_valid(optarg, colon - optarg) || chport <= 0 ||
+                chport > 65535 || chport == PORT || nports == MAX_LISTENERS - 2) {
+                fprintf(stderr, "Bad channel listener %s\n", optarg);
+                return 1;
+            }
+            *colon = '\0';
+            ports[nports++] = (struct channel_port){ optarg, (uint16_t)chport };
+            break;
+        }
+        case 'S':
+            serve_endpoint = optarg;
+            break;
+        case 'F':
+            follow_endpoint = optarg;
+            break;
+        case 'R':
+            recv_cap = (size_t)atol(optarg) * 1024;
+            break;
+        case 'M':
+            recv_budget = (size_t)atol(optarg) * 1024 * 1024;
+            break;
+        case 's':
+            spill_threshold = (size_t)atol(optarg) * 1024;
+            break;
+        case 'z':
+            zerocopy_threshold = (size_t)atol(optarg) * 1024;
+            break;
+        case 'b':
+            busy_poll_us = (unsigned)atoi(optarg);
+            break;
+        case 'I': {
+            unsigned secs[3] = { idle_timeout_ms / 1000, header_timeout_ms / 1000,
+                                 lifetime_ms / 1000 };
+            if (sscanf(optarg, "%u,%u,%u", &secs[0], &secs[1], &secs[2]) < 1) {
+                fprintf(stderr, "Bad timeouts %s\n", optarg);
+                return 1;
+            }
+            idle_timeout_ms = secs[0] * 1000ull;
+            header_timeout_ms = secs[1] * 1000ull;
+            lifetime_ms = secs[2] * 1000ull;
+            break;
+        }
+        case 'A':
+            if (sscanf(optarg, "%lf,%lf,%zu", &rl_conns, &rl_bytes, &rl_addresses) < 1) {
+                fprintf(stderr, "Bad rate limits %s\n", optarg);
+                return 1;
+            }
+            rate_limited = true;
+            break;
+        case 'B':
+            listen_backlog = atoi(optarg);
+            backlog_set = true;
+            break;
+        case 'L': {
+            char mode[8] = "";
+            if (sscanf(optarg, "%d,%7s", &max_conns, mode) < 1 || max_conns < 0 ||
+                (mode[0] && strcmp(mode, "shed") != 0)) {
+                fprintf(stderr, "Bad connection limit %s\n", optarg);
+                return 1;
+            }
+            shed_load = max_conns > 0 && mode[0];
+            break;
+        }
+        case 'W':
+            timestamp_secs = (unsigned)atoi(optarg);
+            break;
+        case 'T':
+            tcp_tuning = parse_tcp_tuning(optarg);
+            if (tcp_tuning < 0) {
+                fprintf(stderr, "Bad TCP tuning %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-K | -D] [-p] [-m cache_mib] [-t drain_timeout_ms] "
+                    "[-R recv_cap_kib] [-M recv_budget_mib] [-s spill_kib] "
+                    "[-z zerocopy_kib] [-T cork,nodelay,defer|all] [-b busy_poll_us] "
+                    "[-I idle_s[,header_s[,lifetime_s]]] "
+                    "[-A conns_per_s[,bytes_per_s[,addresses]]] [-B backlog] "
+                    "[-L max_conns[,shed]] [-W timestamp_s] [-N channel:port]... "
+                    "[-S endpoint] [-F endpoint] "
+                    "[-U [-C] | -P workers]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (upgrade && nworkers > 0) {
+        fprintf(stderr, "-U cannot be combined with -P\n");
+        return 1;
+    }
+    if (recv_cap < 1024 || recv_budget < recv_cap) {
+        fprintf(stderr, "-R must be at least 1 KiB and no more than -M\n");
+        return 1;
+    }
+    if (spill_threshold >= recv_cap) {
+        fprintf(stderr, "-s must be below -R\n");
+        return 1;
+    }
+    if (listen_backlog <= 0) {
+        fprintf(stderr, "-B must be positive\n");
+        return 1;
+    }
+    if (rate_limited && (rl_conns < 0 || rl_bytes < 0 ||
+                         ratelimit_init(&limits, rl_conns, rl_bytes, rl_addresses) < 0)) {
+        fprintf(stderr, "Bad rate limits or out of memory for %zu addresses\n", rl_addresses);
+        return 1;
+    }
+    // Replication follows the default channel of a single process
+    if ((serve_endpoint || follow_endpoint) && nworkers > 0) {
+        fprintf(stderr, "-S and -F cannot be combined with -P\n");
+        return 1;
+    }
+    if (follow_endpoint && (upgrade || nports > 0)) {
+        fprintf(stderr, "-F cannot be combined with -U or -N\n");
+        return 1;
+    }
+    if (follow_endpoint) {
+        port = REPLICA_PORT;
+        unix_path = REPLICA_UNIX_SOCKET;
+        strcpy(default_channel.path, REPLICA_DATAFILE);
     }
 
-    // Register signal handlers for SIGINT/SIGTERM
+    openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+
+    // Block SIGINT/SIGTERM/SIGUSR2 in every thread; the main loop reads them from a signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, METRICS_SIGNAL);
+    if (nworkers > 0) sigaddset(&mask, SIGCHLD);   // The supervisor restarts dead workers
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        perror("sigprocmask");
+        return 1;
+    }
+
+    // No SA_RESTART, so the signal interrupts a connection thread's recv()
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = wake_handler;
+    sigaction(WAKE_SIGNAL, &sa, NULL);
 
-    // Open listening socket
-    int sockfd = open_socket();
-    if (sockfd < 0) {
-        fprintf(stderr, "Failed to open socket\n");
-        return 1;
+    timewheel_init(&conn_timers, now_ms() / TIMEOUT_TICK_MS);
+
+    // Take the listening sockets over from the running instance, inherit
+    // them from a service manager, or open them ourselves
+    struct conn_list taken = SLIST_HEAD_INITIALIZER(taken);
+    off_t handoff_log_size = -1;
+    int listeners[MAX_LISTENERS];
+    int nlisteners = 0;
+    bool activated = false;        // The Unix socket path belongs to the service manager
+    if (upgrade) {
+        nlisteners = receive_handoff(take_clients, &taken, &handoff_log_size, listeners);
+        if (nlisteners < 0) {
+            fprintf(stderr, "No running instance to upgrade, starting fresh\n");
+            nlisteners = 0;
+        }
+    }
+    if (nlisteners == 0) {
+        nlisteners = activation_listen_fds(listeners, MAX_LISTENERS);
+        activated = nlisteners > 0;
+    }
+    if (nlisteners == 0) {
+        listeners[0] = open_socket(port);
+        if (listeners[0] < 0) {
+            fprintf(stderr, "Failed to open socket\n");
+            return 1;
+        }
+        nlisteners = 1;
+        for (int i = 0; i < nports; ++i) {
+            listeners[nlisteners] = open_socket(ports[i].port);
+            if (listeners[nlisteners] < 0) {
+                fprintf(stderr, "Failed to open socket for channel %s\n", ports[i].name);
+                return 1;
+            }
+            nlisteners++;
+        }
+
+        // Local producers are optional; TCP keeps working without them
+        listeners[nlisteners] = open_unix_socket(unix_path);
+        if (listeners[nlisteners] >= 0)
+            nlisteners++;
+        else
+            fprintf(stderr, "No Unix socket at %s: %s\n", unix_path, strerror(errno));
     }
-    global_sockfd = sockfd;
 
     // Run as daemon if requested
+    int ready_fd = -1;
     if (daemon_mode) {
-        daemonize();
+        ready_fd = daemonize();
     } else {
-        printf("Socket opened successfully on port %d\n", PORT);
+        printf("Socket opened successfully on port %d\n", port);
+        fflush(stdout);
+    }
+
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sigfd < 0) {
+        syslog(LOG_ERR, "signalfd: %s", strerror(errno));
+        return 1;
     }
 
-    // Start accepting and handling clients
-    listen_socket(sockfd);
+    struct datalog *log = &default_channel.log;
+    if (datalog_open(log, default_channel.path, log_format, log_cache_bytes) < 0) {
+        close(sigfd);
+        return 1;
+    }
+    if (!daemon_mode && log->payload > 0)
+        printf("Recovered %lld bytes of %s in %llu ms\n", (long long)log->payload,
+               default_channel.path, (unsigned long long)log->open_ms);
+    if (handoff_log_size >= 0 && handoff_log_size != log->size)
+        syslog(LOG_WARNING, "Data file is %lld bytes, previous instance reported %lld",
+               (long long)log->size, (long long)handoff_log_size);
 
-    // Cleanup on exit
-    if (global_sockfd != -1) close(global_sockfd);
-    remove(DATAFILE);
+    // Inherited listeners are matched to channels by their port; the Unix
+    // socket ignores the TCP option. Listening again only resizes the backlog.
+    int defer_secs = DEFER_ACCEPT_SECS;
+    for (int i = 0; i < nlisteners; ++i) {
+        listener_channels[i] = channel_for_listener(listeners[i], ports, nports);
+        if (backlog_set) listen(listeners[i], listen_backlog);
+        if (tcp_tuning & TCP_TUNE_DEFER)
+            setsockopt(listeners[i], IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs,
+                       sizeof(defer_secs));
+    }
+
+    if (nworkers > 0) {
+        // Channels opened from here on, by a worker, share no index
+        for (int i = 0; i < nchannels; ++i) {
+            struct datalog *cl = &channels[i]->log;
+            cl->shared = shmlog_create(cl->size, cl->seq, cl->payload);
+            if (!cl->shared) {
+                syslog(LOG_ERR, "Failed to map shared log index: %s", strerror(errno));
+                close_channels();
+                return 1;
+            }
+        }
+        int rc = supervise_workers(listeners, nlisteners, sigfd, nworkers, drain_timeout_ms,
+                                   ready_fd);
+        close(sigfd);
+        if (!activated) unlink(unix_path);
+        if (!persistent) remove_logs();
+        closelog();
+        return rc < 0 ? 1 : 0;
+    }
+
+    if (serve_endpoint && repl_primary_start(&repl_primary, serve_endpoint, log) < 0) {
+        syslog(LOG_ERR, "Failed to serve followers on %s: %s", serve_endpoint, strerror(errno));
+        close_channels();
+        return 1;
+    }
+    if (follow_endpoint && repl_follower_start(&repl_follower, follow_endpoint, log) < 0) {
+        syslog(LOG_ERR, "Failed to start following %s", follow_endpoint);
+        close_channels();
+        return 1;
+    }
+
+    // Resume the connections handed over by the previous instance. Those
+    // past framing negotiation are past their header timeout too.
+    while (!SLIST_EMPTY(&taken)) {
+        struct conn *c = SLIST_FIRST(&taken);
+        SLIST_REMOVE_HEAD(&taken, entries);
+        atomic_init(&c->committed, c->framing != FRAMING_UNKNOWN);
+        start_connection(c);
+    }
+
+    // The control socket lets a future instance take over without a gap; a
+    // follower cannot be upgraded in place, and the socket is its primary's
+    int ctlfd = follow_endpoint ? -1 : handoff_listen(CONTROL_SOCKET);
+    if (ctlfd < 0 && !follow_endpoint)
+        syslog(LOG_WARNING, "No control socket at %s, upgrades disabled", CONTROL_SOCKET);
+
+    // Clients that connected during startup are waiting in the listen backlog
+    notify_ready(ready_fd);
+
+    // Start accepting and handling clients until a shutdown signal drains them
+    int rc = listen_socket(listeners, nlisteners, sigfd, ctlfd, drain_timeout_ms);
+
+    // Cleanup on exit; after a handoff the data file and sockets belong to
+    // the new instance
+    if (ctlfd >= 0) close(ctlfd);
+    close(sigfd);
+    if (rc != 1) {
+        if (!follow_endpoint) unlink(CONTROL_SOCKET);
+        if (!activated) unlink(unix_path);
+        if (serve_endpoint && strchr(serve_endpoint, '/')) unlink(serve_endpoint);
+        if (!persistent) remove_logs();
+    }
+    closelog();
 
     return 0;
 }
-
@@ -0,0 +1,240 @@
+/**
+ * bufchain.c
+ *
+ * Reference-counted buffer chains. See bufchain.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "bufchain.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+struct buf_chunk *buf_chunk_new(size_t size) {
+    struct buf_chunk *chunk = malloc(sizeof(*chunk) + size);
+    if (!chunk) return NULL;
+    atomic_init(&chunk->refs, 1);
+    chunk->size = size;
+    return chunk;
+}
+
+void buf_chunk_unref(struct buf_chunk *chunk) {
+    if (chunk && atomic_fetch_sub_explicit(&chunk->refs, 1, memory_order_acq_rel) == 1)
+        free(chunk);
+}
+
+/**
+ * add_slice
+ * ---------
+ * Appends a slice, extending the last one instead when it ends where the
+ * new one starts in the same chunk. Takes a reference for a new slice of
+ * a chunk.
+ *
+ * Returns:
+ *   0 on success, -1 if memory is exhausted.
+ */
+static int add_slice(struct bufchain *c, struct buf_chunk *chunk, const char *base, size_t len) {
+    if (len == 0) return 0;
+    struct bufchain_seg *last = c->nsegs ? &c->segs[c->nsegs - 1] : NULL;
+    if (last && last->chunk == chunk && last->base + last->len == base) {
+        last->len += len;
+        c->len += len;
+        return 0;
+    }
+
+    if (c->nsegs == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 16;
+        struct bufchain_seg *bigger = realloc(c->segs, cap * sizeof(*bigger));
+        if (!bigger) return -1;
+        c->segs = bigger;
+        c->cap = cap;
+    }
+    if (chunk) atomic_fetch_add_explicit(&chunk->refs, 1, memory_order_relaxed);
+    c->segs[c->nsegs++] = (struct bufchain_seg){ chunk, base, len };
+    c->len += len;
+    return 0;
+}
+
+int bufchain_add(struct bufchain *c, struct buf_chunk *chunk, size_t off, size_t len) {
+    return add_slice(c, chunk, chunk->data + off, len);
+}
+
+int bufchain_borrow(struct bufchain *c, const void *buf, size_t len) {
+    return add_slice(c, NULL, buf, len);
+}
+
+char *bufchain_space(struct bufchain *c, size_t *avail) {
+    if (!c->tail || c->tail_used == c->tail->size) {
+        // Slices keep the full chunk alive; the chain moves on to a fresh one
+        struct buf_chunk *fresh = buf_chunk_new(BUFCHAIN_CHUNK);
+        if (!fresh) return NULL;
+        buf_chunk_unref(c->tail);
+        c->tail = fresh;
+        c->tail_used = 0;
+    }
+    *avail = c->tail->size - c->tail_used;
+    return c->tail->data + c->tail_used;
+}
+
+int bufchain_commit(struct bufchain *c, size_t len) {
+    if (add_slice(c, c->tail, c->tail->data + c->tail_used, len) < 0) return -1;
+    c->tail_used += len;
+    return 0;
+}
+
+int bufchain_copy(struct bufchain *c, const void *buf, size_t len) {
+    const char *src = buf;
+    while (len > 0) {
+        size_t avail;
+        char *dst = bufchain_space(c, &avail);
+        if (!dst) return -1;
+        size_t n = len < avail ? len : avail;
+        memcpy(dst, src, n);
+        if (bufchain_commit(c, n) < 0) return -1;
+        c->copies++;
+        c->copied += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int bufchain_zerocopy(struct bufchain *c, int fd, size_t threshold) {
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) return -1;
+    c->zc_threshold = threshold;
+    return 0;
+}
+
+/**
+ * zerocopy_wait
+ * -------------
+ * Waits until the socket's error queue has reported pending zerocopy sends
+ * complete, and gives up on zerocopy for the chain if the kernel had to
+ * copy any of them.
+ *
+ * Returns:
+ *   0 on success, -1 if the socket failed or hung up first; the kernel then
+ *   drops the sends without reading the slices again.
+ */
+static int zerocopy_wait(struct bufchain *c, int fd, unsigned long pending) {
+    bool copied = false, gone = false;
+    while (pending > 0) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+            if (gone) return -1;
+            // Completions arrive once the peer has acknowledged the data
+            struct pollfd pfd = { .fd = fd };
+            int rc = poll(&pfd, 1, -1);
+            if (rc < 0 && errno != EINTR) return -1;
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            gone = rc > 0 && (pfd.revents & (POLLHUP | POLLNVAL) ||
+                              (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err));
+            continue;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) continue;
+            // One notification covers the range of sends [ee_info, ee_data]
+            unsigned long done = serr.ee_data - serr.ee_info + 1;
+            pending = done < pending ? pending - done : 0;
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                c->zc_copied += done;
+                copied = true;
+            }
+        }
+    }
+
+    if (copied) {
+        // Pinning pages for a copy costs more than copying outright
+        c->zc_threshold = 0;
+        c->zc_fallbacks++;
+    }
+    return 0;
+}
+
+int bufchain_send(struct bufchain *c, int fd) {
+    struct iovec iov[IOV_MAX];
+    size_t seg = 0, off = 0;    // Next byte to send: slice, offset within it
+    int flags = c->zc_threshold && c->len >= c->zc_threshold ? MSG_ZEROCOPY : 0;
+    unsigned long zc_pending = 0;
+
+    while (seg < c->nsegs) {
+        int n = 0;
+        for (size_t i = seg; i < c->nsegs && n < IOV_MAX; ++i, ++n) {
+            iov[n].iov_base = (char *)c->segs[i].base + (i == seg ? off : 0);
+            iov[n].iov_len = c->segs[i].len - (i == seg ? off : 0);
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ENOBUFS && flags) {
+                // Out of option memory to track the send: copy the rest
+                flags = 0;
+                continue;
+            }
+            if (zc_pending) zerocopy_wait(c, fd, zc_pending);
+            return -1;
+        }
+        c->sends++;
+        if (flags) {
+            c->zc_sends++;
+            zc_pending++;
+        }
+
+        while (sent > 0) {
+            size_t left = c->segs[seg].len - off;
+            if ((size_t)sent < left) {
+                off += sent;
+                break;
+            }
+            sent -= left;
+            seg++;
+            off = 0;
+        }
+    }
+    return zc_pending ? zerocopy_wait(c, fd, zc_pending) : 0;
+}
+
+void bufchain_clear(struct bufchain *c) {
+    for (size_t i = 0; i < c->nsegs; ++i) buf_chunk_unref(c->segs[i].chunk);
+    c->nsegs = 0;
+    c->len = 0;
+    // Nobody else points into the own chunk any more: fill it again
+    if (c->tail && atomic_load_explicit(&c->tail->refs, memory_order_acquire) == 1)
+        c->tail_used = 0;
+}
+
+void bufchain_release(struct bufchain *c) {
+    bufchain_clear(c);
+    free(c->segs);
+    c->segs = NULL;
+    c->cap = 0;
+    buf_chunk_unref(c->tail);
+    c->tail = NULL;
+    c->tail_used = 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * bufchain.h
+ *
+ * Chains of shared, immutable buffer chunks. A chunk is reference counted
+ * and never changes once its bytes are written, so any number of chains in
+ * any number of threads can point into it without copying; the last one to
+ * let go frees it. A chain describes a byte range, such as "the data file
+ * up to offset X", as a list of slices of chunks, and goes out with one
+ * sendmsg() per IOV_MAX slices instead of being flattened into a single
+ * buffer first.
+ *
+ * Bytes that live in no shareable chunk (a protocol header, records read
+ * back from the file) go into chunks of the chain's own. The chain counts
+ * what it had to copy in memory and the sends it took, for the metrics.
+ *
+ * Large chains can be sent with MSG_ZEROCOPY (see bufchain_zerocopy()): the
+ * kernel then reads the slices in place, and the chain keeps them pinned
+ * until the socket's error queue reports the sends complete. Once the
+ * kernel reports that it copied the data anyway (as it does on loopback),
+ * the chain goes back to ordinary sends.
+ */
+
+#ifndef BUFCHAIN_H
+#define BUFCHAIN_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define BUFCHAIN_CHUNK (64 * 1024)        // Size of the chunks a chain fills itself
+
+// A reference-counted block of bytes
+struct buf_chunk {
+    atomic_uint refs;
+    size_t size;               // Capacity of data
+    char data[];
+};
+
+// One slice of a chunk
+struct bufchain_seg {
+    struct buf_chunk *chunk;   // Holds a reference; NULL for borrowed bytes
+    const char *base;
+    size_t len;
+};
+
+struct bufchain {
+    struct bufchain_seg *segs;
+    size_t nsegs;
+    size_t cap;
+    size_t len;                // Bytes in all slices
+    struct buf_chunk *tail;    // Own chunk being filled, with one reference
+    size_t tail_used;
+
+    unsigned long copies;      // Copies into own chunks
+    size_t copied;             // Bytes copied
+    unsigned long sends;       // sendmsg() calls
+
+    size_t zc_threshold;       // Chains this long go out with MSG_ZEROCOPY; 0: never
+    unsigned long zc_sends;    // sendmsg() calls with MSG_ZEROCOPY
+    unsigned long zc_copied;   // ...of which the kernel copied the data anyway
+    unsigned long zc_fallbacks;   // Times zerocopy was given up on
+};
+
+#define BUFCHAIN_INITIALIZER { 0 }
+
+/**
+ * Allocates a chunk of size bytes, holding one reference.
+ * Returns NULL if memory is exhausted.
+ */
+struct buf_chunk *buf_chunk_new(size_t size);
+
+/**
+ * Drops one reference to chunk, freeing it with the last one. NULL is
+ * ignored.
+ */
+void buf_chunk_unref(struct buf_chunk *chunk);
+
+/**
+ * Appends len bytes of chunk, starting at off, by reference. The bytes
+ * must never change while any chain holds them.
+ * Returns 0 on success, -1 if memory is exhausted.
+ */
+int bufchain_add(struct bufchain *c, struct buf_chunk *chunk, size_t off, size_t len);
+
+/**
+ * Appends len bytes at buf by reference without counting it: the caller
+ * keeps them alive and unchanged until the chain has been sent or cleared.
+ * Returns 0 on success, -1 if memory is exhausted.
+ */
+int bufchain_borrow(struct bufchain *c, const void *buf, size_t len);
+
+/**
+ * Appends a copy of len bytes at buf.
+ * Returns 0 on success, -1 if memory is exhausted.
+ */
+int bufchain_copy(struct bufchain *c, const void *buf, size_t len);
+
+/**
+ * Returns space for up to *avail more bytes at the end of the chain, to be
+ * filled directly (by read(), say) and appended with bufchain_commit().
+ * Returns NULL if memory is exhausted.
+ */
+char *bufchain_space(struct bufchain *c, size_t *avail);
+
+/**
+ * Appends the first len bytes written to the space from bufchain_space().
+ * Returns 0 on success, -1 if memory is exhausted.
+ */
+int bufchain_commit(struct bufchain *c, size_t len);
+
+/**
+ * Enables MSG_ZEROCOPY on the socket fd, which the chain will be sent to,
+ * for chains of at least threshold bytes.
+ * Returns 0 on success, -1 if the socket does not support it.
+ */
+int bufchain_zerocopy(struct bufchain *c, int fd, size_t threshold);
+
+/**
+ * Sends the whole chain to fd, retrying short sends and sends interrupted
+ * by a signal. A zerocopy send returns only once the kernel is done with
+ * the slices, so the chain may be cleared right after.
+ * Returns 0 on success, -1 on failure.
+ */
+int bufchain_send(struct bufchain *c, int fd);
+
+/**
+ * Drops every slice, keeping the counters and the own chunk being filled,
+ * which is reused from the start if no other chain points into it.
+ */
+void bufchain_clear(struct bufchain *c);
+
+/**
+ * Drops every reference the chain holds and frees its slice list.
+ */
+void bufchain_release(struct bufchain *c);
+
+#endif
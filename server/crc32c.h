@@ -0,0 +1,34 @@
+/**
+ * crc32c.h
+ *
+ * CRC32C (Castagnoli), as used by iSCSI, ext4 and SCTP. The implementation
+ * is picked once at runtime: the SSE4.2 crc32 instruction on x86-64, the
+ * ARMv8 CRC32 extension on AArch64, and a slicing-by-8 table lookup
+ * everywhere else.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Extends crc over len bytes of buf with the fastest available code. Start
+ * with crc 0; the result of one call can be passed to the next to checksum
+ * data in pieces.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Same as crc32c(), always using the portable slicing-by-8 code.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Name of the implementation crc32c() uses: "sse4.2", "armv8" or
+ * "slicing-by-8".
+ */
+const char *crc32c_impl(void);
+
+#endif
@@ -0,0 +1,1307 @@
+/**
+ * datalog.c
+ *
+ * Data file appends, replays and crash recovery. See datalog.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "datalog.h"
+#include "crc32c.h"
+#include "framing.h"
+#include "xxhash.h"
+
+#define LOG_SCAN_CHUNK (1024 * 1024)
+#define LOG_READAHEAD (4 * 1024 * 1024)         // Read ahead of a scan with posix_fadvise
+#define LOG_SCAN_THREADS 8                      // Most threads recovering one file
+#define LOG_SCAN_SLICE (32ll * 1024 * 1024)     // Least bytes worth a thread of its own
+#define LOG_COPY_CHUNK (1024 * 1024)            // Staged record bytes copied per write
+
+// A sink for record bytes read back from the file
+typedef int (*record_sink)(void *arg, const char *buf, size_t len);
+
+// Visitor for the records of a checksummed file: h is the record's header,
+// payload the record bytes before it, and body the file offset of what is
+// stored after the header, which is *ref for a reference (else NULL)
+typedef int (*record_visit)(void *arg, const struct record_hdr *h, off_t payload, off_t body,
+                            const struct record_ref *ref);
+
+// Record bytes being gathered into a chain, and sent from it whenever it
+// holds BUFCHAIN_CHUNK bytes if fd is a client
+struct replay_sink {
+    int fd;                    // -1: gather only
+    struct bufchain *chain;
+};
+
+// One slice of a checksummed file, validated by its own thread on recovery
+struct scan_part {
+    pthread_t thread;
+    const char *path;
+    off_t from;                // Slice start: the first record at or after it...
+    off_t stop;                // ...through the last record starting before stop
+    off_t to;                  // End of the file
+    off_t first;               // Offset of the first record found, -1 if none
+    uint64_t first_seq;
+    struct datalog log;        // Walk state; payload and index relative to first
+    int rc;
+};
+
+/**
+ * now_ns
+ * ------
+ * Returns the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+/**
+ * record_crc
+ * ----------
+ * Returns the CRC32C protecting a record: its length field, sequence number
+ * and the len bytes stored after the header.
+ */
+static uint32_t record_crc(const struct record_hdr *h, const char *buf, size_t len) {
+    uint32_t crc = crc32c(0, &h->len, sizeof(h->len));
+    crc = crc32c(crc, &h->seq, sizeof(h->seq));
+    return crc32c(crc, buf, len);
+}
+
+// Bytes stored after a record header: a reference's are a struct record_ref
+static inline uint32_t stored_len(bool deduplicated, const struct record_hdr *h) {
+    return deduplicated ? h->len & ~RECORD_REF : h->len;
+}
+
+static inline bool is_ref(const struct datalog *log, const struct record_hdr *h) {
+    return log->deduplicated && (h->len & RECORD_REF);
+}
+
+/**
+ * index_add
+ * ---------
+ * Notes that a record starts at file offset offset with payload record
+ * bytes before it, if it is at least LOG_INDEX_STRIDE past the previous
+ * entry. Entries are added in file order by whoever holds the append lock.
+ */
+static void index_add(struct datalog *log, off_t offset, off_t payload) {
+    if (payload < log->index_next) return;
+
+    pthread_mutex_lock(&log->index_lock);
+    if (log->index_len == log->index_cap) {
+        size_t cap = log->index_cap ? log->index_cap * 2 : 64;
+        struct log_index_entry *bigger = realloc(log->index, cap * sizeof(*bigger));
+        if (!bigger) {
+            // The index is only a shortcut; replays fall back to earlier entries
+            pthread_mutex_unlock(&log->index_lock);
+            return;
+        }
+        log->index = bigger;
+        log->index_cap = cap;
+    }
+    log->index[log->index_len++] = (struct log_index_entry){ offset, payload };
+    pthread_mutex_unlock(&log->index_lock);
+    log->index_next = payload + LOG_INDEX_STRIDE;
+}
+
+/**
+ * index_find
+ * ----------
+ * Returns the last indexed record starting at or before payload offset
+ * payload, or the first record of the file.
+ */
+static struct log_index_entry index_find(struct datalog *log, off_t payload) {
+    struct log_index_entry e = { LOG_MAGIC_LEN, 0 };
+
+    pthread_mutex_lock(&log->index_lock);
+    size_t lo = 0, hi = log->index_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (log->index[mid].payload <= payload)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0) e = log->index[lo - 1];
+    pthread_mutex_unlock(&log->index_lock);
+    return e;
+}
+
+/**
+ * cache_append
+ * ------------
+ * Copies len record bytes, found at payload offset at, into the replay
+ * cache. The cache only ever holds a prefix of the file: bytes that do not
+ * continue it (another process appended in between) or do not fit leave it
+ * as it is. Replays may read the cache concurrently.
+ */
+static void cache_append(struct datalog *log, off_t at, const char *buf, size_t len) {
+    off_t cached = atomic_load_explicit(&log->cached, memory_order_relaxed);
+    if (!log->cache_chunks || at != cached) return;
+
+    off_t cap = (off_t)log->cache_chunks * LOG_CACHE_CHUNK;
+    while (len > 0 && cached < cap) {
+        size_t chunk = cached / LOG_CACHE_CHUNK;
+        size_t in = cached % LOG_CACHE_CHUNK;
+        if (!log->cache[chunk] && !(log->cache[chunk] = buf_chunk_new(LOG_CACHE_CHUNK))) break;
+        size_t n = LOG_CACHE_CHUNK - in < len ? LOG_CACHE_CHUNK - in : len;
+        memcpy(log->cache[chunk]->data + in, buf, n);
+        buf += n;
+        len -= n;
+        cached += n;
+    }
+    // Publishes the bytes (and chunk pointers) to replays
+    atomic_store_explicit(&log->cached, cached, memory_order_release);
+}
+
+/**
+ * dedupe_hash
+ * -----------
+ * Returns the hash a deduplicated file keys a body by, never 0, and adds
+ * its cost to the hashing statistics.
+ */
+static uint64_t dedupe_hash(struct datalog *log, const char *buf, size_t len) {
+    uint64_t start = now_ns();
+    uint64_t hash = xxh64(buf, len, 0);
+    atomic_fetch_add_explicit(&log->dedupe_hash_ns, now_ns() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->dedupe_hashed, len, memory_order_relaxed);
+    return hash ? hash : 1;
+}
+
+/**
+ * dedupe_find
+ * -----------
+ * Returns the stored body with the given hash, or NULL. Called with the
+ * append lock held.
+ */
+static struct dedupe_entry *dedupe_find(struct datalog *log, uint64_t hash) {
+    if (!log->dedupe) return NULL;
+    for (size_t i = hash & log->dedupe_mask; log->dedupe[i].hash; i = (i + 1) & log->dedupe_mask)
+        if (log->dedupe[i].hash == hash) return &log->dedupe[i];
+    return NULL;
+}
+
+/**
+ * dedupe_add
+ * ----------
+ * Remembers the body of len bytes whose record starts at file offset
+ * offset, payload offset payload, doubling the table as it fills. A body
+ * whose hash is taken already (a copy, or a collision) keeps the earlier
+ * one, and once LOG_DEDUPE_ENTRIES bodies are known no more are added.
+ * Called with the append lock held.
+ */
+static void dedupe_add(struct datalog *log, uint64_t hash, off_t offset, off_t payload,
+                       uint32_t len) {
+    if (log->dedupe_count >= LOG_DEDUPE_ENTRIES) return;
+    if (!log->dedupe || 2 * (log->dedupe_count + 1) > log->dedupe_mask + 1) {
+        size_t slots = log->dedupe ? 2 * (log->dedupe_mask + 1) : 1024;
+        struct dedupe_entry *bigger = calloc(slots, sizeof(*bigger));
+        if (!bigger) return;
+        for (size_t i = 0; log->dedupe && i <= log->dedupe_mask; ++i) {
+            if (!log->dedupe[i].hash) continue;
+            size_t k = log->dedupe[i].hash & (slots - 1);
+            while (bigger[k].hash) k = (k + 1) & (slots - 1);
+            bigger[k] = log->dedupe[i];
+        }
+        free(log->dedupe);
+        log->dedupe = bigger;
+        log->dedupe_mask = slots - 1;
+    }
+
+    size_t i = hash & log->dedupe_mask;
+    for (; log->dedupe[i].hash; i = (i + 1) & log->dedupe_mask)
+        if (log->dedupe[i].hash == hash) return;
+    log->dedupe[i] = (struct dedupe_entry){ hash, offset, payload, len };
+    log->dedupe_count++;
+}
+
+/**
+ * dedupe_equal
+ * ------------
+ * Compares a stored body with the len bytes at buf: from the replay cache
+ * if it holds the body, else read back from the file. Called with the
+ * append lock held.
+ */
+static bool dedupe_equal(struct datalog *log, const struct dedupe_entry *e, const char *buf,
+                         size_t len) {
+    if (e->len != len) return false;
+    off_t from = e->payload;
+    if (from + (off_t)len <= atomic_load_explicit(&log->cached, memory_order_relaxed)) {
+        while (len > 0) {
+            size_t in = from % LOG_CACHE_CHUNK;
+            size_t n = LOG_CACHE_CHUNK - in < len ? LOG_CACHE_CHUNK - in : len;
+            if (memcmp(log->cache[from / LOG_CACHE_CHUNK]->data + in, buf, n) != 0) return false;
+            from += n;
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    char readbuf[16384];
+    off_t pos = e->offset + sizeof(struct record_hdr);
+    while (len > 0) {
+        size_t want = len < sizeof(readbuf) ? len : sizeof(readbuf);
+        if (pread(log->fd, readbuf, want, pos) != (ssize_t)want ||
+            memcmp(readbuf, buf, want) != 0)
+            return false;
+        pos += want;
+        buf += want;
+        len -= want;
+    }
+    return true;
+}
+
+/**
+ * datalog_scan
+ * ------------
+ * Checksummed data file: validates the records starting between log->size
+ * and stop, none of which may extend past to, advancing size, seq and
+ * payload past every intact one and adding them to the index and cache.
+ *
+ * Returns:
+ *   0 if every record was intact, -1 if the scan stopped at a torn or
+ *   corrupt record (log->size is then its offset).
+ */
+static int datalog_scan(struct datalog *log, off_t stop, off_t to) {
+    size_t cap = LOG_SCAN_CHUNK;
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+
+    int rc = 0;
+    while (log->size < stop) {
+        size_t want = to - log->size < (off_t)cap ? (size_t)(to - log->size) : cap;
+        if (to - log->size > (off_t)cap)
+            posix_fadvise(log->fd, log->size + cap, LOG_READAHEAD, POSIX_FADV_WILLNEED);
+        ssize_t n = pread(log->fd, buf, want, log->size);
+        if (n <= 0) {
+            rc = -1;
+            break;
+        }
+
+        // Walk the records that are wholly inside the buffer
+        size_t off = 0;
+        struct record_hdr h;
+        uint32_t stored = 0;
+        while (off + sizeof(h) <= (size_t)n && log->size + (off_t)off < stop) {
+            memcpy(&h, buf + off, sizeof(h));
+            if (h.seq != log->seq + 1) {
+                rc = -1;
+                break;
+            }
+            stored = stored_len(log->deduplicated, &h);
+            if (off + sizeof(h) + stored > (size_t)n) break;
+            const char *body = buf + off + sizeof(h);
+            if (record_crc(&h, body, stored) != h.crc) {
+                rc = -1;
+                break;
+            }
+
+            // A reference must point back into the file; its bytes reach
+            // the cache through cache_load()
+            uint32_t len = stored;
+            struct record_ref ref;
+            if (is_ref(log, &h)) {
+                memcpy(&ref, body, sizeof(ref));
+                if (stored != sizeof(ref) || ref.offset >= (uint64_t)(log->size + off)) {
+                    rc = -1;
+                    break;
+                }
+                len = ref.len;
+            } else {
+                if (log->dedupe && len > sizeof(ref))
+                    dedupe_add(log, dedupe_hash(log, body, len), log->size + off, log->payload,
+                               len);
+                cache_append(log, log->payload, body, len);
+            }
+            index_add(log, log->size + off, log->payload);
+            off += sizeof(h) + stored;
+            log->seq++;
+            log->payload += len;
+        }
+        log->size += off;
+        if (rc < 0) break;
+
+        if (off == 0) {
+            // A record larger than the buffer, or one cut short by the end
+            if ((size_t)n < sizeof(h) || log->size + (off_t)(sizeof(h) + stored) > to) {
+                rc = -1;
+                break;
+            }
+            char *bigger = realloc(buf, sizeof(h) + stored);
+            if (!bigger) {
+                rc = -1;
+                break;
+            }
+            buf = bigger;
+            cap = sizeof(h) + stored;
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
+/**
+ * record_valid
+ * ------------
+ * Checks the CRC of the record whose header h, followed by stored bytes,
+ * was read at offset off.
+ */
+static bool record_valid(int fd, off_t off, const struct record_hdr *h, uint32_t stored,
+                         char *buf) {
+    uint32_t crc = crc32c(0, &h->len, sizeof(h->len));
+    crc = crc32c(crc, &h->seq, sizeof(h->seq));
+    off += sizeof(*h);
+    for (uint32_t left = stored; left > 0; ) {
+        size_t want = left < LOG_SCAN_CHUNK ? left : LOG_SCAN_CHUNK;
+        ssize_t n = pread(fd, buf, want, off);
+        if (n <= 0) return false;
+        crc = crc32c(crc, buf, n);
+        off += n;
+        left -= n;
+    }
+    return crc == h->crc;
+}
+
+/**
+ * find_record
+ * -----------
+ * Finds the first record starting in [from, stop) of a checksummed (or, if
+ * deduplicated is set, deduplicated) file to bytes long, without knowing
+ * where the records before it end. A
+ * candidate header needs a plausible length and sequence number, a
+ * successor carrying the next sequence number, and a matching CRC.
+ *
+ * Returns:
+ *   The record's offset, or -1 if none was found.
+ */
+static off_t find_record(int fd, bool deduplicated, off_t from, off_t stop, off_t to,
+                         uint64_t *seq) {
+    char *buf = malloc(LOG_SCAN_CHUNK);
+    char *check = malloc(LOG_SCAN_CHUNK);
+    off_t found = -1;
+    uint64_t max_seq = (to - LOG_MAGIC_LEN) / sizeof(struct record_hdr);
+
+    for (off_t base = from; buf && check && base < stop && found < 0; ) {
+        size_t want = to - base < LOG_SCAN_CHUNK ? (size_t)(to - base) : LOG_SCAN_CHUNK;
+        ssize_t n = pread(fd, buf, want, base);
+        if (n < (ssize_t)sizeof(struct record_hdr)) break;
+
+        size_t last = n - sizeof(struct record_hdr);   // Last header wholly in buf
+        for (size_t i = 0; i <= last && base + (off_t)i < stop; ++i) {
+            struct record_hdr h, next;
+            memcpy(&h, buf + i, sizeof(h));
+            uint32_t stored = stored_len(deduplicated, &h);
+            off_t end = base + i + sizeof(h) + stored;
+            if (h.seq == 0 || h.seq > max_seq || end > to) continue;
+            if (end + (off_t)sizeof(next) <= to) {
+                if (end + (off_t)sizeof(next) <= base + n)
+                    memcpy(&next, buf + (end - base), sizeof(next));
+                else if (pread(fd, &next, sizeof(next), end) != sizeof(next))
+                    continue;
+                if (next.seq != h.seq + 1) continue;
+            }
+            if (!record_valid(fd, base + i, &h, stored, check)) continue;
+            found = base + i;
+            *seq = h.seq;
+            break;
+        }
+        base += last + 1;
+    }
+
+    free(buf);
+    free(check);
+    return found;
+}
+
+/**
+ * scan_part_thread
+ * ----------------
+ * Validates one slice of a checksummed file through its own descriptor, so
+ * each thread gets its own sequential readahead.
+ */
+static void *scan_part_thread(void *arg) {
+    struct scan_part *p = arg;
+    p->rc = -1;
+    p->first = -1;
+
+    int fd = open(p->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, p->from, LOG_READAHEAD, POSIX_FADV_WILLNEED);
+
+    if (p->from == LOG_MAGIC_LEN) {
+        p->first = p->from;
+        p->first_seq = 1;
+    } else {
+        p->first = find_record(fd, p->log.deduplicated, p->from, p->stop, p->to,
+                               &p->first_seq);
+    }
+    if (p->first >= 0) {
+        p->log.fd = fd;
+        p->log.size = p->first;
+        p->log.seq = p->first_seq - 1;
+        p->rc = datalog_scan(&p->log, p->stop, p->to);
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * datalog_recover
+ * ---------------
+ * Validates a checksummed file to bytes long, rebuilding log->size, seq,
+ * payload and the offset index. Large files are split into slices that are
+ * scanned in parallel and then stitched together; wherever two slices do
+ * not line up, a single pass takes over from the last record both agree on.
+ *
+ * Returns:
+ *   0 if every record was intact, -1 at the first torn or corrupt record
+ *   (log->size is then its offset).
+ */
+static int datalog_recover(struct datalog *log, off_t to) {
+    log->size = LOG_MAGIC_LEN;
+    log->seq = 0;
+    log->payload = 0;
+
+    long cpus = log->scan_threads ? (long)log->scan_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    off_t bytes = to - LOG_MAGIC_LEN;
+    unsigned nparts = cpus > LOG_SCAN_THREADS ? LOG_SCAN_THREADS : cpus > 1 ? (unsigned)cpus : 1;
+    if (bytes / LOG_SCAN_SLICE < nparts) nparts = bytes / LOG_SCAN_SLICE > 1 ? bytes / LOG_SCAN_SLICE : 1;
+    struct scan_part *parts = nparts > 1 ? calloc(nparts, sizeof(*parts)) : NULL;
+    if (!parts) nparts = 1;
+    log->scan_threads = nparts;
+
+    for (unsigned i = 0; parts && i < nparts; ++i) {
+        struct scan_part *p = &parts[i];
+        p->path = log->path;
+        p->from = LOG_MAGIC_LEN + bytes * i / nparts;
+        p->stop = LOG_MAGIC_LEN + bytes * (i + 1) / nparts;
+        p->to = to;
+        p->log = (struct datalog)DATALOG_INITIALIZER;
+        p->log.checksummed = true;
+        p->log.deduplicated = log->deduplicated;
+        if (pthread_create(&p->thread, NULL, scan_part_thread, p) != 0) {
+            scan_part_thread(p);
+            p->thread = 0;
+        }
+    }
+
+    bool stitched = true;
+    for (unsigned i = 0; parts && i < nparts; ++i) {
+        struct scan_part *p = &parts[i];
+        if (p->thread) pthread_join(p->thread, NULL);
+        if (!stitched) continue;
+
+        if (p->first < 0 && log->size >= p->stop) continue;   // Inside an earlier record
+        if (p->first != log->size || p->first_seq != log->seq + 1) {
+            stitched = false;
+            continue;
+        }
+        for (size_t k = 0; k < p->log.index_len; ++k)
+            index_add(log, p->log.index[k].offset, log->payload + p->log.index[k].payload);
+        log->size = p->log.size;
+        log->seq = p->log.seq;
+        log->payload += p->log.payload;
+        if (p->rc < 0) stitched = false;
+    }
+    for (unsigned i = 0; parts && i < nparts; ++i) free(parts[i].log.index);
+    free(parts);
+
+    // Whatever the slices could not vouch for is checked in one pass
+    return datalog_scan(log, to, to);
+}
+
+/**
+ * walk_ref
+ * --------
+ * Feeds the bytes a reference record stands for to sink, read from the
+ * first copy of its body: those past *skip, which it reduces, and at most
+ * want of them, adding what it fed to *done.
+ *
+ * Returns:
+ *   0 on success, -1 if reading the file or the sink failed.
+ */
+static int walk_ref(struct datalog *log, const struct record_ref *ref, off_t *skip, off_t want,
+                    off_t *done, record_sink sink, void *arg) {
+    char readbuf[16384];
+    off_t begin = *skip < (off_t)ref->len ? *skip : (off_t)ref->len;
+    *skip -= begin;
+    off_t left = ref->len - begin;
+    if (left > want) left = want;
+
+    off_t pos = ref->offset + sizeof(struct record_hdr) + begin;
+    while (left > 0) {
+        size_t n = left < (off_t)sizeof(readbuf) ? (size_t)left : sizeof(readbuf);
+        if (pread(log->fd, readbuf, n, pos) != (ssize_t)n) {
+            syslog(LOG_ERR, "Failed to read %s for replay", log->path);
+            return -1;
+        }
+        if (sink(arg, readbuf, n) < 0) return -1;
+        pos += n;
+        left -= n;
+        *done += n;
+    }
+    return 0;
+}
+
+/**
+ * walk_records
+ * ------------
+ * Checksummed data file: feeds len record bytes, starting at payload offset
+ * from, to sink without the headers, expanding references. Starts at the
+ * nearest index entry.
+ *
+ * Returns:
+ *   0 on success, -1 if reading the file or the sink failed.
+ */
+static int walk_records(struct datalog *log, off_t from, off_t len,
+                        record_sink sink, void *arg) {
+    char readbuf[16384];
+    struct log_index_entry start = index_find(log, from);
+    off_t pos = start.offset;   // File offset of readbuf[0]
+    off_t skip = from - start.payload;
+    size_t have = 0, off = 0;
+    uint64_t body_left = 0;     // Bytes of the current record not yet consumed
+    off_t done = 0;
+    // A reference is read along with its header
+    size_t whole = sizeof(struct record_hdr) +
+                   (log->deduplicated ? sizeof(struct record_ref) : 0);
+
+    while (done < len) {
+        if (body_left == 0 && have - off < whole) {
+            // Refill so the next header is in one piece
+            pos += off;
+            ssize_t nn = pread(log->fd, readbuf, sizeof(readbuf), pos);
+            if (nn < (ssize_t)sizeof(struct record_hdr)) goto read_error;
+            have = nn;
+            off = 0;
+        }
+        if (body_left == 0) {
+            struct record_hdr h;
+            memcpy(&h, readbuf + off, sizeof(h));
+            off += sizeof(h);
+            body_left = h.len;
+            if (is_ref(log, &h)) {
+                struct record_ref ref;
+                if (have - off < sizeof(ref)) goto read_error;
+                memcpy(&ref, readbuf + off, sizeof(ref));
+                off += sizeof(ref);
+                body_left = 0;
+                if (walk_ref(log, &ref, &skip, len - done, &done, sink, arg) < 0) return -1;
+            }
+            continue;
+        }
+        if (off == have) {
+            pos += have;
+            ssize_t nn = pread(log->fd, readbuf, sizeof(readbuf), pos);
+            if (nn <= 0) goto read_error;
+            have = nn;
+            off = 0;
+        }
+
+        size_t take = have - off;
+        if (take > body_left) take = body_left;
+        if (skip > 0) {
+            // Bytes between the index entry and from
+            if ((off_t)take > skip) take = skip;
+            skip -= take;
+        } else {
+            if ((off_t)take > len - done) take = len - done;
+            if (sink(arg, readbuf + off, take) < 0) return -1;
+            done += take;
+        }
+        off += take;
+        body_left -= take;
+    }
+    return 0;
+
+read_error:
+    syslog(LOG_ERR, "Failed to read %s for replay", log->path);
+    return -1;
+}
+
+/**
+ * cache_sink
+ * ----------
+ * record_sink filling the replay cache in file order.
+ */
+static int cache_sink(void *arg, const char *buf, size_t len) {
+    struct datalog *log = arg;
+    cache_append(log, atomic_load_explicit(&log->cached, memory_order_relaxed), buf, len);
+    return 0;
+}
+
+/**
+ * cache_load
+ * ----------
+ * Fills the replay cache from the file after recovery, up to its capacity.
+ */
+static void cache_load(struct datalog *log) {
+    off_t want = (off_t)log->cache_chunks * LOG_CACHE_CHUNK;
+    if (want > log->payload) want = log->payload;
+    off_t cached = atomic_load(&log->cached);
+    if (cached >= want) return;
+
+    if (log->checksummed) {
+        walk_records(log, cached, want - cached, cache_sink, log);
+        return;
+    }
+    char buf[16384];
+    while (cached < want) {
+        size_t n = want - cached < (off_t)sizeof(buf) ? (size_t)(want - cached) : sizeof(buf);
+        ssize_t nn = pread(log->fd, buf, n, cached);
+        if (nn <= 0) break;
+        cache_append(log, cached, buf, nn);
+        cached += nn;
+    }
+}
+
+/**
+ * dedupe_load
+ * -----------
+ * Deduplicated file: hashes the bodies of its records after recovery, so
+ * appends refer to bodies stored before the restart too. Bodies larger
+ * than LOG_SCAN_CHUNK are left out.
+ */
+static void dedupe_load(struct datalog *log) {
+    char *buf = malloc(LOG_SCAN_CHUNK);
+    if (!buf) return;
+
+    off_t pos = LOG_MAGIC_LEN, payload = 0;
+    while (pos < log->size) {
+        size_t want = log->size - pos < LOG_SCAN_CHUNK ? (size_t)(log->size - pos) : LOG_SCAN_CHUNK;
+        ssize_t n = pread(log->fd, buf, want, pos);
+        if (n < (ssize_t)sizeof(struct record_hdr)) break;
+
+        size_t off = 0;
+        while (off + sizeof(struct record_hdr) <= (size_t)n) {
+            struct record_hdr h;
+            struct record_ref ref;
+            memcpy(&h, buf + off, sizeof(h));
+            uint32_t stored = stored_len(true, &h);
+            bool whole = off + sizeof(h) + stored <= (size_t)n;
+            if (is_ref(log, &h)) {
+                if (!whole) break;
+                memcpy(&ref, buf + off + sizeof(h), sizeof(ref));
+                payload += ref.len;
+            } else {
+                if (!whole && off > 0) break;      // Read again from its start
+                if (whole && stored > sizeof(ref))
+                    dedupe_add(log, dedupe_hash(log, buf + off + sizeof(h), stored),
+                               pos + off, payload, stored);
+                payload += stored;
+            }
+            off += sizeof(h) + stored;
+        }
+        if (off == 0) break;
+        pos += off;
+    }
+    free(buf);
+}
+
+int datalog_open(struct datalog *log, const char *path, enum log_format format,
+                 size_t cache_bytes) {
+    uint64_t start = now_ms();
+    log->path = path;
+    log->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    log->cache_chunks = (cache_bytes + LOG_CACHE_CHUNK - 1) / LOG_CACHE_CHUNK;
+    log->cache = log->cache_chunks ? calloc(log->cache_chunks, sizeof(*log->cache)) : NULL;
+    if (!log->cache) log->cache_chunks = 0;
+    atomic_store(&log->cached, 0);
+    log->index_len = 0;
+    log->index_next = 0;
+
+    // The lock keeps an instance handing over from appending mid-check
+    flock(log->fd, LOCK_EX);
+    struct stat st;
+    char magic[LOG_MAGIC_LEN];
+    if (fstat(log->fd, &st) < 0) goto fail;
+    if (st.st_size == 0 && format != LOG_RAW) {
+        const char *m = format == LOG_DEDUPLICATED ? LOG_DEDUPE_MAGIC : LOG_MAGIC;
+        if (write(log->fd, m, LOG_MAGIC_LEN) != LOG_MAGIC_LEN) goto fail;
+        st.st_size = LOG_MAGIC_LEN;
+    }
+
+    bool magic_read = st.st_size >= LOG_MAGIC_LEN &&
+                      pread(log->fd, magic, LOG_MAGIC_LEN, 0) == LOG_MAGIC_LEN;
+    log->deduplicated = magic_read && memcmp(magic, LOG_DEDUPE_MAGIC, LOG_MAGIC_LEN) == 0;
+    log->checksummed = log->deduplicated ||
+                       (magic_read && memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) == 0);
+    if (!log->checksummed) {
+        log->size = log->payload = st.st_size;
+        log->scan_threads = 0;
+    } else if (datalog_recover(log, st.st_size) < 0) {
+        syslog(LOG_WARNING, "Bad record %llu at offset %lld of %s, dropping %lld bytes",
+               (unsigned long long)log->seq + 1, (long long)log->size, path,
+               (long long)(st.st_size - log->size));
+        if (ftruncate(log->fd, log->size) < 0) goto fail;
+    }
+    cache_load(log);
+    if (log->deduplicated) dedupe_load(log);
+    flock(log->fd, LOCK_UN);
+
+    log->open_ms = now_ms() - start;
+    if (log->payload > 0)
+        syslog(LOG_INFO, "Recovered %lld bytes (%llu records) of %s in %llu ms, "
+               "%u scan threads, %lld bytes cached",
+               (long long)log->payload, (unsigned long long)log->seq, path,
+               (unsigned long long)log->open_ms, log->scan_threads,
+               (long long)atomic_load(&log->cached));
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "Failed to read %s: %s", path, strerror(errno));
+    close(log->fd);
+    log->fd = -1;
+    return -1;
+}
+
+/**
+ * write_all
+ * ---------
+ * Writes the iovecs in full, retrying short and interrupted writes.
+ *
+ * Returns:
+ *   Bytes written, which is less than requested only on failure.
+ */
+static size_t write_all(struct datalog *log, struct iovec *iov, int iovcnt) {
+    size_t done = 0;
+    while (iovcnt > 0) {
+        ssize_t n = writev(log->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Failed to write %s: %s", log->path, strerror(errno));
+            break;
+        }
+        done += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return done;
+}
+
+/**
+ * append_begin
+ * ------------
+ * Takes the append lock: the shared robust mutex for pre-forked workers,
+ * else the log's own. A checksummed file is also locked against an
+ * instance sharing it during a handoff, and any records that instance
+ * appended since our last one are accounted for.
+ *
+ * Returns:
+ *   0 on success, -1 if the lock could not be taken.
+ */
+static int append_begin(struct datalog *log) {
+    if (log->shared) {
+        if (shmlog_lock(log->shared, log->fd) < 0) return -1;
+        log->size = log->shared->size;
+        log->seq = log->shared->records;
+        log->payload = log->shared->payload;
+    } else {
+        pthread_mutex_lock(&log->lock);
+    }
+
+    if (log->checksummed) {
+        flock(log->fd, LOCK_EX);
+        struct stat st;
+        if (fstat(log->fd, &st) == 0 && st.st_size > log->size) {
+            if (datalog_scan(log, st.st_size, st.st_size) < 0)
+                syslog(LOG_ERR, "Bad record appended to %s at offset %lld",
+                       log->path, (long long)log->size);
+            // The scan leaves the bytes of references out of the cache
+            if (log->deduplicated) cache_load(log);
+        }
+    }
+    return 0;
+}
+
+/**
+ * append_commit
+ * -------------
+ * After total bytes holding a record of len bytes were written at file
+ * offset start, payload offset start_payload: advances the log past them.
+ *
+ * Returns:
+ *   The new replay length.
+ */
+static off_t append_commit(struct datalog *log, off_t start, off_t start_payload, size_t total,
+                           off_t len) {
+    // O_APPEND leaves the offset at the end of our write, even if another
+    // process (an instance mid-handoff) appended to the file as well
+    off_t pos = lseek(log->fd, 0, SEEK_CUR);
+    log->size = pos >= 0 ? pos : start + (off_t)total;
+    if (log->checksummed) {
+        index_add(log, start, start_payload);
+        log->payload += len;
+        log->seq++;
+    } else {
+        log->payload = log->size;
+    }
+    return log->payload;
+}
+
+/**
+ * append_end
+ * ----------
+ * Rolls back a failed append (end < 0) that left done bytes behind, or
+ * publishes a successful one of total bytes, and releases the locks taken
+ * by append_begin().
+ */
+static void append_end(struct datalog *log, off_t end, size_t total, size_t done) {
+    if (end < 0 && done > 0 && ftruncate(log->fd, log->size) < 0) {
+        // Never leave half a packet behind
+        syslog(LOG_ERR, "Failed to roll back partial write: %s", strerror(errno));
+    }
+    if (log->checksummed) flock(log->fd, LOCK_UN);
+
+    if (log->shared) {
+        if (end >= 0) {
+            shmlog_commit(log->shared, log->size, total, log->worker);
+            log->shared->payload = log->payload;
+        }
+        shmlog_unlock(log->shared);
+    } else {
+        if (end >= 0) pthread_cond_broadcast(&log->grown);
+        pthread_mutex_unlock(&log->lock);
+    }
+}
+
+off_t datalog_append(struct datalog *log, const char *buf, size_t len) {
+    struct record_ref ref = { 0 };
+    if (log->deduplicated && len >= RECORD_REF) {
+        syslog(LOG_ERR, "Record of %zu bytes is too large for %s", len, log->path);
+        return -1;
+    }
+    // Hashed before taking the lock; bodies no longer than a reference are
+    // stored as they are
+    uint64_t hash = log->deduplicated && len > sizeof(ref) ? dedupe_hash(log, buf, len) : 0;
+    if (append_begin(log) < 0) return -1;
+
+    struct record_hdr h = { .len = len };
+    const void *body = buf;
+    size_t stored = len;
+    struct dedupe_entry *e = hash ? dedupe_find(log, hash) : NULL;
+    if (e && dedupe_equal(log, e, buf, len)) {
+        ref = (struct record_ref){ .offset = e->offset, .len = len };
+        h.len = RECORD_REF | sizeof(ref);
+        body = &ref;
+        stored = sizeof(ref);
+    } else {
+        e = NULL;
+    }
+
+    struct iovec iov[2];
+    int iovcnt = 0;
+    if (log->checksummed) {
+        h.seq = log->seq + 1;
+        h.crc = record_crc(&h, body, stored);
+        iov[iovcnt++] = (struct iovec){ .iov_base = &h, .iov_len = sizeof(h) };
+    }
+    iov[iovcnt++] = (struct iovec){ .iov_base = (void *)body, .iov_len = stored };
+    size_t total = (log->checksummed ? sizeof(h) : 0) + stored;
+
+    off_t end = -1;
+    off_t start = log->size, start_payload = log->payload;
+    size_t done = write_all(log, iov, iovcnt);
+    if (done == total) {
+        end = append_commit(log, start, start_payload, total, len);
+        cache_append(log, end - (off_t)len, buf, len);
+        if (e) {
+            atomic_fetch_add_explicit(&log->dedupe_refs, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&log->dedupe_saved, len - stored, memory_order_relaxed);
+        } else if (hash) {
+            dedupe_add(log, hash, start, start_payload, len);
+        }
+    }
+    append_end(log, end, total, done);
+    return end;
+}
+
+/**
+ * staged_crc
+ * ----------
+ * Sets h->crc for a record made of the first staged bytes of the file fd
+ * followed by len bytes at buf, reading the file through chunk.
+ *
+ * Returns:
+ *   0 on success, -1 if the file could not be read.
+ */
+static int staged_crc(struct record_hdr *h, int fd, off_t staged, const char *buf, size_t len,
+                      char *chunk) {
+    uint32_t crc = crc32c(0, &h->len, sizeof(h->len));
+    crc = crc32c(crc, &h->seq, sizeof(h->seq));
+    for (off_t off = 0; off < staged; ) {
+        size_t want = staged - off < LOG_COPY_CHUNK ? (size_t)(staged - off) : LOG_COPY_CHUNK;
+        ssize_t n = pread(fd, chunk, want, off);
+        if (n <= 0) return -1;
+        crc = crc32c(crc, chunk, n);
+        off += n;
+    }
+    h->crc = crc32c(crc, buf, len);
+    return 0;
+}
+
+off_t datalog_append_staged(struct datalog *log, int fd, off_t staged, const char *buf,
+                            size_t len) {
+    char *chunk = malloc(LOG_COPY_CHUNK);
+    if (!chunk || append_begin(log) < 0) {
+        free(chunk);
+        return -1;
+    }
+
+    off_t end = -1;
+    size_t done = 0;
+    off_t start = log->size, start_payload = log->payload;
+    off_t record = staged + (off_t)len;
+    struct record_hdr h = { .len = (uint32_t)record, .seq = log->seq + 1 };
+    size_t total = (log->checksummed ? sizeof(h) : 0) + record;
+    if (log->checksummed && record > (log->deduplicated ? RECORD_REF - 1 : UINT32_MAX)) {
+        syslog(LOG_ERR, "Record of %lld bytes does not fit a record header of %s",
+               (long long)record, log->path);
+        goto out;
+    }
+    if (log->checksummed) {
+        if (staged_crc(&h, fd, staged, buf, len, chunk) < 0) goto read_error;
+        struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+        done += write_all(log, &iov, 1);
+        if (done != sizeof(h)) goto out;
+    }
+
+    // The staged bytes go in bounded chunks, so memory use does not depend
+    // on the size of the record
+    for (off_t off = 0; off < staged; ) {
+        size_t want = staged - off < LOG_COPY_CHUNK ? (size_t)(staged - off) : LOG_COPY_CHUNK;
+        ssize_t n = pread(fd, chunk, want, off);
+        if (n <= 0) goto read_error;
+        struct iovec iov = { .iov_base = chunk, .iov_len = n };
+        size_t wrote = write_all(log, &iov, 1);
+        done += wrote;
+        if (wrote != (size_t)n) goto out;
+        off += n;
+    }
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    done += write_all(log, &iov, 1);
+    if (done != total) goto out;
+
+    end = append_commit(log, start, start_payload, total, record);
+    cache_load(log);
+    goto out;
+
+read_error:
+    syslog(LOG_ERR, "Failed to read staged record: %s", strerror(errno));
+out:
+    append_end(log, end, total, done);
+    free(chunk);
+    return end;
+}
+
+off_t datalog_length(struct datalog *log) {
+    pthread_mutex_lock(&log->lock);
+    off_t len = log->payload;
+    pthread_mutex_unlock(&log->lock);
+    return len;
+}
+
+/**
+ * replay_flush
+ * ------------
+ * Sends the chain of a replay sink once it holds BUFCHAIN_CHUNK bytes, or
+ * whatever it holds if all is set, and empties it.
+ *
+ * Returns:
+ *   0 on success, -1 if sending failed.
+ */
+static int replay_flush(struct replay_sink *s, bool all) {
+    if (s->fd < 0 || s->chain->len == 0 || (!all && s->chain->len < BUFCHAIN_CHUNK)) return 0;
+    int rc = bufchain_send(s->chain, s->fd);
+    bufchain_clear(s->chain);
+    if (rc < 0) syslog(LOG_ERR, "Failed to send data to client");
+    return rc;
+}
+
+/**
+ * chain_sink
+ * ----------
+ * record_sink for replays and datalog_chain(): copies the bytes into the
+ * chain.
+ */
+static int chain_sink(void *arg, const char *buf, size_t len) {
+    struct replay_sink *s = arg;
+    if (bufchain_copy(s->chain, buf, len) < 0) return -1;
+    return replay_flush(s, false);
+}
+
+/**
+ * chain_cached
+ * ------------
+ * Adds the record bytes from *from up to end that are in the replay cache
+ * to the sink's chain by reference, and advances *from past them.
+ *
+ * Returns:
+ *   0 on success, -1 if memory is exhausted.
+ */
+static int chain_cached(struct datalog *log, off_t *from, off_t end, struct replay_sink *s) {
+    off_t cached = atomic_load_explicit(&log->cached, memory_order_acquire);
+    if (cached > end) cached = end;
+    while (*from < cached) {
+        size_t in = *from % LOG_CACHE_CHUNK;
+        size_t n = LOG_CACHE_CHUNK - in;
+        if ((off_t)n > cached - *from) n = cached - *from;
+        if (bufchain_add(s->chain, log->cache[*from / LOG_CACHE_CHUNK], in, n) < 0) return -1;
+        *from += n;
+    }
+    return 0;
+}
+
+/**
+ * chain_file
+ * ----------
+ * Reads len bytes at file offset at straight into the sink's chain.
+ *
+ * Returns:
+ *   0 on success, -1 if reading the file or sending failed.
+ */
+static int chain_file(struct datalog *log, off_t at, off_t len, struct replay_sink *s) {
+    off_t end = at + len;
+    while (at < end) {
+        size_t avail;
+        char *dst = bufchain_space(s->chain, &avail);
+        if (!dst) return -1;
+        if ((off_t)avail > end - at) avail = end - at;
+        ssize_t n = pread(log->fd, dst, avail, at);
+        if (n <= 0) {
+            syslog(LOG_ERR, "Failed to read %s", log->path);
+            return -1;
+        }
+        if (bufchain_commit(s->chain, n) < 0 || replay_flush(s, false) < 0) return -1;
+        at += n;
+    }
+    return 0;
+}
+
+/**
+ * chain_records
+ * -------------
+ * Adds len record bytes, starting at payload offset from, to the sink's
+ * chain: cached bytes by reference, the rest read from the file into the
+ * chain's own chunks.
+ *
+ * Returns:
+ *   0 on success, -1 if reading the file or sending failed.
+ */
+static int chain_records(struct datalog *log, off_t from, off_t len, struct replay_sink *s) {
+    off_t end = from + len;
+    if (chain_cached(log, &from, end, s) < 0) return -1;
+    if (from < end && log->checksummed)
+        return walk_records(log, from, end - from, chain_sink, s);
+    // Raw records are where their bytes are in the file
+    return chain_file(log, from, end - from, s);
+}
+
+/**
+ * walk_headers
+ * ------------
+ * Checksummed data file: hands every record from the one at start on to
+ * visit, up to the record ending at payload offset len. Only the headers
+ * (and references) are read.
+ *
+ * Returns:
+ *   0 on success, -1 if reading the file or visit failed.
+ */
+static int walk_headers(struct datalog *log, struct log_index_entry start, off_t len,
+                        record_visit visit, void *arg) {
+    char readbuf[16384];
+    off_t bufpos = 0;           // File offset of readbuf[0]
+    size_t have = 0;
+    off_t pos = start.offset;   // File offset of the next record header
+    off_t payload = start.payload;
+    // A reference is read along with its header
+    size_t whole = sizeof(struct record_hdr) +
+                   (log->deduplicated ? sizeof(struct record_ref) : 0);
+
+    while (payload < len) {
+        if (pos < bufpos || pos + (off_t)whole > bufpos + (off_t)have) {
+            ssize_t nn = pread(log->fd, readbuf, sizeof(readbuf), pos);
+            if (nn < (ssize_t)sizeof(struct record_hdr)) goto read_error;
+            bufpos = pos;
+            have = nn;
+        }
+        struct record_hdr h;
+        const char *at = readbuf + (pos - bufpos);
+        memcpy(&h, at, sizeof(h));
+        off_t body = pos + sizeof(h);
+        struct record_ref ref;
+        uint32_t bytes = h.len;
+        if (is_ref(log, &h)) {
+            if (pos + (off_t)whole > bufpos + (off_t)have) goto read_error;
+            memcpy(&ref, at + sizeof(h), sizeof(ref));
+            bytes = ref.len;
+        }
+        if (visit(arg, &h, payload, body, is_ref(log, &h) ? &ref : NULL) < 0) return -1;
+        pos = body + stored_len(log->deduplicated, &h);
+        payload += bytes;
+    }
+    return 0;
+
+read_error:
+    syslog(LOG_ERR, "Failed to read %s for replay", log->path);
+    return -1;
+}
+
+/**
+ * last_seq
+ * --------
+ * record_visit noting the sequence number of the latest record visited.
+ */
+static int last_seq(void *arg, const struct record_hdr *h, off_t payload, off_t body,
+                    const struct record_ref *ref) {
+    (void)payload;
+    (void)body;
+    (void)ref;
+    *(uint64_t *)arg = h->seq;
+    return 0;
+}
+
+// A framed replay being put together
+struct framed_sink {
+    struct datalog *log;
+    struct replay_sink *s;
+};
+
+/**
+ * chain_framed
+ * ------------
+ * record_visit for framed replays: adds the record to the chain as its
+ * varint length followed by its bytes, cached ones by reference and the
+ * rest read from the file, references expanded.
+ */
+static int chain_framed(void *arg, const struct record_hdr *h, off_t payload, off_t body,
+                        const struct record_ref *ref) {
+    struct framed_sink *f = arg;
+    uint32_t len = ref ? ref->len : h->len;
+    char hdr[VARINT_MAX_LEN];
+    if (bufchain_copy(f->s->chain, hdr, varint_encode(len, hdr)) < 0) return -1;
+
+    off_t from = payload, end = payload + len;
+    if (chain_cached(f->log, &from, end, f->s) < 0) return -1;
+    if (from < end) {
+        off_t skip = from - payload, done = 0;
+        if (ref) return walk_ref(f->log, ref, &skip, end - from, &done, chain_sink, f->s);
+        return chain_file(f->log, body + skip, end - from, f->s);
+    }
+    return replay_flush(f->s, false);
+}
+
+int datalog_chain(struct datalog *log, off_t from, off_t len, struct bufchain *chain) {
+    struct replay_sink s = { .fd = -1, .chain = chain };
+    return chain_records(log, from, len, &s);
+}
+
+/**
+ * replay_send
+ * -----------
+ * Sends a replay of the first len record bytes to clientfd through chain,
+ * preceded by hdrlen bytes of protocol header, as plain bytes or as framed
+ * records, and counts what it took.
+ *
+ * Returns:
+ *   0 on success, -1 if reading the file or sending failed.
+ */
+static int replay_send(struct datalog *log, struct bufchain *chain, int clientfd, off_t len,
+                       const char *hdrbuf, size_t hdrlen, bool framed) {
+    struct replay_sink s = { .fd = clientfd, .chain = chain };
+    struct bufchain before = *chain;
+
+    // The header rides along with the cached prefix in the first send
+    bufchain_clear(chain);
+    int rc = bufchain_borrow(chain, hdrbuf, hdrlen);
+    if (rc == 0 && framed) {
+        struct framed_sink f = { .log = log, .s = &s };
+        rc = walk_headers(log, index_find(log, 0), len, chain_framed, &f);
+    } else if (rc == 0) {
+        rc = chain_records(log, 0, len, &s);
+    }
+    if (rc == 0) rc = replay_flush(&s, true);
+    bufchain_clear(chain);
+
+    atomic_fetch_add_explicit(&log->replays, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->replay_copies, chain->copies - before.copies,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->replay_copied, chain->copied - before.copied,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->replay_sends, chain->sends - before.sends,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->replay_zc_sends, chain->zc_sends - before.zc_sends,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->replay_zc_copied, chain->zc_copied - before.zc_copied,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&log->replay_zc_fallbacks,
+                              chain->zc_fallbacks - before.zc_fallbacks, memory_order_relaxed);
+    return rc;
+}
+
+int datalog_replay(struct datalog *log, struct bufchain *chain, int clientfd, off_t len,
+                   const char *hdrbuf, size_t hdrlen) {
+    return replay_send(log, chain, clientfd, len, hdrbuf, hdrlen, false);
+}
+
+int datalog_replay_framed(struct datalog *log, struct bufchain *chain, int clientfd, off_t len) {
+    if (!log->checksummed) return -1;
+
+    // Records are numbered from 1, so the last one's number is the count;
+    // it is found from the nearest index entry rather than the start
+    uint64_t count = 0;
+    if (len > 0 && walk_headers(log, index_find(log, len - 1), len, last_seq, &count) < 0)
+        return -1;
+    char hdr[VARINT_MAX_LEN];
+    return replay_send(log, chain, clientfd, len, hdr, varint_encode(count, hdr), true);
+}
+
+void datalog_close(struct datalog *log) {
+    if (log->fd < 0) return;
+    fdatasync(log->fd);
+    close(log->fd);
+    log->fd = -1;
+
+    for (size_t i = 0; i < log->cache_chunks; ++i) buf_chunk_unref(log->cache[i]);
+    free(log->cache);
+    log->cache = NULL;
+    log->cache_chunks = 0;
+    atomic_store(&log->cached, 0);
+    free(log->index);
+    log->index = NULL;
+    log->index_len = log->index_cap = 0;
+    free(log->dedupe);
+    log->dedupe = NULL;
+    log->dedupe_mask = log->dedupe_count = 0;
+}
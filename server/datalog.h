@@ -0,0 +1,210 @@
+/**
+ * datalog.h
+ *
+ * The append-only data file every packet is committed to and replayed from.
+ * A file is either raw (packets back to back) or checksummed: the magic
+ * LOG_MAGIC followed by records, each behind a struct record_hdr. A
+ * deduplicated file (LOG_DEDUPE_MAGIC) is checksummed too, but stores
+ * every record body only once: a record whose body is already in the file
+ * is written as a reference to its first copy (RECORD_REF, struct
+ * record_ref). Bodies are found by their XXH64 hash and compared before
+ * they are referenced, and replays expand references back into the exact
+ * bytes that were appended.
+ *
+ * Opening a file recovers it: a checksummed file is validated by several
+ * threads at once and truncated at the first torn or corrupt record. Two
+ * in-memory structures are rebuilt on the way and kept up to date by appends:
+ * - a sparse offset index mapping record bytes to file offsets, so a replay
+ *   can start reading a checksummed file in the middle;
+ * - a replay cache holding the first record bytes of the file. Every replay
+ *   starts at the beginning of the file, so that prefix is the hottest data
+ *   there is, and it never changes once written.
+ *
+ * Replays and replication batches are put together as buffer chains (see
+ * bufchain.h) that point into the cache's chunks instead of copying them;
+ * only bytes read back from the file are copied.
+ */
+
+#ifndef DATALOG_H
+#define DATALOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "shmlog.h"
+#include "bufchain.h"
+
+#define LOG_MAGIC "AESDLOG1"                    // First bytes of a checksummed data file
+#define LOG_DEDUPE_MAGIC "AESDDUP1"             // ...and of a deduplicated one
+#define LOG_MAGIC_LEN 8
+#define LOG_INDEX_STRIDE (1024 * 1024)          // Record bytes between index entries
+#define LOG_CACHE_CHUNK (1024 * 1024)           // Allocation unit of the replay cache
+#define LOG_DEFAULT_CACHE (64u * 1024 * 1024)
+#define LOG_DEDUPE_ENTRIES (512u * 1024)        // Most distinct bodies a log remembers
+#define RECORD_REF 0x80000000u                  // Deduplicated files: record_hdr.len flag
+
+// Format of a newly created data file; an existing one keeps its own
+enum log_format {
+    LOG_RAW,
+    LOG_CHECKSUMMED,
+    LOG_DEDUPLICATED,
+};
+
+// Header in front of every record of a checksummed data file
+struct record_hdr {
+    uint32_t len;              // Record bytes that follow the header
+    uint32_t crc;              // CRC32C of len, seq and the record
+    uint64_t seq;              // Position of the record in the file, from 1
+};
+
+// Body of a reference record (len RECORD_REF | sizeof(struct record_ref))
+struct record_ref {
+    uint64_t offset;           // File offset of the header of the body's first copy
+    uint32_t len;              // Record bytes it stands for
+    uint32_t unused;
+};
+
+// A body stored in a deduplicated file, by hash
+struct dedupe_entry {
+    uint64_t hash;             // XXH64 of the body, 0: empty slot
+    off_t offset;              // File offset of its record header
+    off_t payload;             // Record bytes in the file before it
+    uint32_t len;
+};
+
+// One offset index entry: where a record starts
+struct log_index_entry {
+    off_t offset;              // File offset of the record header
+    off_t payload;             // Record bytes in the file before this record
+};
+
+struct datalog {
+    pthread_mutex_t lock;      // Serializes appends so records never interleave
+    pthread_cond_t grown;      // Broadcast after every append, paired with lock
+    int fd;
+    const char *path;
+    off_t size;                // Bytes committed so far
+    bool checksummed;          // Records are stored behind a struct record_hdr
+    bool deduplicated;         // ...and repeated bodies as references
+    uint64_t seq;              // Records in the file (checksummed only)
+    off_t payload;             // Record bytes in the file, i.e. size minus headers
+    struct shmlog *shared;     // Cross-process index in pre-fork mode, else NULL
+    uint32_t worker;           // Tags shared index entries, 0 outside pre-fork mode
+
+    // Sparse offset index (checksummed only), guarded by index_lock
+    pthread_mutex_t index_lock;
+    struct log_index_entry *index;
+    size_t index_len;
+    size_t index_cap;
+    off_t index_next;          // Payload offset that earns the next entry
+
+    // Replay cache: record bytes [0, cached) in LOG_CACHE_CHUNK pieces.
+    // Appended to under lock; replays read it without locking, and chains
+    // hold on to its chunks even past datalog_close().
+    struct buf_chunk **cache;
+    size_t cache_chunks;       // Capacity, in chunks
+    _Atomic off_t cached;
+
+    // Bodies stored so far (deduplicated only), guarded by the append lock:
+    // an open-addressing table with linear probing, at most half full
+    struct dedupe_entry *dedupe;
+    size_t dedupe_mask;        // Slots - 1
+    size_t dedupe_count;
+    atomic_ulong dedupe_refs;          // Records appended as references
+    atomic_ulong dedupe_saved;         // Bytes they did not write
+    atomic_ulong dedupe_hashed;        // Bytes hashed
+    atomic_ulong dedupe_hash_ns;       // ...and the time it took
+
+    // Replay statistics
+    atomic_ulong replays;
+    atomic_ulong replay_copies;        // Copies made in memory on the way out
+    atomic_ulong replay_copied;        // Bytes copied
+    atomic_ulong replay_sends;         // sendmsg() calls
+    atomic_ulong replay_zc_sends;      // ...of which with MSG_ZEROCOPY
+    atomic_ulong replay_zc_copied;     // Zerocopy sends the kernel copied anyway
+    atomic_ulong replay_zc_fallbacks;  // Connections that gave up on zerocopy
+
+    // Recovery: scan_threads may be set beforehand to override the number
+    // of CPUs; datalog_open() reports the threads it used and its duration
+    uint64_t open_ms;
+    unsigned scan_threads;
+};
+
+#define DATALOG_INITIALIZER { .lock = PTHREAD_MUTEX_INITIALIZER, \
+                              .grown = PTHREAD_COND_INITIALIZER, .fd = -1, \
+                              .index_lock = PTHREAD_MUTEX_INITIALIZER }
+
+/**
+ * Opens (creating if needed) the data file at path for appending and
+ * reading. A new file is created in the given format; an existing one keeps
+ * its format and is recovered, and a deduplicated one has its bodies hashed
+ * again. Up to cache_bytes of records are kept in memory for replays.
+ * Returns 0 on success, -1 on failure.
+ */
+int datalog_open(struct datalog *log, const char *path, enum log_format format,
+                 size_t cache_bytes);
+
+/**
+ * Appends one complete packet, behind a checksummed header if the file uses
+ * them, or as a reference if a deduplicated file holds its body already.
+ * Returns the replay length for this packet, i.e. how many record bytes the
+ * file holds up to and including it, or -1 on failure.
+ */
+off_t datalog_append(struct datalog *log, const char *buf, size_t len);
+
+/**
+ * Appends one complete packet whose first staged bytes were streamed to the
+ * file fd (see aesdsocket's spilling) and whose remaining len bytes are at
+ * buf, as a single record. It becomes visible to replays all at once, like
+ * any other append. Checksummed files only take records below 4 GiB,
+ * deduplicated ones below 2 GiB, and never deduplicate staged records.
+ * Returns the replay length for this packet, or -1 on failure.
+ */
+off_t datalog_append_staged(struct datalog *log, int fd, off_t staged, const char *buf,
+                            size_t len);
+
+/**
+ * Sends the first len record bytes of the file to clientfd, preceded by
+ * hdrlen bytes of protocol header. The file only ever grows, so this needs
+ * no lock. Cached bytes go out by reference with the header, the rest in
+ * sends of up to BUFCHAIN_CHUNK bytes, all through chain, which belongs to
+ * the connection and keeps its own chunk and zerocopy setting from one
+ * replay to the next. The chain is left empty.
+ * Returns 0 on success, -1 if reading the file or sending failed.
+ */
+int datalog_replay(struct datalog *log, struct bufchain *chain, int clientfd, off_t len,
+                   const char *hdrbuf, size_t hdrlen);
+
+/**
+ * Like datalog_replay(), but for framed connections (see framing.h): sends
+ * the number of records in the first len record bytes as a varint, then
+ * every record as its varint length followed by its bytes. Only checksummed
+ * and deduplicated files keep record lengths; a raw one fails.
+ * Returns 0 on success, -1 if reading the file or sending failed.
+ */
+int datalog_replay_framed(struct datalog *log, struct bufchain *chain, int clientfd, off_t len);
+
+/**
+ * Returns how many record bytes the file holds, i.e. the replay length of
+ * its latest packet.
+ */
+off_t datalog_length(struct datalog *log);
+
+/**
+ * Appends len record bytes, starting at record offset from, to chain:
+ * cached bytes by reference, the rest read from the file. Like replays,
+ * this needs no lock for bytes already committed.
+ * Returns 0 on success, -1 if reading the file failed.
+ */
+int datalog_chain(struct datalog *log, off_t from, off_t len, struct bufchain *chain);
+
+/**
+ * Flushes the file to stable storage, closes it and frees the index and
+ * cache.
+ */
+void datalog_close(struct datalog *log);
+
+#endif
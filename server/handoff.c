@@ -0,0 +1,137 @@
+/**
+ * handoff.c
+ *
+ * Control-socket and SCM_RIGHTS helpers for handing a running aesdsocket's
+ * sockets to its replacement. See handoff.h for the message exchange.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_addr(path, &addr) < 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_addr(path, &addr) < 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_send(int sock, const struct handoff_msg *msg, const void *payload,
+                 const int *fds, int nfds) {
+    struct iovec iov[2] = {
+        { .iov_base = (void *)msg, .iov_len = sizeof(*msg) },
+        { .iov_base = (void *)payload, .iov_len = payload ? msg->len : 0 },
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr mh = {
+        .msg_iov = iov,
+        .msg_iovlen = payload ? 2 : 1,
+    };
+
+    if (nfds > HANDOFF_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nfds > 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        mh.msg_control = ctl.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n < 0 ? -1 : 0;
+}
+
+ssize_t handoff_recv(int sock, struct handoff_msg *msg, void *payload, size_t paylen,
+                     int *fds, int *nfds) {
+    struct iovec iov[2] = {
+        { .iov_base = msg, .iov_len = sizeof(*msg) },
+        { .iov_base = payload, .iov_len = paylen },
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr mh = {
+        .msg_iov = iov,
+        .msg_iovlen = payload ? 2 : 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    int capacity = nfds ? *nfds : 0;
+
+    if (nfds) *nfds = 0;
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < (ssize_t)sizeof(*msg)) return -1;
+
+    // Collect the descriptors, closing any we have no room for
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *in = (int *)CMSG_DATA(cm);
+        for (int i = 0; i < count; ++i) {
+            if (nfds && *nfds < capacity) fds[(*nfds)++] = in[i];
+            else close(in[i]);
+        }
+    }
+
+    if (msg->magic != HANDOFF_MAGIC || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        errno = EPROTO;
+        return -1;
+    }
+    return n - sizeof(*msg);
+}
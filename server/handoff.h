@@ -0,0 +1,85 @@
+/**
+ * handoff.h
+ *
+ * Unix-socket protocol used to hand a running aesdsocket's listening socket,
+ * and optionally its live client connections, to a newly started binary.
+ * Descriptors travel as SCM_RIGHTS ancillary data on a SOCK_SEQPACKET
+ * socket, so every message arrives whole.
+ *
+ * Exchange, initiated by the new process:
+ *   new -> old  HANDOFF_REQUEST  (flags: HANDOFF_WANT_CLIENTS)
+ *   old -> new  HANDOFF_STATE    listener fds, client count, log size
+ *   old -> new  HANDOFF_CLIENT   one per client: its fd, peer address,
+ *               framing and channel name, followed by HANDOFF_DATA chunks of
+ *               its partial packet. A packet that started in a staging file
+ *               brings that file's fd along; the chunks continue it
+ *   new -> old  HANDOFF_ACK      the old process may now exit
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define HANDOFF_MAGIC 0x41455344u        // "AESD"
+#define HANDOFF_MAX_FDS 16               // Descriptors per message
+#define HANDOFF_CHUNK 65536              // Payload bytes per HANDOFF_DATA message
+
+#define HANDOFF_WANT_CLIENTS 0x1          // REQUEST flags
+#define HANDOFF_CLIENT_NEWLINE 0x2        // CLIENT flags: framing already negotiated,
+#define HANDOFF_CLIENT_FRAMED 0x4         // one of these three is set
+#define HANDOFF_CLIENT_BATCH 0x8
+
+enum handoff_type {
+    HANDOFF_REQUEST = 1,
+    HANDOFF_STATE,
+    HANDOFF_CLIENT,
+    HANDOFF_DATA,
+    HANDOFF_ACK,
+};
+
+// Fixed header at the start of every message
+struct handoff_msg {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t count;                      // STATE: clients that follow,
+                                         // CLIENT: packets acknowledged in batch mode
+    uint64_t value;                      // STATE: log size, CLIENT: partial packet length
+    uint32_t len;                        // Payload bytes after the header:
+                                         // DATA: partial packet, CLIENT: channel name
+    uint32_t reserved;
+    struct sockaddr_storage addr;        // CLIENT: peer address
+};
+
+/**
+ * Creates the control socket at path, replacing any stale one.
+ * Returns the listening descriptor, or -1 on failure.
+ */
+int handoff_listen(const char *path);
+
+/**
+ * Connects to the control socket of a running server at path.
+ * Returns the connected descriptor, or -1 on failure.
+ */
+int handoff_connect(const char *path);
+
+/**
+ * Sends one message: msg, optionally followed by len payload bytes, with nfds
+ * descriptors attached. Returns 0 on success, -1 on failure.
+ */
+int handoff_send(int sock, const struct handoff_msg *msg, const void *payload,
+                 const int *fds, int nfds);
+
+/**
+ * Receives one message into msg and up to paylen payload bytes. On entry
+ * *nfds is the capacity of fds; on return it holds the number received.
+ * Returns the payload length on success, -1 on failure or a malformed message.
+ */
+ssize_t handoff_recv(int sock, struct handoff_msg *msg, void *payload, size_t paylen,
+                     int *fds, int *nfds);
+
+#endif
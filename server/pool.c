@@ -0,0 +1,109 @@
+/**
+ * pool.c
+ *
+ * Recycling allocator for connection state and receive buffers. See pool.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+#define BUF_CLASS(shift) POOL_INITIALIZER(1ul << (shift), POOL_CLASS_BYTES >> (shift))
+
+static struct pool buf_classes[POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1] = {
+    BUF_CLASS(10), BUF_CLASS(11), BUF_CLASS(12), BUF_CLASS(13), BUF_CLASS(14), BUF_CLASS(15),
+    BUF_CLASS(16), BUF_CLASS(17), BUF_CLASS(18), BUF_CLASS(19), BUF_CLASS(20),
+};
+
+void *pool_get(struct pool *p) {
+    atomic_fetch_add_explicit(&p->gets, 1, memory_order_relaxed);
+    pthread_mutex_lock(&p->lock);
+    void *obj = p->free;
+    if (obj) {
+        memcpy(&p->free, obj, sizeof(void *));
+        p->nfree--;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (!obj) return malloc(p->size);
+    atomic_fetch_add_explicit(&p->hits, 1, memory_order_relaxed);
+    return obj;
+}
+
+void pool_put(struct pool *p, void *obj) {
+    if (!obj) return;
+    pthread_mutex_lock(&p->lock);
+    if (p->nfree < p->max_free) {
+        memcpy(obj, &p->free, sizeof(void *));
+        p->free = obj;
+        p->nfree++;
+        obj = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(obj);
+}
+
+void pool_trim(struct pool *p) {
+    pthread_mutex_lock(&p->lock);
+    void *obj = p->free;
+    p->free = NULL;
+    p->nfree = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    while (obj) {
+        void *next;
+        memcpy(&next, obj, sizeof(void *));
+        free(obj);
+        obj = next;
+    }
+}
+
+void pool_stats(struct pool *p, struct pool_stats *st) {
+    st->gets += atomic_load_explicit(&p->gets, memory_order_relaxed);
+    st->hits += atomic_load_explicit(&p->hits, memory_order_relaxed);
+    pthread_mutex_lock(&p->lock);
+    st->resident += p->nfree * p->size;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * buf_class
+ * ---------
+ * Returns the buffer class of exactly size bytes, or NULL if there is none.
+ */
+static struct pool *buf_class(size_t size) {
+    if (size < POOL_MIN_BUF || size > POOL_MAX_BUF || (size & (size - 1)) != 0) return NULL;
+    return &buf_classes[__builtin_ctzl(size) - POOL_MIN_SHIFT];
+}
+
+void *pool_buf_get(size_t size) {
+    struct pool *p = buf_class(size);
+    return p ? pool_get(p) : malloc(size);
+}
+
+void pool_buf_put(void *buf, size_t size) {
+    struct pool *p = buf_class(size);
+    if (p) pool_put(p, buf);
+    else free(buf);
+}
+
+void *pool_buf_resize(void *buf, size_t size, size_t used, size_t newsize) {
+    // Past the largest class, realloc may still grow in place
+    if (!buf_class(size) && !buf_class(newsize)) return realloc(buf, newsize);
+
+    void *newbuf = pool_buf_get(newsize);
+    if (!newbuf) return NULL;
+    memcpy(newbuf, buf, used < newsize ? used : newsize);
+    pool_buf_put(buf, size);
+    return newbuf;
+}
+
+void pool_buf_trim(void) {
+    for (size_t i = 0; i < sizeof(buf_classes) / sizeof(buf_classes[0]); ++i)
+        pool_trim(&buf_classes[i]);
+}
+
+void pool_buf_stats(struct pool_stats *st) {
+    for (size_t i = 0; i < sizeof(buf_classes) / sizeof(buf_classes[0]); ++i)
+        pool_stats(&buf_classes[i], st);
+}
@@ -0,0 +1,98 @@
+/**
+ * pool.h
+ *
+ * Recycling allocator for connection state and receive buffers. Objects
+ * released when a connection closes go on a free list instead of back to
+ * malloc, so connection churn keeps reusing the same memory rather than
+ * fragmenting the heap and contending on the allocator's locks.
+ * Buffers come in power-of-two size classes from POOL_MIN_BUF to
+ * POOL_MAX_BUF, each with its own free list; any other size is passed
+ * straight to malloc. Each free list keeps a bounded amount of memory, and
+ * everything beyond it is freed.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define POOL_MIN_SHIFT 10                 // Smallest buffer class, 1 KiB
+#define POOL_MAX_SHIFT 20                 // Largest buffer class, 1 MiB
+#define POOL_MIN_BUF (1ul << POOL_MIN_SHIFT)
+#define POOL_MAX_BUF (1ul << POOL_MAX_SHIFT)
+#define POOL_CLASS_BYTES (4ul << 20)      // Free memory each buffer class keeps at most
+
+// Free list of objects of one size
+struct pool {
+    size_t size;               // Object size
+    size_t max_free;           // Objects kept on the free list at most
+    pthread_mutex_t lock;      // Guards free and nfree
+    void *free;                // Linked through the first word of each object
+    size_t nfree;
+    atomic_ulong gets;
+    atomic_ulong hits;         // Gets served from the free list
+};
+
+#define POOL_INITIALIZER(sz, max) \
+    { .size = (sz), .max_free = (max), .lock = PTHREAD_MUTEX_INITIALIZER }
+
+// Counters of one or more pools, see pool_stats()
+struct pool_stats {
+    unsigned long gets;
+    unsigned long hits;
+    size_t resident;           // Bytes held on free lists
+};
+
+/**
+ * Returns an object of p->size bytes, recycled if possible, or NULL if
+ * memory is exhausted. Like malloc, its contents are undefined.
+ */
+void *pool_get(struct pool *p);
+
+/**
+ * Returns obj, which came from pool_get(p), to the free list, or frees it
+ * if the list is full.
+ */
+void pool_put(struct pool *p, void *obj);
+
+/**
+ * Frees every object on p's free list.
+ */
+void pool_trim(struct pool *p);
+
+/**
+ * Adds p's counters to st.
+ */
+void pool_stats(struct pool *p, struct pool_stats *st);
+
+/**
+ * Returns a buffer of size bytes, or NULL if memory is exhausted.
+ */
+void *pool_buf_get(size_t size);
+
+/**
+ * Releases buf, which came from pool_buf_get() or pool_buf_resize() with
+ * the same size.
+ */
+void pool_buf_put(void *buf, size_t size);
+
+/**
+ * Moves the first used bytes of buf, of size bytes, to a buffer of newsize
+ * bytes, like realloc. On failure buf is left untouched.
+ * Returns the new buffer, or NULL if memory is exhausted.
+ */
+void *pool_buf_resize(void *buf, size_t size, size_t used, size_t newsize);
+
+/**
+ * Frees every buffer on the free lists.
+ */
+void pool_buf_trim(void);
+
+/**
+ * Adds the counters of all buffer classes to st.
+ */
+void pool_buf_stats(struct pool_stats *st);
+
+#endif
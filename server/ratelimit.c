@@ -0,0 +1,200 @@
+/**
+ * ratelimit.c
+ *
+ * Per-address token buckets. See ratelimit.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+
+int ratelimit_init(struct ratelimit *rl, double conn_rate, double byte_rate,
+                   size_t max_entries) {
+    memset(rl, 0, sizeof(*rl));
+    if (max_entries == 0 || max_entries > (1u << 30)) return -1;
+    size_t slots = 2;
+    while (slots < 2 * max_entries) slots *= 2;
+    rl->slots = calloc(slots, sizeof(*rl->slots));
+    if (!rl->slots) return -1;
+    rl->mask = slots - 1;
+    rl->max_entries = max_entries;
+    rl->conn_rate = conn_rate;
+    rl->byte_rate = byte_rate;
+    rl->lru_head = rl->lru_tail = RATELIMIT_NONE;
+    pthread_mutex_init(&rl->lock, NULL);
+    return 0;
+}
+
+void ratelimit_free(struct ratelimit *rl) {
+    if (!rl->slots) return;
+    free(rl->slots);
+    rl->slots = NULL;
+    pthread_mutex_destroy(&rl->lock);
+}
+
+/**
+ * address_key
+ * -----------
+ * Fills key with the IPv6 form of addr.
+ *
+ * Returns:
+ *   Its hash, never 0, or 0 if addr is no IP address.
+ */
+static uint32_t address_key(const struct sockaddr_storage *addr, uint8_t key[16]) {
+    if (addr->ss_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    } else if (addr->ss_family == AF_INET) {
+        static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+        memcpy(key, mapped, sizeof(mapped));
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    } else {
+        return 0;
+    }
+
+    uint64_t hi, lo;
+    memcpy(&hi, key, 8);
+    memcpy(&lo, key + 8, 8);
+    uint64_t h = (hi * 0x9e3779b97f4a7c15ull) ^ lo;
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ull;
+    h ^= h >> 32;
+    return (uint32_t)h ? (uint32_t)h : 1;
+}
+
+// A connection bucket holds a second's worth, and at least one connection
+static inline double conn_burst(const struct ratelimit *rl) {
+    return rl->conn_rate < 1.0 ? 1.0 : rl->conn_rate;
+}
+
+static void lru_unlink(struct ratelimit *rl, uint32_t i) {
+    struct rl_entry *e = &rl->slots[i];
+    if (e->lru_prev != RATELIMIT_NONE) rl->slots[e->lru_prev].lru_next = e->lru_next;
+    else rl->lru_head = e->lru_next;
+    if (e->lru_next != RATELIMIT_NONE) rl->slots[e->lru_next].lru_prev = e->lru_prev;
+    else rl->lru_tail = e->lru_prev;
+}
+
+static void lru_push(struct ratelimit *rl, uint32_t i) {
+    struct rl_entry *e = &rl->slots[i];
+    e->lru_prev = RATELIMIT_NONE;
+    e->lru_next = rl->lru_head;
+    if (rl->lru_head != RATELIMIT_NONE) rl->slots[rl->lru_head].lru_prev = i;
+    else rl->lru_tail = i;
+    rl->lru_head = i;
+}
+
+/**
+ * erase
+ * -----
+ * Removes the entry in slot i. Later entries of its probe run move back
+ * into the gap where their home slot allows, so lookups never need
+ * tombstones; their LRU neighbours follow them to the new slot.
+ */
+static void erase(struct ratelimit *rl, uint32_t i) {
+    lru_unlink(rl, i);
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & rl->mask;
+        struct rl_entry *e = &rl->slots[j];
+        if (!e->hash) break;
+        // The gap at i lies on e's probe path from its home slot to j
+        uint32_t home = e->hash & rl->mask;
+        if (((j - home) & rl->mask) < ((j - i) & rl->mask)) continue;
+
+        rl->slots[i] = *e;
+        if (e->lru_prev != RATELIMIT_NONE) rl->slots[e->lru_prev].lru_next = i;
+        else rl->lru_head = i;
+        if (e->lru_next != RATELIMIT_NONE) rl->slots[e->lru_next].lru_prev = i;
+        else rl->lru_tail = i;
+        i = j;
+    }
+    rl->slots[i].hash = 0;
+    rl->count--;
+    rl->evictions++;
+}
+
+/**
+ * lookup
+ * ------
+ * Finds the entry of key, or adds one with full buckets (evicting the
+ * least recently seen address if the table is full), refills its buckets
+ * up to now and marks it most recently seen. Called with the lock held.
+ *
+ * Returns:
+ *   The entry.
+ */
+static struct rl_entry *lookup(struct ratelimit *rl, const uint8_t key[16], uint32_t hash,
+                               uint64_t now_ms) {
+    uint32_t i = hash & rl->mask;
+    for (; rl->slots[i].hash; i = (i + 1) & rl->mask) {
+        struct rl_entry *e = &rl->slots[i];
+        if (e->hash != hash || memcmp(e->addr, key, 16) != 0) continue;
+
+        double secs = now_ms > e->stamp_ms ? (now_ms - e->stamp_ms) / 1000.0 : 0.0;
+        e->stamp_ms = now_ms;
+        e->conn_tokens += secs * rl->conn_rate;
+        if (e->conn_tokens > conn_burst(rl)) e->conn_tokens = conn_burst(rl);
+        e->byte_tokens += secs * rl->byte_rate;
+        if (e->byte_tokens > rl->byte_rate) e->byte_tokens = rl->byte_rate;
+        if (e->lru_secs != (uint32_t)(now_ms / 1000) && rl->lru_head != i) {
+            lru_unlink(rl, i);
+            lru_push(rl, i);
+            e->lru_secs = now_ms / 1000;
+        }
+        return e;
+    }
+
+    if (rl->count == rl->max_entries) {
+        // Eviction can shift this key's probe run; look for a free slot again
+        erase(rl, rl->lru_tail);
+        for (i = hash & rl->mask; rl->slots[i].hash; i = (i + 1) & rl->mask)
+            ;
+    }
+    struct rl_entry *e = &rl->slots[i];
+    memcpy(e->addr, key, 16);
+    e->hash = hash;
+    e->stamp_ms = now_ms;
+    e->conn_tokens = conn_burst(rl);
+    e->byte_tokens = rl->byte_rate;
+    e->lru_secs = now_ms / 1000;
+    lru_push(rl, i);
+    rl->count++;
+    return e;
+}
+
+bool ratelimit_connect(struct ratelimit *rl, const struct sockaddr_storage *addr,
+                       uint64_t now_ms) {
+    uint8_t key[16];
+    uint32_t hash = address_key(addr, key);
+    if (!hash || rl->conn_rate <= 0) return true;
+
+    pthread_mutex_lock(&rl->lock);
+    struct rl_entry *e = lookup(rl, key, hash, now_ms);
+    bool ok = e->conn_tokens >= 1.0;
+    if (ok) e->conn_tokens -= 1.0;
+    pthread_mutex_unlock(&rl->lock);
+    return ok;
+}
+
+uint64_t ratelimit_bytes(struct ratelimit *rl, const struct sockaddr_storage *addr,
+                         size_t len, uint64_t now_ms) {
+    uint8_t key[16];
+    uint32_t hash = address_key(addr, key);
+    if (!hash || rl->byte_rate <= 0) return 0;
+
+    pthread_mutex_lock(&rl->lock);
+    struct rl_entry *e = lookup(rl, key, hash, now_ms);
+    e->byte_tokens -= len;
+    double debt = -e->byte_tokens;
+    pthread_mutex_unlock(&rl->lock);
+    return debt > 0 ? (uint64_t)(debt * 1000.0 / rl->byte_rate) + 1 : 0;
+}
+
+size_t ratelimit_stats(struct ratelimit *rl, unsigned long *evictions) {
+    pthread_mutex_lock(&rl->lock);
+    size_t count = rl->count;
+    *evictions = rl->evictions;
+    pthread_mutex_unlock(&rl->lock);
+    return count;
+}
@@ -0,0 +1,88 @@
+/**
+ * ratelimit.h
+ *
+ * Per-address admission control: every client IP address gets a token
+ * bucket for connections per second and one for bytes per second, each
+ * holding up to one second's worth (and at least one connection). The
+ * buckets live in an open-addressing hash table with linear probing, sized
+ * to stay at most half full, so a lookup touches a couple of adjacent
+ * slots however many addresses are tracked. Once the table holds its
+ * maximum, the least recently seen address is evicted; it starts over with
+ * full buckets when it returns. An address moves to the front of the LRU
+ * list at most once a second, so a busy client costs one cache line per
+ * lookup rather than the three of its list neighbours as well.
+ *
+ * Addresses are keyed as IPv6, IPv4 ones mapped (::ffff:a.b.c.d), so a
+ * client counts the same over either socket family. Unix domain peers have
+ * no address and are never limited. The table is per process.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define RATELIMIT_NONE UINT32_MAX         // No slot, ends the LRU list
+
+// One tracked address
+struct rl_entry {
+    uint8_t addr[16];
+    uint32_t hash;                        // 0: empty slot
+    uint32_t lru_prev;                    // Slot seen more recently, or RATELIMIT_NONE
+    uint32_t lru_next;                    // Slot seen less recently, or RATELIMIT_NONE
+    uint32_t lru_secs;                    // When it last moved to the front, in seconds
+    uint64_t stamp_ms;                    // When the buckets were last refilled
+    double conn_tokens;
+    double byte_tokens;
+};
+
+struct ratelimit {
+    double conn_rate;                     // Connections per second, 0: unlimited
+    double byte_rate;                     // Bytes per second, 0: unlimited
+    size_t max_entries;
+    size_t mask;                          // Slots - 1, a power of two minus one
+    size_t count;
+    struct rl_entry *slots;
+    uint32_t lru_head, lru_tail;          // Most and least recently seen
+    unsigned long evictions;
+    pthread_mutex_t lock;                 // Guards all of the above but the rates
+};
+
+/**
+ * Sets rl up to track up to max_entries addresses at the given rates.
+ * Returns 0 on success, -1 if memory is exhausted.
+ */
+int ratelimit_init(struct ratelimit *rl, double conn_rate, double byte_rate,
+                   size_t max_entries);
+
+/**
+ * Frees the table.
+ */
+void ratelimit_free(struct ratelimit *rl);
+
+/**
+ * Takes a connection token for the address of a new connection.
+ * Returns false if it has none left and the connection should be refused.
+ */
+bool ratelimit_connect(struct ratelimit *rl, const struct sockaddr_storage *addr,
+                       uint64_t now_ms);
+
+/**
+ * Charges len bytes received from addr, letting the bucket go into debt.
+ * Returns how many milliseconds the caller should wait before receiving
+ * from it again, 0 if none.
+ */
+uint64_t ratelimit_bytes(struct ratelimit *rl, const struct sockaddr_storage *addr,
+                         size_t len, uint64_t now_ms);
+
+/**
+ * Returns the number of addresses tracked and, in *evictions, how many
+ * were evicted so far.
+ */
+size_t ratelimit_stats(struct ratelimit *rl, unsigned long *evictions);
+
+#endif
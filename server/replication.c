@@ -0,0 +1,660 @@
+/**
+ * replication.c
+ *
+ * Log shipping between a primary and its followers. See replication.h for
+ * the exchange.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "replication.h"
+
+// One connected follower, served by its own sender thread on the primary
+struct repl_follower_conn {
+    int fd;                    // Closed by the thread under the primary's lock
+    pthread_t thread;
+    struct repl_primary *primary;
+    char name[64];
+    bool done;                 // Thread finished, ready to be joined
+    struct repl_stats stats;
+
+    // Batches sent but not yet acknowledged: where they end and how old
+    // their oldest record is
+    uint64_t inflight_end[REPL_WINDOW];
+    uint64_t inflight_ms[REPL_WINDOW];
+    unsigned inflight_head;
+    unsigned inflight_count;
+    struct repl_ack ack;       // Acknowledgement being received
+    size_t ack_have;
+};
+
+/**
+ * realtime_ms
+ * -----------
+ * Returns the wall clock in milliseconds, comparable across processes.
+ */
+static uint64_t realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * is_unix_endpoint
+ * ----------------
+ * Returns true if the endpoint names a Unix socket rather than a TCP port.
+ */
+static bool is_unix_endpoint(const char *endpoint) {
+    return strchr(endpoint, '/') != NULL;
+}
+
+/**
+ * unix_addr
+ * ---------
+ * Fills addr with the Unix socket path.
+ *
+ * Returns:
+ *   0 on success, -1 if the path is too long.
+ */
+static int unix_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * tcp_addrs
+ * ---------
+ * Resolves a TCP [host:]port endpoint; without a host, to every interface
+ * when passive and to localhost otherwise.
+ *
+ * Returns:
+ *   0 on success, -1 on failure.
+ */
+static int tcp_addrs(const char *endpoint, bool passive, struct addrinfo **res) {
+    char host[256];
+    const char *port = endpoint;
+    const char *colon = strrchr(endpoint, ':');
+    const char *node = passive ? NULL : "localhost";
+    if (colon) {
+        size_t len = colon - endpoint;
+        if (len >= sizeof(host)) return -1;
+        memcpy(host, endpoint, len);
+        host[len] = '\0';
+        // Accept bracketed IPv6 literals, "[::1]:9100"
+        if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+            memmove(host, host + 1, len - 2);
+            host[len - 2] = '\0';
+        }
+        node = host;
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    if (passive) hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(node, port, &hints, res) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * set_nodelay
+ * -----------
+ * Acknowledgements are small and must not wait for Nagle's algorithm.
+ */
+static void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/**
+ * repl_listen
+ * -----------
+ * Opens the listening socket for followers at endpoint.
+ *
+ * Returns:
+ *   Socket descriptor on success, -1 on failure.
+ */
+static int repl_listen(const char *endpoint) {
+    if (is_unix_endpoint(endpoint)) {
+        struct sockaddr_un addr;
+        if (unix_addr(endpoint, &addr) < 0) return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        unlink(endpoint);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            chmod(endpoint, 0666) < 0 || listen(fd, REPL_MAX_FOLLOWERS) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo *res;
+    if (tcp_addrs(endpoint, true, &res) < 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+            listen(fd, REPL_MAX_FOLLOWERS) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**
+ * repl_connect
+ * ------------
+ * Connects to the primary at endpoint.
+ *
+ * Returns:
+ *   Socket descriptor on success, -1 on failure.
+ */
+static int repl_connect(const char *endpoint) {
+    if (is_unix_endpoint(endpoint)) {
+        struct sockaddr_un addr;
+        if (unix_addr(endpoint, &addr) < 0) return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo *res;
+    if (tcp_addrs(endpoint, false, &res) < 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) set_nodelay(fd);
+    return fd;
+}
+
+/**
+ * send_all
+ * --------
+ * Sends the iovecs in full, retrying short and interrupted sends.
+ *
+ * Returns:
+ *   0 on success, -1 on failure.
+ */
+static int send_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * recv_all
+ * --------
+ * Receives exactly len bytes.
+ *
+ * Returns:
+ *   0 on success, -1 on failure or end of stream.
+ */
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * note_lag
+ * --------
+ * Records one lag measurement.
+ */
+static void note_lag(struct repl_stats *s, int64_t lag_bytes, uint64_t lag_ms) {
+    s->lag_bytes = lag_bytes;
+    s->lag_ms = lag_ms;
+    if (lag_bytes > s->max_lag_bytes) s->max_lag_bytes = lag_bytes;
+    if (lag_ms > s->max_lag_ms) s->max_lag_ms = lag_ms;
+}
+
+/**
+ * read_acks
+ * ---------
+ * Consumes the follower's acknowledgements, measuring the lag of every batch
+ * they cover. Blocks only while the window of unacknowledged batches is full.
+ *
+ * Returns:
+ *   0 on success, -1 if the follower went away or misbehaved.
+ */
+static int read_acks(struct repl_follower_conn *fc, uint64_t primary_len) {
+    while (fc->inflight_count > 0) {
+        int flags = fc->inflight_count == REPL_WINDOW ? 0 : MSG_DONTWAIT;
+        ssize_t n = recv(fc->fd, (char *)&fc->ack + fc->ack_have,
+                         sizeof(fc->ack) - fc->ack_have, flags);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        fc->ack_have += n;
+        if (fc->ack_have < sizeof(fc->ack)) continue;
+        fc->ack_have = 0;
+        if (fc->ack.magic != REPL_MAGIC) return -1;
+
+        uint64_t now = realtime_ms();
+        while (fc->inflight_count > 0 &&
+               fc->inflight_end[fc->inflight_head] <= fc->ack.applied) {
+            uint64_t sent = fc->inflight_ms[fc->inflight_head];
+            note_lag(&fc->stats, (int64_t)(primary_len - fc->ack.applied),
+                     now > sent ? now - sent : 0);
+            fc->inflight_head = (fc->inflight_head + 1) % REPL_WINDOW;
+            fc->inflight_count--;
+        }
+    }
+    return 0;
+}
+
+/**
+ * wait_for_records
+ * ----------------
+ * Waits until the log holds more than sent record bytes, the heartbeat
+ * interval passes or the primary stops.
+ *
+ * Returns:
+ *   The record bytes in the log; *waited tells whether it had to wait.
+ */
+static off_t wait_for_records(struct repl_primary *p, off_t sent, bool *waited) {
+    struct datalog *log = p->log;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPL_HEARTBEAT_MS / 1000;
+
+    *waited = false;
+    pthread_mutex_lock(&log->lock);
+    while (log->payload <= sent && !p->stop) {
+        *waited = true;
+        if (pthread_cond_timedwait(&log->grown, &log->lock, &deadline) == ETIMEDOUT) break;
+    }
+    off_t end = log->payload;
+    pthread_mutex_unlock(&log->lock);
+    return end;
+}
+
+/**
+ * serve_follower
+ * --------------
+ * Sender thread for one follower: streams every record committed past the
+ * follower's position, batching whatever accumulated while the previous
+ * batch was on its way. Batches are chains into the log's replay cache, so
+ * every follower within the cache shares the same bytes instead of copying
+ * them.
+ */
+static void *serve_follower(void *arg) {
+    struct repl_follower_conn *fc = arg;
+    struct repl_primary *p = fc->primary;
+    struct bufchain chain = BUFCHAIN_INITIALIZER;
+
+    struct repl_hello hello;
+    struct timeval tv = { .tv_sec = 10 };
+    setsockopt(fc->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv_all(fc->fd, &hello, sizeof(hello)) < 0 || hello.magic != REPL_MAGIC) {
+        syslog(LOG_ERR, "Bad replication request from %s", fc->name);
+        goto done;
+    }
+    tv.tv_sec = 0;
+    setsockopt(fc->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    off_t sent = hello.from;
+    if (sent > datalog_length(p->log)) {
+        syslog(LOG_ERR, "Follower %s holds %llu bytes, more than this primary, refusing",
+               fc->name, (unsigned long long)hello.from);
+        goto done;
+    }
+    syslog(LOG_INFO, "Follower %s connected at %llu bytes", fc->name,
+           (unsigned long long)hello.from);
+
+    // Records committed after covered_ms are the ones not yet shipped
+    uint64_t covered_ms = realtime_ms();
+    while (!p->stop) {
+        bool waited;
+        off_t end = wait_for_records(p, sent, &waited);
+        if (p->stop) break;
+
+        uint64_t now = realtime_ms();
+        struct repl_batch b = { .magic = REPL_MAGIC, .start = sent, .primary = end };
+        b.oldest_ms = waited ? now : covered_ms;
+        b.len = end - sent < REPL_BATCH_MAX ? end - sent : REPL_BATCH_MAX;
+        if (sent + (off_t)b.len == end) covered_ms = now;
+        bufchain_clear(&chain);
+        if (bufchain_borrow(&chain, &b, sizeof(b)) < 0 ||
+            datalog_chain(p->log, sent, b.len, &chain) < 0)
+            break;
+        if (bufchain_send(&chain, fc->fd) < 0) break;
+        if (b.len > 0) {
+            unsigned slot = (fc->inflight_head + fc->inflight_count) % REPL_WINDOW;
+            fc->inflight_end[slot] = sent + b.len;
+            fc->inflight_ms[slot] = b.oldest_ms;
+            fc->inflight_count++;
+            fc->stats.batches++;
+            fc->stats.bytes += b.len;
+            sent += b.len;
+        }
+        if (read_acks(fc, end) < 0) break;
+    }
+
+    syslog(LOG_INFO, "Follower %s left after %llu bytes in %llu batches, "
+           "lag %lld bytes / %llu ms (max %lld bytes / %llu ms)", fc->name,
+           (unsigned long long)fc->stats.bytes, (unsigned long long)fc->stats.batches,
+           (long long)fc->stats.lag_bytes, (unsigned long long)fc->stats.lag_ms,
+           (long long)fc->stats.max_lag_bytes, (unsigned long long)fc->stats.max_lag_ms);
+
+done:
+    bufchain_release(&chain);
+    pthread_mutex_lock(&p->lock);
+    close(fc->fd);
+    fc->fd = -1;
+    fc->done = true;
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/**
+ * follower_name
+ * -------------
+ * Writes a printable address of an accepted follower.
+ */
+static void follower_name(const struct sockaddr_storage *addr, char *buf, size_t len) {
+    char host[INET6_ADDRSTRLEN], port[8];
+    if (addr->ss_family == AF_UNIX ||
+        getnameinfo((const struct sockaddr *)addr, sizeof(*addr), host, sizeof(host),
+                    port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        snprintf(buf, len, "local");
+    else
+        snprintf(buf, len, "%s:%s", host, port);
+}
+
+/**
+ * add_follower
+ * ------------
+ * With p->lock held, reaps finished sender threads and starts one for the
+ * accepted follower on fd.
+ */
+static void add_follower(struct repl_primary *p, int fd, const struct sockaddr_storage *addr) {
+    int slot = -1;
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; ++i) {
+        struct repl_follower_conn *fc = p->followers[i];
+        if (fc && fc->done) {
+            pthread_join(fc->thread, NULL);
+            free(fc);
+            p->followers[i] = fc = NULL;
+        }
+        if (!fc && slot < 0) slot = i;
+    }
+
+    struct repl_follower_conn *fc = slot >= 0 ? calloc(1, sizeof(*fc)) : NULL;
+    if (!fc) {
+        syslog(LOG_WARNING, "No room for another follower, refusing it");
+        close(fd);
+        return;
+    }
+    fc->fd = fd;
+    fc->primary = p;
+    follower_name(addr, fc->name, sizeof(fc->name));
+    if (addr->ss_family != AF_UNIX) set_nodelay(fd);
+    if (pthread_create(&fc->thread, NULL, serve_follower, fc) != 0) {
+        syslog(LOG_ERR, "Failed to create follower thread");
+        close(fd);
+        free(fc);
+        return;
+    }
+    p->followers[slot] = fc;
+}
+
+/**
+ * primary_thread
+ * --------------
+ * Accepts followers until the primary stops.
+ */
+static void *primary_thread(void *arg) {
+    struct repl_primary *p = arg;
+    struct pollfd pfd[2] = {
+        { .fd = p->listenfd, .events = POLLIN },
+        { .fd = p->wakefd, .events = POLLIN },
+    };
+
+    while (!p->stop) {
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "poll: %s", strerror(errno));
+            break;
+        }
+        if (p->stop || !(pfd[0].revents & POLLIN)) continue;
+
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept4(p->listenfd, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        pthread_mutex_lock(&p->lock);
+        add_follower(p, fd, &addr);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+int repl_primary_start(struct repl_primary *p, const char *endpoint, struct datalog *log) {
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    p->endpoint = endpoint;
+    p->log = log;
+    p->listenfd = repl_listen(endpoint);
+    if (p->listenfd < 0) return -1;
+    p->wakefd = eventfd(0, EFD_CLOEXEC);
+    if (p->wakefd < 0 || pthread_create(&p->thread, NULL, primary_thread, p) != 0) {
+        if (p->wakefd >= 0) close(p->wakefd);
+        close(p->listenfd);
+        return -1;
+    }
+    syslog(LOG_INFO, "Serving followers on %s", endpoint);
+    return 0;
+}
+
+void repl_primary_stop(struct repl_primary *p) {
+    p->stop = true;
+    uint64_t one = 1;
+    if (write(p->wakefd, &one, sizeof(one)) < 0)
+        syslog(LOG_ERR, "Failed to wake replication thread");
+    pthread_join(p->thread, NULL);
+
+    // Wake senders waiting for records or for the network
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; ++i)
+        if (p->followers[i] && p->followers[i]->fd >= 0)
+            shutdown(p->followers[i]->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_lock(&p->log->lock);
+    pthread_cond_broadcast(&p->log->grown);
+    pthread_mutex_unlock(&p->log->lock);
+
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; ++i) {
+        if (!p->followers[i]) continue;
+        pthread_join(p->followers[i]->thread, NULL);
+        free(p->followers[i]);
+        p->followers[i] = NULL;
+    }
+    close(p->wakefd);
+    close(p->listenfd);
+}
+
+/**
+ * sleep_unless_stopped
+ * --------------------
+ * Sleeps for ms milliseconds, returning early once the follower stops.
+ */
+static void sleep_unless_stopped(struct repl_follower *f, unsigned ms) {
+    for (unsigned slept = 0; slept < ms && !f->stop; slept += 100) {
+        struct timespec ts = { 0, 100 * 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * follow
+ * ------
+ * Applies batches from the primary on fd until the connection ends.
+ */
+static void follow(struct repl_follower *f, int fd, char *buf) {
+    struct repl_hello hello = { .magic = REPL_MAGIC, .from = datalog_length(f->log) };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    if (send_all(fd, &iov, 1) < 0) return;
+    syslog(LOG_INFO, "Following %s from %llu bytes", f->endpoint,
+           (unsigned long long)hello.from);
+
+    uint64_t reported_ms = realtime_ms();
+    struct repl_batch b;
+    while (!f->stop && recv_all(fd, &b, sizeof(b)) == 0) {
+        off_t have = datalog_length(f->log);
+        if (b.magic != REPL_MAGIC || b.len > REPL_BATCH_MAX || b.start != (uint64_t)have) {
+            syslog(LOG_ERR, "Bad batch from primary at %llu bytes, holding %lld",
+                   (unsigned long long)b.start, (long long)have);
+            return;
+        }
+        if (b.len > 0) {
+            if (recv_all(fd, buf, b.len) < 0) return;
+            // The follower's own format applies: a batch becomes one record
+            if ((have = datalog_append(f->log, buf, b.len)) < 0) return;
+        }
+
+        uint64_t now = realtime_ms();
+        pthread_mutex_lock(&f->lock);
+        if (b.len > 0) {
+            f->stats.batches++;
+            f->stats.bytes += b.len;
+            note_lag(&f->stats, (int64_t)(b.primary - have),
+                     now > b.oldest_ms ? now - b.oldest_ms : 0);
+        } else {
+            f->stats.lag_bytes = (int64_t)(b.primary - have);
+        }
+        struct repl_stats s = f->stats;
+        pthread_mutex_unlock(&f->lock);
+
+        if (b.len > 0) {
+            struct repl_ack ack = { .magic = REPL_MAGIC, .applied = have };
+            iov = (struct iovec){ .iov_base = &ack, .iov_len = sizeof(ack) };
+            if (send_all(fd, &iov, 1) < 0) return;
+        }
+        if (now - reported_ms >= REPL_REPORT_MS) {
+            syslog(LOG_INFO, "Replication lag %lld bytes, %llu ms (max %lld bytes / %llu ms)",
+                   (long long)s.lag_bytes, (unsigned long long)s.lag_ms,
+                   (long long)s.max_lag_bytes, (unsigned long long)s.max_lag_ms);
+            reported_ms = now;
+        }
+    }
+}
+
+/**
+ * follower_thread
+ * ---------------
+ * Connects to the primary, follows it, and reconnects whenever the
+ * connection is lost, until the follower stops.
+ */
+static void *follower_thread(void *arg) {
+    struct repl_follower *f = arg;
+    char *buf = malloc(REPL_BATCH_MAX);
+    bool reachable = true;         // Only the first failed attempt is logged
+
+    while (buf && !f->stop) {
+        int fd = repl_connect(f->endpoint);
+        if (fd < 0) {
+            if (reachable)
+                syslog(LOG_WARNING, "Cannot reach primary at %s: %s, retrying",
+                       f->endpoint, strerror(errno));
+            reachable = false;
+            sleep_unless_stopped(f, REPL_RETRY_MS);
+            continue;
+        }
+        reachable = true;
+
+        pthread_mutex_lock(&f->lock);
+        f->fd = fd;
+        pthread_mutex_unlock(&f->lock);
+        if (!f->stop) follow(f, fd, buf);
+        pthread_mutex_lock(&f->lock);
+        close(fd);
+        f->fd = -1;
+        pthread_mutex_unlock(&f->lock);
+
+        if (!f->stop) {
+            syslog(LOG_WARNING, "Lost primary at %s, reconnecting", f->endpoint);
+            sleep_unless_stopped(f, REPL_RETRY_MS);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int repl_follower_start(struct repl_follower *f, const char *endpoint, struct datalog *log) {
+    memset(f, 0, sizeof(*f));
+    pthread_mutex_init(&f->lock, NULL);
+    f->endpoint = endpoint;
+    f->log = log;
+    f->fd = -1;
+    return pthread_create(&f->thread, NULL, follower_thread, f) == 0 ? 0 : -1;
+}
+
+void repl_follower_stop(struct repl_follower *f, struct repl_stats *stats) {
+    f->stop = true;
+    pthread_mutex_lock(&f->lock);
+    if (f->fd >= 0) shutdown(f->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&f->lock);
+    pthread_join(f->thread, NULL);
+    *stats = f->stats;
+}
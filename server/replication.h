@@ -0,0 +1,126 @@
+/**
+ * replication.h
+ *
+ * Log shipping from a primary aesdsocket to read-only followers. The
+ * primary ("-S endpoint") streams the record bytes of its default channel
+ * to every follower connected to endpoint; a follower ("-F endpoint")
+ * appends them to its own data file and serves replays of it, taking the
+ * cost of replaying the full file off the primary.
+ *
+ * An endpoint is a Unix socket path (anything containing a '/') or a TCP
+ * [host:]port; the host defaults to localhost when connecting and to every
+ * interface when listening.
+ *
+ * Exchange, initiated by the follower:
+ *   follower -> primary  struct repl_hello  record bytes it already holds
+ *   primary -> follower  struct repl_batch  followed by len record bytes:
+ *                        everything committed since the previous batch, up
+ *                        to REPL_BATCH_MAX; len 0 is a heartbeat
+ *   follower -> primary  struct repl_ack    after applying each batch
+ *
+ * Lag is measured on both sides. The follower knows how far the primary was
+ * ahead when a batch left it and how old the batch's oldest record was when
+ * it was applied; the primary learns the same from the acknowledgements.
+ * Times are CLOCK_REALTIME milliseconds, so they assume synchronized clocks
+ * across hosts.
+ */
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "datalog.h"
+
+#define REPL_MAGIC 0x41455352u            // "AESR"
+#define REPL_BATCH_MAX (1024 * 1024)      // Record bytes per batch
+#define REPL_WINDOW 16                    // Batches in flight before waiting for an ack
+#define REPL_HEARTBEAT_MS 1000            // Empty batch after this long without data
+#define REPL_MAX_FOLLOWERS 8
+#define REPL_RETRY_MS 1000                // Follower reconnect interval
+#define REPL_REPORT_MS 10000              // Follower lag report interval, to syslog
+
+struct repl_hello {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t from;             // Record bytes the follower holds; the stream starts there
+};
+
+struct repl_batch {
+    uint32_t magic;
+    uint32_t len;              // Record bytes that follow
+    uint64_t start;            // Record offset of the first byte
+    uint64_t primary;          // Record bytes the primary held when sending
+    uint64_t oldest_ms;        // When the first of them was committed, at the latest
+};
+
+struct repl_ack {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t applied;          // Record bytes the follower holds now
+};
+
+// Replication progress as seen from one side
+struct repl_stats {
+    uint64_t batches;
+    uint64_t bytes;
+    int64_t lag_bytes;         // Latest: bytes the follower was behind
+    uint64_t lag_ms;           // Latest: age of the oldest record just applied
+    int64_t max_lag_bytes;
+    uint64_t max_lag_ms;
+};
+
+struct repl_follower_conn;
+
+// Primary side: the listener and one sender thread per follower
+struct repl_primary {
+    const char *endpoint;
+    int listenfd;
+    int wakefd;                // eventfd that stops the accepting thread
+    pthread_t thread;
+    struct datalog *log;
+    atomic_bool stop;
+    pthread_mutex_t lock;      // Guards followers
+    struct repl_follower_conn *followers[REPL_MAX_FOLLOWERS];
+};
+
+// Follower side: one thread connecting (and reconnecting) to the primary
+struct repl_follower {
+    const char *endpoint;
+    int fd;
+    pthread_t thread;
+    struct datalog *log;
+    atomic_bool stop;
+    pthread_mutex_t lock;      // Guards fd and stats
+    struct repl_stats stats;
+};
+
+/**
+ * Starts serving followers of log on endpoint.
+ * Returns 0 on success, -1 if the endpoint cannot be opened.
+ */
+int repl_primary_start(struct repl_primary *p, const char *endpoint, struct datalog *log);
+
+/**
+ * Disconnects every follower and stops serving. Must be called before log
+ * is closed. A Unix socket endpoint is left in place for the caller to
+ * remove, since after a handoff it belongs to the new instance.
+ */
+void repl_primary_stop(struct repl_primary *p);
+
+/**
+ * Starts following the primary at endpoint, appending to log. The log must
+ * not take any other appends.
+ * Returns 0 on success, -1 if the thread cannot be started.
+ */
+int repl_follower_start(struct repl_follower *f, const char *endpoint, struct datalog *log);
+
+/**
+ * Disconnects from the primary and copies the final statistics to stats.
+ */
+void repl_follower_stop(struct repl_follower *f, struct repl_stats *stats);
+
+#endif
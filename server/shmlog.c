@@ -0,0 +1,70 @@
+/**
+ * shmlog.c
+ *
+ * Shared-memory append index for pre-forked workers. See shmlog.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include "shmlog.h"
+
+struct shmlog *shmlog_create(off_t size, uint64_t records, uint64_t payload) {
+    struct shmlog *shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) return NULL;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        munmap(shm, sizeof(*shm));
+        return NULL;
+    }
+
+    shm->size = size;
+    shm->records = records;
+    shm->payload = payload;
+    return shm;
+}
+
+int shmlog_lock(struct shmlog *shm, int fd) {
+    int rc = pthread_mutex_lock(&shm->lock);
+    if (rc == EOWNERDEAD) {
+        // The owner died mid-append: drop whatever it wrote past the commit
+        if (ftruncate(fd, shm->size) < 0)
+            syslog(LOG_ERR, "Failed to roll back torn append: %s", strerror(errno));
+        shm->recoveries++;
+        syslog(LOG_WARNING, "Worker died while appending, log rolled back to %llu bytes",
+               (unsigned long long)shm->size);
+        pthread_mutex_consistent(&shm->lock);
+        rc = 0;
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+void shmlog_unlock(struct shmlog *shm) {
+    pthread_mutex_unlock(&shm->lock);
+}
+
+void shmlog_commit(struct shmlog *shm, uint64_t end, uint32_t len, uint32_t worker) {
+    struct shmlog_entry *e = &shm->ring[shm->records % SHMLOG_RING];
+    e->offset = end - len;
+    e->len = len;
+    e->worker = worker;
+    shm->size = end;
+    shm->records++;
+}
+
+void shmlog_destroy(struct shmlog *shm) {
+    if (!shm) return;
+    pthread_mutex_destroy(&shm->lock);
+    munmap(shm, sizeof(*shm));
+}
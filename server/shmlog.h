@@ -0,0 +1,61 @@
+/**
+ * shmlog.h
+ *
+ * Shared-memory index of the data file for pre-forked worker processes.
+ * Appends from all workers are serialized by a robust, process-shared mutex;
+ * the committed size, record count and a ring of recent record offsets live
+ * next to it.
+ * If a worker dies while appending, the next locker truncates the file back
+ * to the last committed size, so a crash can never leave a torn record.
+ */
+
+#ifndef SHMLOG_H
+#define SHMLOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define SHMLOG_RING 4096          // Recent records kept in the index
+
+struct shmlog_entry {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t worker;
+};
+
+struct shmlog {
+    pthread_mutex_t lock;         // Robust and process-shared
+    uint64_t size;                // Committed bytes in the data file
+    uint64_t records;             // Records in the data file (checksummed files), or
+                                  // committed since startup
+    uint64_t payload;             // Record bytes in the data file, excluding headers
+    uint64_t recoveries;          // Appends rolled back after a worker died
+    struct shmlog_entry ring[SHMLOG_RING];
+};
+
+/**
+ * Maps a shared index for a data file currently size bytes long, holding
+ * records records with payload bytes of data. Must be called before forking
+ * the workers. Returns NULL on failure.
+ */
+struct shmlog *shmlog_create(off_t size, uint64_t records, uint64_t payload);
+
+/**
+ * Takes the append lock. If its previous owner died, the data file behind
+ * fd is truncated to the committed size before the lock is marked
+ * consistent again. Returns 0 on success, -1 on failure.
+ */
+int shmlog_lock(struct shmlog *shm, int fd);
+
+void shmlog_unlock(struct shmlog *shm);
+
+/**
+ * Records a completed append of len bytes, header included, ending at end.
+ * Called with the lock held; the caller updates payload.
+ */
+void shmlog_commit(struct shmlog *shm, uint64_t end, uint32_t len, uint32_t worker);
+
+void shmlog_destroy(struct shmlog *shm);
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * timewheel.c
+ *
+ * Hierarchical timing wheel. See timewheel.h.
+ */
+
+#include <string.h>
+#include "timewheel.h"
+
+#define LEVEL_SHIFT(level) (TIMEWHEEL_BITS * (level))
+#define WHEEL_REACH (1ull << LEVEL_SHIFT(TIMEWHEEL_LEVELS))
+
+void timewheel_init(struct timewheel *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+/**
+ * place
+ * -----
+ * Links t into the slot for its expiry: on the lowest level whose slots
+ * span its distance from now, so it moves down a level each time that
+ * level's slot comes round, until it reaches level 0 in its own tick.
+ */
+static void place(struct timewheel *w, struct timer *t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < TIMEWHEEL_LEVELS - 1 && delta >= 1ull << LEVEL_SHIFT(level + 1)) level++;
+
+    struct timer **head = &w->slots[level][(t->expires >> LEVEL_SHIFT(level)) &
+                                           (TIMEWHEEL_SLOTS - 1)];
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+void timer_add(struct timewheel *w, struct timer *t, uint64_t expires) {
+    if (expires <= w->now) expires = w->now + 1;
+    if (expires - w->now >= WHEEL_REACH) expires = w->now + WHEEL_REACH - 1;
+    t->expires = expires;
+    place(w, t);
+    w->count++;
+}
+
+void timer_del(struct timewheel *w, struct timer *t) {
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    w->count--;
+}
+
+size_t timewheel_advance(struct timewheel *w, uint64_t now,
+                         void (*fire)(struct timer *t, void *arg), void *arg) {
+    size_t fired = 0;
+    // Nothing to visit on the way
+    if (w->count == 0 && now > w->now) w->now = now;
+
+    while (w->now < now) {
+        w->now++;
+
+        // Higher levels whose slot comes round hand their timers down,
+        // topmost first so none lands in a slot already emptied this tick
+        int top = 0;
+        while (top < TIMEWHEEL_LEVELS - 1 &&
+               (w->now & ((1ull << LEVEL_SHIFT(top + 1)) - 1)) == 0)
+            top++;
+        for (int level = top; level > 0; --level) {
+            struct timer **head = &w->slots[level][(w->now >> LEVEL_SHIFT(level)) &
+                                                   (TIMEWHEEL_SLOTS - 1)];
+            struct timer *t = *head;
+            *head = NULL;
+            while (t) {
+                struct timer *next = t->next;
+                place(w, t);
+                t = next;
+            }
+        }
+
+        struct timer **head = &w->slots[0][w->now & (TIMEWHEEL_SLOTS - 1)];
+        struct timer *t = *head;
+        *head = NULL;
+        while (t) {
+            // The rest of the list hangs off next, so fire may still
+            // unschedule any timer in it
+            struct timer *next = t->next;
+            if (next) next->pprev = &next;
+            t->next = NULL;
+            t->pprev = NULL;
+            w->count--;
+            fired++;
+            fire(t, arg);
+            t = next;
+        }
+    }
+    return fired;
+}
@@ -0,0 +1,68 @@
+/**
+ * timewheel.h
+ *
+ * Hierarchical timing wheel for connection timeouts. Time advances in
+ * ticks; a timer sits in one of TIMEWHEEL_SLOTS slots on the level whose
+ * span covers its distance from now, and is cascaded to a lower level when
+ * the wheel turns past it. Adding, removing and firing a timer are O(1),
+ * and a tick only visits the timers due in it, so the wheel costs the
+ * same per tick with ten connections as with a hundred thousand, and
+ * needs a single timeout (the main loop's epoll_wait) for all of them.
+ *
+ * The wheel is not locked: it belongs to one thread.
+ */
+
+#ifndef TIMEWHEEL_H
+#define TIMEWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMEWHEEL_BITS 6
+#define TIMEWHEEL_SLOTS (1u << TIMEWHEEL_BITS)
+#define TIMEWHEEL_LEVELS 4                 // Timers up to 2^24 ticks ahead
+
+// A timer, embedded in whatever it times out; all zero when idle
+struct timer {
+    struct timer *next;
+    struct timer **pprev;                  // NULL while not scheduled
+    uint64_t expires;                      // Tick it fires in
+};
+
+struct timewheel {
+    uint64_t now;                          // Last tick processed
+    size_t count;                          // Timers scheduled
+    struct timer *slots[TIMEWHEEL_LEVELS][TIMEWHEEL_SLOTS];
+};
+
+/**
+ * Empties the wheel, with now as its current tick.
+ */
+void timewheel_init(struct timewheel *w, uint64_t now);
+
+/**
+ * Schedules t, which must not be scheduled already, to fire in tick
+ * expires. A tick that has passed fires in the next one; one beyond the
+ * wheel's reach fires at its edge.
+ */
+void timer_add(struct timewheel *w, struct timer *t, uint64_t expires);
+
+/**
+ * Unschedules t if it is scheduled.
+ */
+void timer_del(struct timewheel *w, struct timer *t);
+
+static inline bool timer_pending(const struct timer *t) {
+    return t->pprev != NULL;
+}
+
+/**
+ * Advances the wheel to tick now, calling fire(t, arg) for every timer due
+ * by then, unscheduled first, so fire may add it again.
+ * Returns the number of timers fired.
+ */
+size_t timewheel_advance(struct timewheel *w, uint64_t now,
+                         void (*fire)(struct timer *t, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,22 @@
+/**
+ * xxhash.h
+ *
+ * XXH64, the 64-bit xxHash. Input is consumed 32 bytes at a time by four
+ * independent accumulator lanes, which the CPU (or the compiler's
+ * vectorizer) keeps in flight at once, so large buffers hash at several
+ * GB/s. It is no cryptographic hash: callers that act on a match compare
+ * the bytes as well.
+ */
+
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Returns the XXH64 hash of len bytes of buf with the given seed.
+ */
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed);
+
+#endif